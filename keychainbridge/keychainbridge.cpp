@@ -31,6 +31,18 @@
 
 #include "keychainbridge.h"
 #include "keychainbridgegui.h"
+#include "keychainbridgewallet.h"
+#include "keychainbridgebackend.h"
+#include "keychainbridgedialogfilter.h"
+#include "keychainbridgeheadless.h"
+#include "keychainbridgecredentials.h"
+#include "keychainbridgemetrics.h"
+#include "keychainbridgenotifier.h"
+#include "keychainbridgereadahead.h"
+#include "keychainbridgeretry.h"
+#include "keychainbridgesettings.h"
+#include "keychainbridgelog.h"
+#include "keychainbridgetrace.h"
 
 //
 // Qt4 Related Includes
@@ -39,14 +51,9 @@
 #include <QAction>
 #include <QToolBar>
 #include <QMessageBox>
-#include <QSettings>
 #include <QLineEdit>
-#include <QPushButton>
-#include <QLabel>
-#include <QHBoxLayout>
 #include <QInputDialog>
 #include <QTimer>
-#include <QStackedWidget>
 
 // QtKeyChain library
 #include "qtkeychain/keychain.h"
@@ -57,6 +64,7 @@
 #include "qgscredentialdialog.h"
 #include "qgsmessagelog.h"
 #include "qgsmessagebar.h"
+#include "qgsproject.h"
 
 
 
@@ -69,6 +77,7 @@ static const QString sPluginVersion = QObject::tr( "Version 0.1" );
 static const QgisPlugin::PLUGINTYPE sPluginType = QgisPlugin::UI;
 static const QString sPluginIcon = ":/keychainbridge/keychainbridge.svg";
 const QLatin1String KeyChainBridge::sMasterPasswordName( "QGIS-Master-Password" );
+const QLatin1String KeyChainBridge::sBundleName( "QGIS-Master-Password-Bundle" );
 const QLatin1String KeyChainBridge::sWalletFolderName( "QGIS" );
 
 #if defined(Q_OS_MAC)
@@ -100,8 +109,8 @@ static const QString sDescription = QObject::tr( "Master Password <-> KeyChain s
 KeyChainBridge::KeyChainBridge( QgisInterface * theQgisInterface ):
     QgisPlugin( sName, sDescription, sCategory, sPluginVersion, sPluginType ),
     mQGisIface( theQgisInterface ),
-    mUseWallet( true ),
-    mMasterPassword( "" ),
+    mAboutAction( nullptr ),
+    mSettings( nullptr ),
     mVerificationError( false ),
     mErrorMessage( "" ),
     mErrorCode( QKeychain::NoError ),
@@ -111,48 +120,146 @@ KeyChainBridge::KeyChainBridge( QgisInterface * theQgisInterface ):
     mLoggingEnabledAction( nullptr ),
     mSaveMasterPasswordAction( nullptr ),
     mClearMasterPasswordAction( nullptr ),
-    mLoggingEnabled( false ),
-    mFailedInit( false )
+    mPrefetchEnabledAction( nullptr ),
+    mDumpMetricsAction( nullptr ),
+    mFailedInit( false ),
+    mInitialized( false ),
+    mLoadTime( 0 ),
+    mWallet( nullptr ),
+    mDialogFilter( nullptr ),
+    mCredentials( nullptr ),
+    mReadAhead( nullptr ),
+    mNotifier( nullptr ),
+    mInjectionPending( false ),
+    mMigrationPending( false ),
+    mUnlockWaiting( false ),
+    mSkipDialogRead( false ),
+    mUnlockPrefetched( false ),
+    mBundleLoaded( false ),
+    mPendingMember( nullptr ),
+    mBundleWrites( 0 )
 {
+  QElapsedTimer loadTimer;
+  loadTimer.start();
+  KeyChainBridgeLog::setTag( name() );
+
   // Read settings
-  readSettings();
+  mSettings = new KeyChainBridgeSettings( name(), this );
+  applyLogSettings();
+
+  mUnlockDeadline.setSingleShot( true );
+  connect( &mUnlockDeadline, SIGNAL( timeout() ), &mUnlockLoop, SLOT( quit() ) );
+
+  mNotifier = new KeyChainBridgeNotifier( messageBar(), this );
+  connect( mNotifier, SIGNAL( promptAccepted() ), this, SLOT( on_saveMasterPassword_triggered() ) );
 
   // Connect to Auth Manager
   mAuthManager = QgsAuthManager::instance();
+  mReadAhead = new KeyChainBridgeReadAhead( mAuthManager );
   if ( mAuthManager && ! mAuthManager->isDisabled() )
   {
-    connect( mAuthManager, SIGNAL( masterPasswordVerified( bool ) ), this, SLOT( masterPasswordVerified( bool ) ) ) ;
+    connect( QgsProject::instance(), SIGNAL( layerLoaded( int, int ) ), this, SLOT( projectLayerLoaded( int, int ) ) );
 
     QgsCredentialDialog* credentials = dynamic_cast<QgsCredentialDialog*>( QgsCredentials::instance() );
 
     if ( !credentials )
     {
       mFailedInit = true;
-      mQGisIface->messageBar()->pushWarning( tr( "Master Password &lt;--&gt; %1" ).arg( sWalletDisplayName ),
-                                             tr( "plugin could not be loaded" ) );
+      mNotifier->notify( KeyChainBridgeNotifier::Warning, tr( "Master Password &lt;--&gt; %1" ).arg( sWalletDisplayName ),
+                         tr( "plugin could not be loaded" ) );
       qDebug( "Credentials dialog could not be cast from QgsCredentials instance" );
       return;
     }
-    credentials->installEventFilter( this );
-    connect( credentials, SIGNAL( accepted() ), this, SLOT( credentialsDialogAccepted() ) );
-
-    // Sync if the authm is open
-    if ( mAuthManager->masterPasswordIsSet() )
+    // Answer master password requests before the dialog is even built
+    mCredentials = new KeyChainBridgeCredentials( credentials, this );
+    mCredentials->setTimeToLive( mSettings->value( KeyChainBridgeSettings::MasterPasswordTtl ).toInt() );
+    mCredentials->setIdleTimeout( mSettings->value( KeyChainBridgeSettings::MasterPasswordIdleTimeout ).toInt() );
+    connect( mCredentials, SIGNAL( masterPasswordServed() ), this, SLOT( credentialsMasterPasswordServed() ) );
+    connect( mCredentials, SIGNAL( masterPasswordExpired() ), this, SLOT( credentialsMasterPasswordExpired() ) );
+    connect( mCredentials, SIGNAL( masterPasswordMissing() ), this, SLOT( credentialsMasterPasswordMissing() ), Qt::DirectConnection );
+
+    if ( mSettings->deferredInit() )
     {
-      askSaveMasterPassword( tr( "Do you want to store your master password now?" ) );
+      // Queued from other threads: done before the dialog is shown there
+      connect( mCredentials, SIGNAL( credentialsRequested() ), this, SLOT( initialize() ) );
+    }
+    else
+    {
+      initialize();
     }
   }
   else
   {
     mFailedInit = true;
     qDebug( "Authentication manager is disabled" );
-    debug( tr( "Authentication manager is disabled." ) );
+    KEYCHAINBRIDGE_WARNING( Plugin, tr( "Authentication manager is disabled." ) );
     return;
-  }}
+  }
+  mLoadTime = loadTimer.nsecsElapsed() / 1000;
+}
 
 KeyChainBridge::~KeyChainBridge()
 {
-  writeSettings();
+  delete mReadAhead;
+}
+
+void KeyChainBridge::initialize()
+{
+  if ( mInitialized || mFailedInit )
+  {
+    return;
+  }
+  mInitialized = true;
+  disconnect( mCredentials, SIGNAL( credentialsRequested() ), this, SLOT( initialize() ) );
+  QElapsedTimer timer;
+  timer.start();
+
+  mWallet = new KeyChainBridgeWallet( sWalletFolderName, KeyChainBridgeBackend::create( *mSettings ), this );
+  mWallet->retryScheduler()->setMaxRetries( mSettings->value( KeyChainBridgeSettings::WalletRetries ).toInt() );
+  mWallet->retryScheduler()->setOpenInterval( mSettings->value( KeyChainBridgeSettings::WalletRetryInterval ).toInt() );
+  mWallet->setTimeout( mSettings->value( KeyChainBridgeSettings::WalletTimeout ).toInt() );
+
+  connect( mAuthManager, SIGNAL( masterPasswordVerified( bool ) ), this, SLOT( masterPasswordVerified( bool ) ) ) ;
+  connect( mAuthManager, SIGNAL( authDatabaseChanged() ), this, SLOT( authDatabaseChanged() ) ) ;
+
+  QgsCredentialDialog* credentials = dynamic_cast<QgsCredentialDialog*>( mCredentials->fallback() );
+  mDialogFilter = new KeyChainBridgeDialogFilter( credentials, this );
+  connect( mDialogFilter, SIGNAL( masterPasswordRequested() ), this, SLOT( credentialsDialogMasterPasswordRequested() ) );
+  connect( credentials, SIGNAL( accepted() ), this, SLOT( credentialsDialogAccepted() ) );
+
+  setActionIcons();
+
+  // Sync if the authm is open
+  if ( mAuthManager->masterPasswordIsSet() )
+  {
+    askSaveMasterPassword( tr( "Do you want to store your master password now?" ) );
+  }
+  // Get it before QGIS asks for it
+  else if ( prefetchEnabled() )
+  {
+    prefetchMasterPassword();
+  }
+
+  KeyChainBridgeMetrics::instance()->record( KeyChainBridgeMetrics::Initialization, timer.nsecsElapsed() / 1000 );
+  KeyChainBridgeTrace::instance()->record( KeyChainBridgeTrace::Initialized, 0, timer.nsecsElapsed() / 1000 );
+  KEYCHAINBRIDGE_DEBUG( Plugin, QString( "Initialized in %1 ms." ).arg( timer.nsecsElapsed() / 1000000.0, 0, 'f', 2 ) );
+}
+
+void KeyChainBridge::setActionIcons()
+{
+  // Loading the icons pulls in the SVG icon engine: not at startup
+  if ( mAboutAction )
+  {
+    mAboutAction->setIcon( QIcon( ":/keychainbridge/keychainbridge.svg" ) );
+  }
+  if ( mSaveMasterPasswordAction )
+  {
+    mSaveMasterPasswordAction->setIcon( QIcon( ":/keychainbridge/save.svg" ) );
+  }
+  if ( mClearMasterPasswordAction )
+  {
+    mClearMasterPasswordAction->setIcon( QIcon( ":/keychainbridge/trashcan.svg" ) );
+  }
 }
 
 /*
@@ -161,9 +268,11 @@ KeyChainBridge::~KeyChainBridge()
  */
 void KeyChainBridge::initGui()
 {
+  QElapsedTimer loadTimer;
+  loadTimer.start();
 
   // Create the action for tool
-  mAboutAction = new QAction( QIcon( ":/keychainbridge/keychainbridge.svg" ), tr( "About plugin" ), this );
+  mAboutAction = new QAction( tr( "About plugin" ), this );
   mAboutAction->setObjectName( "KeyChainQActionPointer" );
   // Set the what's this text
   mAboutAction->setWhatsThis( tr( "Store the master password in your %1" ).arg( sWalletDisplayName ) );
@@ -171,12 +280,16 @@ void KeyChainBridge::initGui()
   connect( mAboutAction, SIGNAL( triggered() ), this, SLOT( about() ) );
   mQGisIface->addPluginToMenu( sName, mAboutAction );
 
-  mSaveMasterPasswordAction = new QAction( QIcon( ":/keychainbridge/save.svg" ), tr( "Store/update the master password in your %1" ).arg( sWalletDisplayName ), mQGisIface->mainWindow() );
-  connect( mSaveMasterPasswordAction, SIGNAL( triggered() ), this, SLOT( on_saveMasterPassword_triggered() ) );
-  mQGisIface->addPluginToMenu( sName, mSaveMasterPasswordAction );
-  mClearMasterPasswordAction = new QAction( QIcon( ":/keychainbridge/trashcan.svg" ), tr( "Clear the master password from your %1" ).arg( sWalletDisplayName ), mQGisIface->mainWindow() );
-  connect( mClearMasterPasswordAction, SIGNAL( triggered() ), this, SLOT( on_deleteMasterPassword_triggered() ) );
-  mQGisIface->addPluginToMenu( sName, mClearMasterPasswordAction );
+  // Without a wallet there is nothing to store or clear
+  if ( ! mFailedInit )
+  {
+    mSaveMasterPasswordAction = new QAction( tr( "Store/update the master password in your %1" ).arg( sWalletDisplayName ), mQGisIface->mainWindow() );
+    connect( mSaveMasterPasswordAction, SIGNAL( triggered() ), this, SLOT( on_saveMasterPassword_triggered() ) );
+    mQGisIface->addPluginToMenu( sName, mSaveMasterPasswordAction );
+    mClearMasterPasswordAction = new QAction( tr( "Clear the master password from your %1" ).arg( sWalletDisplayName ), mQGisIface->mainWindow() );
+    connect( mClearMasterPasswordAction, SIGNAL( triggered() ), this, SLOT( on_deleteMasterPassword_triggered() ) );
+    mQGisIface->addPluginToMenu( sName, mClearMasterPasswordAction );
+  }
 
   mUseWalletAction = new QAction( tr( "Enable the integration with the %1" ).arg( sWalletDisplayName ), mQGisIface->mainWindow() );
   mUseWalletAction->setCheckable( true );
@@ -186,10 +299,30 @@ void KeyChainBridge::initGui()
 
   mLoggingEnabledAction = new QAction( tr( "Enable logging" ), mQGisIface->mainWindow() );
   mLoggingEnabledAction->setCheckable( true );
-  mLoggingEnabledAction->setChecked( mLoggingEnabled );
+  mLoggingEnabledAction->setChecked( loggingEnabled() );
   connect( mLoggingEnabledAction, SIGNAL( changed() ), this, SLOT( on_loggingEnabled_changed() ) );
   mQGisIface->addPluginToMenu( sName, mLoggingEnabledAction );
 
+  mPrefetchEnabledAction = new QAction( tr( "Read the master password from the %1 at startup" ).arg( sWalletDisplayName ), mQGisIface->mainWindow() );
+  mPrefetchEnabledAction->setCheckable( true );
+  mPrefetchEnabledAction->setChecked( prefetchEnabled() );
+  connect( mPrefetchEnabledAction, SIGNAL( changed() ), this, SLOT( on_prefetchEnabled_changed() ) );
+  mQGisIface->addPluginToMenu( sName, mPrefetchEnabledAction );
+
+  mDumpMetricsAction = new QAction( tr( "Dump statistics to the log" ), mQGisIface->mainWindow() );
+  connect( mDumpMetricsAction, SIGNAL( triggered() ), this, SLOT( on_dumpMetrics_triggered() ) );
+  mQGisIface->addPluginToMenu( sName, mDumpMetricsAction );
+
+  if ( mInitialized )
+  {
+    setActionIcons();
+  }
+
+  // The plugin's share of the QGIS startup time
+  mLoadTime += loadTimer.nsecsElapsed() / 1000;
+  KeyChainBridgeMetrics::instance()->record( KeyChainBridgeMetrics::PluginLoad, mLoadTime );
+  KEYCHAINBRIDGE_DEBUG( Plugin, QString( "Loaded in %1 ms%2." ).arg( mLoadTime / 1000.0, 0, 'f', 2 )
+                        .arg( mInitialized ? QString() : QString( ", initialization deferred" ) ) );
 }
 
 /*
@@ -200,79 +333,100 @@ void KeyChainBridge::initGui()
  */
 void KeyChainBridge::masterPasswordVerified( bool verified )
 {
-  debug( QString( tr( "KeyChainBridge::masterPasswordVerified called %1." ) ).arg( verified ) );
+  KEYCHAINBRIDGE_DEBUG( Verification, QString( tr( "KeyChainBridge::masterPasswordVerified called %1." ) ).arg( verified ) );
+  KeyChainBridgeTrace::instance()->record( KeyChainBridgeTrace::Verified, verified );
   if ( pluginIsEnabled() )
   {
     mVerificationError = ! verified;
+    // Do not serve a rejected password again: next request goes to the dialog
+    if ( ! verified )
+    {
+      mCredentials->clearMasterPassword();
+    }
+    if ( ! verified && ! isDirty() && ! masterPassword().isEmpty() )
+    {
+      setErrorMessage( tr( "It seems like the password stored in the %1 is no longer valid." ).arg( sWalletDisplayName ) );
+      showWarning();
+      setIsDirty( true );
+      setMasterPassword( "", false );
+    }
     // Check if the cached password is still valid
     if ( verified && ! isDirty() && ! masterPassword().isEmpty() && ! passwordIsSame( masterPassword() ) )
     {
       setIsDirty( true );
       askSaveMasterPassword( tr( "Master password stored in the %1 is not valid anymore, do you want to update it now?" ).arg( sWalletDisplayName ) );
     }
+    // Read from the entry of older versions: now it can go in the bundle
+    if ( verified && mMigrationPending && ! isDirty() && passwordIsSame( masterPassword() ) )
+    {
+      KEYCHAINBRIDGE_DEBUG( Wallet, "Moving the master password to the bundle ..." );
+      storeMasterPassword( masterPassword() );
+    }
+    mMigrationPending = false;
     // Check if we have a valid password and we need to store it in the wallet
     if ( verified && isDirty() && passwordIsSame( masterPassword() ) )
     {
-      if ( storeMasterPassword( masterPassword() ) )
-      {
-        setIsDirty( false ); // Password is synced!
-        showInfo( tr( "Master password has been successfully stored in your %1." ).arg( sWalletDisplayName ) );
-      }
-      else
-      {
-        showWarning( );
-      }
+      // Password is synced when masterPasswordStored() succeeds
+      storeMasterPassword( masterPassword() );
     }
   }
 }
 
 void KeyChainBridge::credentialsDialogAccepted()
 {
-  QgsCredentialDialog* credentials = static_cast<QgsCredentialDialog*>( QgsCredentials::instance() );
-  QLineEdit* leMasterPass =  credentials->findChild<QLineEdit*>( "leMasterPass" );
-  QString password = leMasterPass->text();
+  QLineEdit* leMasterPass = mDialogFilter->masterPasswordEdit();
+  QString password = leMasterPass ? leMasterPass->text() : QString();
   if ( ! password.isEmpty() )
   {
-    setIsDirty( mMasterPassword != password );
-    mMasterPassword = password;
-    debug( tr( "Password has been captured successfully." ) );
+    setIsDirty( ! mMasterPassword.equals( password ) );
+    setMasterPassword( password, false );
+    KEYCHAINBRIDGE_DEBUG( Dialog, tr( "Password has been captured successfully." ) );
   }
   else
   {
-    debug( tr( "Could not capture the password." ) );
+    KEYCHAINBRIDGE_DEBUG( Dialog, tr( "Could not capture the password." ) );
   }
 }
 
 void KeyChainBridge::on_saveMasterPassword_triggered()
 {
+  initialize();
+  if ( ! mWallet )
+  {
+    setErrorMessage( tr( "The %1 is not available." ).arg( sWalletDisplayName ) );
+    showError( );
+    return;
+  }
   saveMasterPassword();
 }
 
 void KeyChainBridge::on_deleteMasterPassword_triggered()
 {
+  initialize();
+  if ( ! mWallet )
+  {
+    setErrorMessage( tr( "The %1 is not available." ).arg( sWalletDisplayName ) );
+    showError( );
+    return;
+  }
   if ( QMessageBox::Yes == QMessageBox::question( nullptr,
                                                  tr( "Delete confirmation" ),
                                                  tr( "Do you really want to remove the master password from your %1?" ).arg( sWalletDisplayName ),
                                                  QMessageBox::Yes|QMessageBox::No) )
   {
-    bool ok = deleteMasterPassword();
-    mMasterPassword = "";
+    deleteMasterPassword();
+    setMasterPassword( "", false );
     setIsDirty( true );
-    if ( ok )
-    {
-      showInfo( tr( "The master password has been successfully removed from your %1." ).arg( sWalletDisplayName ) );
-    }
-    else
-    {
-      showWarning();
-    }
   }
 }
 
 void KeyChainBridge::on_useWallet_changed()
 {
   setUseWallet( mUseWalletAction->isChecked() );
-  writeSettings();
+  if ( ! useWallet() && mCredentials )
+  {
+    mCredentials->clearMasterPassword();
+  }
   showInfo( useWallet() ? tr( "Your %1 will be <b>used from now</b> on to store and retrieve the master password." ).arg( sWalletDisplayName ) :
             tr( "Your %1 will <b>not be used anymore</b> to store and retrieve the master password." ).arg( sWalletDisplayName ) );
 }
@@ -280,33 +434,74 @@ void KeyChainBridge::on_useWallet_changed()
 void KeyChainBridge::on_loggingEnabled_changed()
 {
   setLoggingEnabled( mLoggingEnabledAction->isChecked() );
-  writeSettings();
   showInfo( loggingEnabled( ) ? tr( "Logging is now <b>enabled</b>" ) :
             tr( "Logging is now <b>disabled</b>" ) );
 }
 
-bool KeyChainBridge::deleteMasterPassword()
+void KeyChainBridge::on_dumpMetrics_triggered()
 {
-  debug( "Opening wallet for DELETE ..." );
-  QKeychain::DeletePasswordJob job( sWalletFolderName );
-  job.setAutoDelete( false );
-  job.setKey( sMasterPasswordName );
-  QEventLoop loop;
-  job.connect( &job, SIGNAL( finished( QKeychain::Job* ) ), &loop, SLOT( quit() ) );
-  job.start();
-  loop.exec();
-  if ( job.error() )
+  // On demand: logged even if logging is disabled
+  QgsMessageLog::logMessage( tr( "Statistics:\n%1" ).arg( KeyChainBridgeMetrics::instance()->toString() ), name() );
+  if ( KeyChainBridgeTrace::instance()->flush() )
   {
-    setErrorCode( job.error() );
-    setErrorMessage( QString( tr( "Delete password failed: %1." ) ).arg( job.errorString() ) );
-    setIsDirty( true );
-    return false;
+    showInfo( tr( "Statistics have been written to the log, the trace to %1" ).arg( KeyChainBridgeTrace::defaultFileName() ) );
+  }
+  else
+  {
+    showInfo( tr( "Statistics have been written to the log" ) );
+  }
+}
+
+void KeyChainBridge::on_prefetchEnabled_changed()
+{
+  setPrefetchEnabled( mPrefetchEnabledAction->isChecked() );
+  showInfo( prefetchEnabled( ) ? tr( "The master password will be <b>read at startup</b>" ) :
+            tr( "The master password will be <b>read when needed</b>" ) );
+}
+
+void KeyChainBridge::deleteMasterPassword()
+{
+  if ( ! mWallet )
+  {
+    KEYCHAINBRIDGE_WARNING( Wallet, tr( "The %1 is not available." ).arg( sWalletDisplayName ) );
+    return;
+  }
+  // A pending read would bring the deleted password back
+  mWallet->cancel( mReadJob );
+  // Nor may it be found again under a previous path of the auth DB, only
+  // this DB's own key and record are removed
+  QString authDbId( KeyChainBridgeBundle::authDbIdentity( mAuthManager->authenticationDbPath() ) );
+  if ( ! authDbId.isEmpty() )
+  {
+    mPendingSecrets.insert( KeyChainBridgeBundle::authDbName( authDbId ), QString() );
+  }
+  // The entry is deleted when no other secret is left
+  updateBundle( masterPasswordKey(), QString(), SLOT( masterPasswordDeleted( KeyChainBridgeWalletJob* ) ) );
+  // Or the next read would fall back to the copy of older versions
+  mWallet->deletePassword( sMasterPasswordName, nullptr, nullptr );
+}
+
+void KeyChainBridge::masterPasswordDeleted( KeyChainBridgeWalletJob *job )
+{
+  --mBundleWrites;
+  if ( job->state() == KeyChainBridgeWalletJob::Cancelled )
+  {
+    return;
+  }
+  // Whatever the outcome, the wallet is not in sync with the (cleared) memory
+  setIsDirty( true );
+  if ( job->error() )
+  {
+    // Read the entry again before the next change
+    mBundleLoaded = false;
+    setErrorCode( job->error() );
+    setErrorMessage( QString( tr( "Delete password failed: %1." ) ).arg( job->errorString() ) );
+    showWarning();
   }
   else
   {
-    setIsDirty( false );
     clearErrors();
-    return true;
+    showInfo( tr( "The master password has been successfully removed from your %1." ).arg( sWalletDisplayName ) );
   }
 }
 
@@ -314,127 +509,209 @@ bool KeyChainBridge::deleteMasterPassword()
  * Here it is the core plugin functionality:
  * Inject the password into the credentials dialog and accept it
  */
-bool KeyChainBridge::eventFilter( QObject *obj, QEvent *event )
+void KeyChainBridge::credentialsDialogMasterPasswordRequested()
 {
+  KeyChainBridgeTrace::instance()->record( KeyChainBridgeTrace::DialogShown );
   // Don't even try!
   if ( ! pluginIsEnabled() )
   {
-    return QObject::eventFilter( obj, event );
+    return;
   }
 
-  QgsCredentialDialog* credentials = qobject_cast<QgsCredentialDialog*>( obj );
-  Q_ASSERT( credentials );
-  QStackedWidget* stackedWidget =  credentials->findChild<QStackedWidget*>( "stackedWidget" );
-  Q_ASSERT( stackedWidget );
+  // The wallet has just been read in vain, before the dialog was shown
+  if ( mSkipDialogRead )
+  {
+    mSkipDialogRead = false;
+    return;
+  }
 
-  // Dialog is about to be shown: QGIS wants a master password
-  if ( stackedWidget->currentIndex() == 1 &&
-       event->type() == QEvent::Show )
+  // If there was an error, we do not want to enter this pwd again, and again ...
+  if ( ! mVerificationError )
   {
-    // If there was an error, we do not want to enter this pwd again, and again ...
-    if ( ! mVerificationError )
+    mUnlockTimer.start();
+    // Already read from the wallet: no need to wait for it
+    mUnlockPrefetched = mCredentials->hasMasterPassword();
+    if ( mUnlockPrefetched )
     {
-      // Retrieve master password from wallet
-      mMasterPassword = readMasterPassword();
-      if ( errorCode() == QKeychain::NoError )
-      {
-        setIsDirty( false );
-        QLineEdit* leMasterPass =  credentials->findChild<QLineEdit*>( "leMasterPass" );
-        // Hackish!!!
-        if ( leMasterPass->styleSheet() != "QLineEdit{color: rgb(200, 0, 0);}" )
-        {
-          leMasterPass->setText( mMasterPassword );
-          QTimer::singleShot( 0, credentials, SLOT( accept() ) );
-          showInfo( tr( "Master password has been successfully retrieved from %1 and inserted into the form!" ).arg( sWalletDisplayName ) );
-        }
-        else
-        {
-          setErrorMessage( tr( "It seems like the password stored in the %1 is no longer valid." ).arg( sWalletDisplayName ) );
-          showWarning();
-          setIsDirty( true );
-          mMasterPassword = "";
-        }
-      }
-      else   // We've got an error
-      {
-        // Process the error
-        processError();
-      }
+      injectMasterPassword();
+    }
+    else
+    {
+      // Retrieve master password from wallet (or wait for the prefetch to
+      // complete), the password is injected as soon as the wallet answers
+      mInjectionPending = true;
+      readMasterPassword();
     }
-    return QObject::eventFilter( obj, event );
-  }
-  else
-  {
-    // standard event processing
-    return QObject::eventFilter( obj, event );
   }
 }
 
-void KeyChainBridge::debug( QString msg )
+bool KeyChainBridge::useWallet()
 {
-  if ( loggingEnabled( ) )
-  {
-    QgsMessageLog::logMessage( msg, name() );
-  }
+  return mSettings->useWallet();
+}
+
+void KeyChainBridge::setUseWallet( bool useWallet )
+{
+  mSettings->setUseWallet( useWallet );
+}
+
+bool KeyChainBridge::loggingEnabled()
+{
+  return mSettings->loggingEnabled();
+}
+
+void KeyChainBridge::setLoggingEnabled( bool loggingEnabled )
+{
+  mSettings->setLoggingEnabled( loggingEnabled );
+  applyLogSettings();
+}
+
+QString KeyChainBridge::backendName()
+{
+  return mSettings->backend();
+}
+
+bool KeyChainBridge::prefetchEnabled()
+{
+  return mSettings->prefetchEnabled();
 }
 
-void KeyChainBridge::readSettings()
+void KeyChainBridge::setPrefetchEnabled( bool prefetchEnabled )
 {
-  QSettings settings;
-  setUseWallet( settings.value( QString( "%1/useWallet" ).arg( name() ), true ).toBool() );
-  setLoggingEnabled( settings.value( QString( "%1/loggingEnabled" ).arg( name() ), false ).toBool() );
+  mSettings->setPrefetchEnabled( prefetchEnabled );
 }
 
-void KeyChainBridge::writeSettings()
+void KeyChainBridge::applyLogSettings()
 {
-  QSettings settings;
-  settings.setValue( QString( "%1/useWallet" ).arg( name() ), useWallet( ) );
-  settings.setValue( QString( "%1/loggingEnabled" ).arg( name() ), loggingEnabled( ) );
+  // Not exposed in the GUI: fine tuning of the logging
+  KeyChainBridgeLog::Level level = static_cast<KeyChainBridgeLog::Level>( qBound( static_cast<int>( KeyChainBridgeLog::Debug ), mSettings->logLevel(), static_cast<int>( KeyChainBridgeLog::Disabled ) ) );
+  KeyChainBridgeLog::setCategories( mSettings->logCategories() );
+  KeyChainBridgeLog::setLevel( loggingEnabled() ? level : KeyChainBridgeLog::Disabled );
+}
+
+QgsMessageBar *KeyChainBridge::messageBar()
+{
+  return mQGisIface ? mQGisIface->messageBar() : nullptr;
+}
+
+void KeyChainBridge::setIsDirty( bool dirty )
+{
+  if ( dirty != mIsDirty )
+  {
+    KeyChainBridgeTrace::instance()->record( KeyChainBridgeTrace::DirtyChanged, dirty );
+  }
+  mIsDirty = dirty;
 }
 
 bool KeyChainBridge::pluginIsEnabled()
 {
-  return useWallet( ) && ! mAuthManager->isDisabled();
+  return ! mFailedInit && useWallet( ) && ! mAuthManager->isDisabled();
 }
 
 void KeyChainBridge::askSaveMasterPassword( QString message )
 {
-  QWidget *wdg = new QWidget( mQGisIface->mainWindow() );
-  QHBoxLayout *hlay = new QHBoxLayout( wdg );
-  QLabel *lbl = new QLabel( message, wdg );
-  hlay->addWidget( lbl );
-  QPushButton *btn1 = new QPushButton( tr( "Store/Update" ), wdg );
-  connect( btn1, SIGNAL( clicked() ), this, SLOT( on_saveMasterPassword_triggered() ) );
-  hlay->addWidget( btn1 );
-  mQGisIface->messageBar()->pushWidget( wdg );
+  if ( ! mNotifier->messageBar() )
+  {
+    KEYCHAINBRIDGE_INFO( Plugin, message );
+    return;
+  }
+  // A single prompt, updated if already shown
+  mNotifier->prompt( message, tr( "Store/Update" ) );
 }
 
-bool KeyChainBridge::passwordIsSame( QString password )
+bool KeyChainBridge::passwordIsSame( const KeyChainBridgeSecret &password )
 {
+  QElapsedTimer timer;
+  timer.start();
+  // The auth manager takes a QString
+  QString plain( password.toString() );
   // Note that this may fail if the DB is not open
-  return mAuthManager->masterPasswordSame( password );
+  bool same = mAuthManager->masterPasswordSame( plain );
+  KeyChainBridgeSecret::wipe( plain );
+  KeyChainBridgeMetrics::instance()->record( KeyChainBridgeMetrics::Verification, timer.nsecsElapsed() / 1000 );
+  return same;
+}
+
+void KeyChainBridge::readMasterPassword()
+{
+  // Already on its way
+  if ( mReadJob )
+  {
+    return;
+  }
+  if ( ! mWallet )
+  {
+    KEYCHAINBRIDGE_WARNING( Wallet, tr( "The %1 is not available." ).arg( sWalletDisplayName ) );
+    return;
+  }
+  KEYCHAINBRIDGE_DEBUG( Wallet, "Opening wallet for READ ..." );
+  mReadJob = mWallet->readPassword( sBundleName, this, SLOT( masterPasswordRead( KeyChainBridgeWalletJob* ) ) );
+}
+
+void KeyChainBridge::masterPasswordRead( KeyChainBridgeWalletJob *job )
+{
+  QString password;
+  if ( job->state() != KeyChainBridgeWalletJob::Cancelled &&
+       ( ! job->error() || job->error() == QKeychain::EntryNotFound ) )
+  {
+    KeyChainBridgeBundle bundle;
+    if ( job->error() || bundle.fromText( job->textData() ) )
+    {
+      QString name( masterPasswordKey() );
+      // The profile may have been moved
+      if ( ! bundle.contains( name ) )
+      {
+        name = bundle.movedMasterPassword( KeyChainBridgeBundle::authDbIdentity( mAuthManager->authenticationDbPath() ) );
+      }
+      if ( ! name.isNull() )
+      {
+        password = bundle.secret( name );
+      }
+      // Writes in progress would make it stale
+      if ( mBundleWrites == 0 )
+      {
+        mBundle = bundle;
+        mBundleLoaded = true;
+      }
+    }
+    mMigrationPending = false;
+    if ( password.isEmpty() )
+    {
+      // Not in the bundle: it may have been stored by an older version
+      KEYCHAINBRIDGE_DEBUG( Wallet, "Opening wallet for READ of the legacy entry ..." );
+      mReadJob = mWallet->readPassword( sMasterPasswordName, this, SLOT( legacyMasterPasswordRead( KeyChainBridgeWalletJob* ) ) );
+      return;
+    }
+  }
+  finishMasterPasswordRead( job, password );
+}
+
+void KeyChainBridge::legacyMasterPasswordRead( KeyChainBridgeWalletJob *job )
+{
+  // The legacy entry holds the plain password
+  QString password( job->state() == KeyChainBridgeWalletJob::Finished && ! job->error() ? job->textData() : QString() );
+  // Copied in the bundle once verified, the legacy entry is left for older versions
+  mMigrationPending = ! password.isEmpty();
+  finishMasterPasswordRead( job, password );
 }
 
-QString KeyChainBridge::readMasterPassword()
+void KeyChainBridge::finishMasterPasswordRead( KeyChainBridgeWalletJob *job, QString &password )
 {
-  // Retrieve it!
-  QString password( "" );
-  debug( "Opening wallet for READ ..." );
-  QKeychain::ReadPasswordJob job( sWalletFolderName );
-  job.setAutoDelete( false );
-  job.setKey( sMasterPasswordName );
-  QEventLoop loop;
-  job.connect( &job, SIGNAL( finished( QKeychain::Job* ) ), &loop, SLOT( quit() ) );
-  job.start();
-  loop.exec();
-  if ( job.error() )
+  // Returns when we are done, if credentialsMasterPasswordMissing() waits
+  mUnlockLoop.quit();
+  if ( job->state() == KeyChainBridgeWalletJob::Cancelled )
   {
-    setErrorCode( job.error() );
-    setErrorMessage( QString( tr( "Retrieving password from the %1 failed: %2." ) ).arg( job.errorString(), sWalletDisplayName ) );
+    mInjectionPending = false;
+    KEYCHAINBRIDGE_DEBUG( Wallet, "Wallet READ cancelled." );
+    return;
+  }
+  if ( job->error() )
+  {
+    setErrorCode( job->error() );
+    setErrorMessage( QString( tr( "Retrieving password from the %1 failed: %2." ) ).arg( job->errorString(), sWalletDisplayName ) );
   }
   else
   {
-    password = job.textData();
     // Password is there but it is empty, treat it like if it were not found
     if ( password.isEmpty() )
     {
@@ -446,34 +723,306 @@ QString KeyChainBridge::readMasterPassword()
       clearErrors();
     }
   }
-  return password;
+  setMasterPassword( password, errorCode() == QKeychain::NoError );
+  KeyChainBridgeSecret::wipe( password );
+  if ( errorCode() == QKeychain::NoError )
+  {
+    setIsDirty( false );
+  }
+  // Nobody is waiting: keep it for the credentials provider, errors will be
+  // processed when the dialog is shown and the wallet is read again
+  if ( ! mInjectionPending )
+  {
+    KEYCHAINBRIDGE_DEBUG( Wallet, errorCode() == QKeychain::NoError ? "Master password prefetched." : "Master password prefetch failed." );
+  }
+  else
+  {
+    mInjectionPending = false;
+    if ( errorCode() == QKeychain::NoError )
+    {
+      injectMasterPassword();
+    }
+    else   // We've got an error
+    {
+      KeyChainBridgeMetrics::instance()->record( KeyChainBridgeMetrics::UnlockWalletRead, mUnlockTimer.nsecsElapsed() / 1000, errorCode() );
+      // Process the error
+      processError();
+    }
+  }
 }
 
-bool KeyChainBridge::storeMasterPassword( QString password )
+void KeyChainBridge::injectMasterPassword()
 {
+  // The dialog might have been dismissed while the wallet was busy
+  QgsCredentialDialog* credentials = mDialogFilter->dialog();
+  if ( ! credentials || ! credentials->isVisible() || ! mDialogFilter->isMasterPasswordPage() )
+  {
+    KEYCHAINBRIDGE_DEBUG( Dialog, "Credentials dialog is gone, password not injected." );
+    return;
+  }
+  // The auth manager told us the password has been rejected
+  if ( mVerificationError )
+  {
+    return;
+  }
+  QLineEdit* leMasterPass = mDialogFilter->masterPasswordEdit();
+  // The line edit shares the copy: it cannot be wiped, the dialog owns it
+  leMasterPass->setText( mMasterPassword.toString() );
+  QTimer::singleShot( 0, credentials, SLOT( accept() ) );
+  // Prefetch hits against requests that had to wait for the wallet
+  KeyChainBridgeMetrics::instance()->record( mUnlockPrefetched ? KeyChainBridgeMetrics::UnlockPrefetched : KeyChainBridgeMetrics::UnlockWalletRead,
+      mUnlockTimer.nsecsElapsed() / 1000 );
+  KEYCHAINBRIDGE_DEBUG( Dialog, QString( "Master password injected %1 ms after the dialog was shown." ).arg( mUnlockTimer.elapsed() ) );
+  showInfo( tr( "Master password has been successfully retrieved from %1 and inserted into the form!" ).arg( sWalletDisplayName ) );
+}
+
+void KeyChainBridge::authDatabaseChanged()
+{
+  // It may not be the master password of this DB anymore
+  mCredentials->clearMasterPassword();
+}
+
+void KeyChainBridge::projectLayerLoaded( int i, int n )
+{
+  // Before the first layer: the providers have not asked for anything yet
+  if ( i != 0 || n == 0 || ! pluginIsEnabled() || ! mSettings->readAheadEnabled() )
+  {
+    return;
+  }
+  mReadAhead->warm( QgsProject::instance()->fileName() );
+}
+
+void KeyChainBridge::credentialsMasterPasswordServed()
+{
+  KEYCHAINBRIDGE_DEBUG( Plugin, "Master password request answered from memory." );
+  KeyChainBridgeMetrics::instance()->record( KeyChainBridgeMetrics::UnlockPrefetched, 0 );
+  showInfo( tr( "Master password has been successfully retrieved from %1!" ).arg( sWalletDisplayName ) );
+}
+
+void KeyChainBridge::credentialsMasterPasswordExpired()
+{
+  KEYCHAINBRIDGE_DEBUG( Plugin, "Master password expired from memory." );
+  // A password waiting to be stored is kept, the one from the wallet can be
+  // read again
+  if ( ! isDirty() )
+  {
+    mMasterPassword.clear();
+  }
+}
 
+void KeyChainBridge::credentialsMasterPasswordMissing()
+{
+  // Another request while waiting below: it gets the dialog
+  if ( mUnlockWaiting )
+  {
+    return;
+  }
+  mSkipDialogRead = false;
+  if ( ! pluginIsEnabled() || mVerificationError )
+  {
+    return;
+  }
+  mUnlockTimer.start();
+  // Start reading now, without waiting: the dialog joins the read when it
+  // is shown, and the password is injected as soon as the wallet answers
+  readMasterPassword();
+  if ( ! mSettings->dialogFreeUnlock() )
+  {
+    return;
+  }
+  // Opt-in: wait here rather than in the dialog, so that on success the
+  // dialog is never built. The nested loop runs timers, queued slots and
+  // network replies, which may re-enter the plugin and QGIS, and blocks the
+  // request for up to the dialog-free unlock timeout
+  if ( mReadJob && ! mReadJob->isDone() )
+  {
+    mUnlockWaiting = true;
+    mUnlockDeadline.start( mSettings->value( KeyChainBridgeSettings::DialogFreeUnlockTimeout ).toInt() );
+    mUnlockLoop.exec( QEventLoop::ExcludeUserInputEvents );
+    mUnlockDeadline.stop();
+    mUnlockWaiting = false;
+  }
+  if ( mCredentials->hasMasterPassword() )
+  {
+    KeyChainBridgeMetrics::instance()->record( KeyChainBridgeMetrics::UnlockWalletRead, mUnlockTimer.nsecsElapsed() / 1000 );
+    KEYCHAINBRIDGE_DEBUG( Dialog, QString( "Master password read %1 ms after the request, no dialog shown." ).arg( mUnlockTimer.elapsed() ) );
+    return;
+  }
+  // Still reading: the dialog is shown, and the password injected when the
+  // wallet answers
+  if ( mReadJob && ! mReadJob->isDone() )
+  {
+    KEYCHAINBRIDGE_DEBUG( Dialog, QString( "Wallet still busy after %1 ms, showing the dialog." ).arg( mUnlockTimer.elapsed() ) );
+    return;
+  }
+  // The user will type it
+  mSkipDialogRead = true;
+  if ( errorCode() != QKeychain::NoError )
+  {
+    processError();
+  }
+}
+
+void KeyChainBridge::setMasterPassword( const QString &password, bool fromWallet )
+{
+  mMasterPassword.assign( password );
+  if ( fromWallet && ! password.isEmpty() )
+  {
+    mCredentials->setMasterPassword( mMasterPassword );
+  }
+  else
+  {
+    mCredentials->clearMasterPassword();
+  }
+}
+
+void KeyChainBridge::prefetchMasterPassword()
+{
+  if ( ! pluginIsEnabled() )
+  {
+    return;
+  }
+  KEYCHAINBRIDGE_DEBUG( Wallet, "Prefetching the master password ..." );
+  readMasterPassword();
+}
+
+void KeyChainBridge::storeMasterPassword( const KeyChainBridgeSecret &password )
+{
   Q_ASSERT( !password.isEmpty() );
-  debug( "Opening wallet for WRITE ..." );
-  QKeychain::WritePasswordJob job( sWalletFolderName );
-  job.setAutoDelete( false );
-  job.setKey( sMasterPasswordName );
-  job.setTextData( password );
-  QEventLoop loop;
-  job.connect( &job, SIGNAL( finished( QKeychain::Job* ) ), &loop, SLOT( quit() ) );
-  job.start();
-  loop.exec();
-  if ( job.error() )
-  {
-    setErrorCode( job.error() );
-    setErrorMessage( QString( tr( "Storing password in the %1 failed: %2." ) ).arg( sWalletDisplayName, job.errorString() ) );
+  // The wallet takes text: the copy is wiped once it is in the bundle
+  QString plain( password.toString() );
+  // Found again if the auth DB is moved
+  QString authDbId( KeyChainBridgeBundle::authDbIdentity( mAuthManager->authenticationDbPath() ) );
+  if ( ! authDbId.isEmpty() )
+  {
+    mPendingSecrets.insert( KeyChainBridgeBundle::authDbName( authDbId ), masterPasswordKey() );
+  }
+  updateBundle( masterPasswordKey(), plain, SLOT( masterPasswordStored( KeyChainBridgeWalletJob* ) ) );
+  KeyChainBridgeSecret::wipe( plain );
+}
+
+QString KeyChainBridge::masterPasswordKey()
+{
+  return KeyChainBridgeBundle::masterPasswordName( mAuthManager->authenticationDbPath() );
+}
+
+void KeyChainBridge::updateBundle( const QString &name, const QString &secret, const char *member )
+{
+  mPendingSecrets.insert( name, secret );
+  mPendingMember = member;
+  writeBundle();
+}
+
+void KeyChainBridge::writeBundle()
+{
+  if ( ! mWallet )
+  {
+    KEYCHAINBRIDGE_WARNING( Wallet, tr( "The %1 is not available." ).arg( sWalletDisplayName ) );
+    return;
+  }
+  // Other secrets in the entry must not be lost
+  if ( ! mBundleLoaded )
+  {
+    if ( ! mBundleJob )
+    {
+      KEYCHAINBRIDGE_DEBUG( Wallet, "Opening wallet for READ before WRITE ..." );
+      mBundleJob = mWallet->readPassword( sBundleName, this, SLOT( bundleRead( KeyChainBridgeWalletJob* ) ) );
+    }
+    return;
+  }
+  for ( QHash<QString, QString>::iterator it = mPendingSecrets.begin(); it != mPendingSecrets.end(); ++it )
+  {
+    if ( it.value().isNull() )
+    {
+      mBundle.removeSecret( it.key() );
+    }
+    else
+    {
+      mBundle.setSecret( it.key(), it.value() );
+      KeyChainBridgeSecret::wipe( it.value() );
+    }
+  }
+  mPendingSecrets.clear();
+  ++mBundleWrites;
+  if ( mBundle.isEmpty() )
+  {
+    KEYCHAINBRIDGE_DEBUG( Wallet, "Opening wallet for DELETE ..." );
+    mWallet->deletePassword( sBundleName, this, mPendingMember );
+  }
+  else
+  {
+    KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Opening wallet for WRITE (%1 secrets) ..." ).arg( mBundle.count() ) );
+    mWallet->writePassword( sBundleName, mBundle.toText(), this, mPendingMember );
+  }
+}
+
+bool KeyChainBridge::isWrittenMasterPassword( KeyChainBridgeWalletJob *job )
+{
+  KeyChainBridgeBundle bundle;
+  bundle.fromText( job->textData() );
+  QString written( bundle.secret( masterPasswordKey() ) );
+  bool same = mMasterPassword.equals( written );
+  KeyChainBridgeSecret::wipe( written );
+  return same;
+}
+
+void KeyChainBridge::bundleRead( KeyChainBridgeWalletJob *job )
+{
+  // The pending changes are kept for the next attempt
+  if ( job->state() == KeyChainBridgeWalletJob::Cancelled )
+  {
+    return;
+  }
+  if ( job->error() && job->error() != QKeychain::EntryNotFound )
+  {
+    mPendingSecrets.clear();
+    setErrorCode( job->error() );
+    setErrorMessage( QString( tr( "Reading the %1 failed: %2." ) ).arg( sWalletDisplayName, job->errorString() ) );
     setIsDirty( true );
-    return false;
+    processError();
+    return;
+  }
+  if ( job->error() )
+  {
+    mBundle.clear();
+  }
+  else if ( ! mBundle.fromText( job->textData() ) )
+  {
+    // Unreadable, it is overwritten
+    KEYCHAINBRIDGE_WARNING( Wallet, tr( "Invalid data found in the %1, it will be replaced." ).arg( sWalletDisplayName ) );
+    mBundle.clear();
+  }
+  mBundleLoaded = true;
+  writeBundle();
+}
+
+void KeyChainBridge::masterPasswordStored( KeyChainBridgeWalletJob *job )
+{
+  --mBundleWrites;
+  if ( job->state() == KeyChainBridgeWalletJob::Cancelled )
+  {
+    return;
+  }
+  if ( job->error() )
+  {
+    // Read the entry again before the next change
+    mBundleLoaded = false;
+    setErrorCode( job->error() );
+    setErrorMessage( QString( tr( "Storing password in the %1 failed: %2." ) ).arg( sWalletDisplayName, job->errorString() ) );
+    setIsDirty( true );
+    processError();
+  }
+  // Stale write: the password changed while the wallet was busy
+  else if ( ! isWrittenMasterPassword( job ) )
+  {
+    clearErrors();
   }
   else
   {
-    setIsDirty( false );
+    setIsDirty( false ); // Password is synced!
+    mCredentials->setMasterPassword( mMasterPassword );
     clearErrors();
-    return true;
+    showInfo( tr( "Master password has been successfully stored in your %1!" ).arg( sWalletDisplayName ) );
   }
 }
 
@@ -498,15 +1047,8 @@ void KeyChainBridge::saveMasterPassword()
   }
   if ( ! masterPassword().isEmpty() )
   {
+    // Outcome is notified by masterPasswordStored()
     storeMasterPassword( masterPassword() );
-    if ( errorCode() == QKeychain::NoError )
-    {
-      showInfo( tr( "Master password has been successfully stored in your %1!" ).arg( sWalletDisplayName ) );
-    }
-    else
-    {
-      processError();
-    }
   }
   else
   {
@@ -518,22 +1060,22 @@ void KeyChainBridge::saveMasterPassword()
 void KeyChainBridge::showError()
 {
   QString message( mErrorMessage.isEmpty() ? QString( tr( "Generic %1 plugin error" ) ).arg( name() ) : mErrorMessage );
-  mQGisIface->messageBar()->pushCritical( QString( tr( "%1 plugin error" ) ).arg( name() ), message );
-  debug( message );
+  mNotifier->notify( KeyChainBridgeNotifier::Critical, QString( tr( "%1 plugin error" ) ).arg( name() ), message );
+  KEYCHAINBRIDGE_WARNING( Plugin, message );
 }
 
 void KeyChainBridge::showWarning()
 {
   QString message( mErrorMessage.isEmpty() ? QString( tr( "Generic %1 plugin warning" ) ).arg( name() ) : mErrorMessage );
-  mQGisIface->messageBar()->pushWarning( QString( tr( "%1 plugin warning" ) ).arg( name() ), message );
-  debug( message );
+  mNotifier->notify( KeyChainBridgeNotifier::Warning, QString( tr( "%1 plugin warning" ) ).arg( name() ), message );
+  KEYCHAINBRIDGE_WARNING( Plugin, message );
 }
 
 
 void KeyChainBridge::showInfo( QString message )
 {
-  mQGisIface->messageBar()->pushMessage( QString( tr( "%1 plugin info" ) ).arg( name() ), message, QgsMessageBar::INFO, MESSAGE_BAR_INFO_TIMEOUT );
-  debug( message );
+  mNotifier->notify( KeyChainBridgeNotifier::Info, QString( tr( "%1 plugin info" ) ).arg( name() ), message, MESSAGE_BAR_INFO_TIMEOUT );
+  KEYCHAINBRIDGE_INFO( Plugin, message );
 }
 
 
@@ -542,13 +1084,17 @@ void KeyChainBridge::showInfo( QString message )
 // notification on each subsequent access try.
 void KeyChainBridge::processError()
 {
-  if ( errorCode() == QKeychain::AccessDenied ||
-       errorCode() == QKeychain::AccessDeniedByUser ||
-       errorCode() == QKeychain::NoBackendAvailable ||
-       errorCode() == QKeychain::NotImplemented )
+  // Keep what led to the error, for the support case
+  KeyChainBridgeTrace::instance()->record( KeyChainBridgeTrace::Error, errorCode() );
+  KeyChainBridgeTrace::instance()->flush();
+  // Transient errors have already been retried by the wallet
+  if ( KeyChainBridgeRetryScheduler::classify( errorCode() ) == KeyChainBridgeRetryScheduler::Permanent )
   {
     setUseWallet( false );
-    mUseWalletAction->setChecked( false );
+    if ( mUseWalletAction )
+    {
+      mUseWalletAction->setChecked( false );
+    }
     setErrorMessage( QString( tr( "There was an error and the %1 system has been disabled, you can re-enable it at any time through the menus. %2" ).arg( sWalletDisplayName ).arg( errorMessage( ) ) ) );
   }
   showWarning();
@@ -561,9 +1107,15 @@ void KeyChainBridge::processError()
 // not be enough
 void KeyChainBridge::about()
 {
-  KeyChainBridgeGui *myPluginGui = new KeyChainBridgeGui( mQGisIface->mainWindow(), QgisGui::ModalDialogFlags );
-  myPluginGui->setAttribute( Qt::WA_DeleteOnClose );
-  myPluginGui->show();
+  // Already open: bring it up rather than stacking another one
+  if ( ! mAboutDialog )
+  {
+    mAboutDialog = new KeyChainBridgeGui( mQGisIface ? mQGisIface->mainWindow() : nullptr, QgisGui::ModalDialogFlags );
+    mAboutDialog->setAttribute( Qt::WA_DeleteOnClose );
+  }
+  mAboutDialog->show();
+  mAboutDialog->raise();
+  mAboutDialog->activateWindow();
 }
 
 // Unload the plugin by cleaning up the GUI
@@ -574,22 +1126,45 @@ void KeyChainBridge::unload()
     return;
   }
   // remove the GUI
-  mQGisIface->removePluginMenu( sName, mAboutAction );
-  mQGisIface->removePluginMenu( sName, mUseWalletAction );
-  mQGisIface->removePluginMenu( sName, mLoggingEnabledAction );
-  mQGisIface->removePluginMenu( sName, mSaveMasterPasswordAction );
-  mQGisIface->removePluginMenu( sName, mClearMasterPasswordAction );
+  if ( mQGisIface )
+  {
+    mQGisIface->removePluginMenu( sName, mAboutAction );
+    mQGisIface->removePluginMenu( sName, mUseWalletAction );
+    mQGisIface->removePluginMenu( sName, mLoggingEnabledAction );
+    mQGisIface->removePluginMenu( sName, mPrefetchEnabledAction );
+    mQGisIface->removePluginMenu( sName, mDumpMetricsAction );
+    if ( mSaveMasterPasswordAction )
+    {
+      mQGisIface->removePluginMenu( sName, mSaveMasterPasswordAction );
+      mQGisIface->removePluginMenu( sName, mClearMasterPasswordAction );
+    }
+  }
   // Disconnect all signals
   disconnect( this, 0, 0, 0 );
+  // Forget about the wallet operations still in flight
+  if ( mWallet )
+  {
+    mWallet->cancelAll();
+  }
+  mNotifier->dismissPrompt();
   // Remove event filter
-  QgsCredentialDialog* credentials = dynamic_cast<QgsCredentialDialog*>( QgsCredentials::instance() );
-  credentials->removeEventFilter( this );
-  disconnect( credentials, SIGNAL( accepted() ), this, SLOT( credentialsDialogAccepted() ) );
+  if ( mDialogFilter && mDialogFilter->dialog() )
+  {
+    disconnect( mDialogFilter->dialog(), SIGNAL( accepted() ), this, SLOT( credentialsDialogAccepted() ) );
+  }
+  delete mDialogFilter;
+  mDialogFilter = nullptr;
+  // Give the QgsCredentials instance back to QGIS
+  delete mCredentials;
+  mCredentials = nullptr;
   delete mUseWalletAction;
   delete mLoggingEnabledAction;
+  delete mPrefetchEnabledAction;
+  delete mDumpMetricsAction;
   delete mSaveMasterPasswordAction;
   delete mClearMasterPasswordAction;
   delete mAboutAction;
+  delete mAboutDialog;
 }
 
 
@@ -655,3 +1230,18 @@ QGISEXTERN void unload( QgisPlugin * thePluginPointer )
 {
   delete thePluginPointer;
 }
+
+// Unlock the auth manager without any GUI, for batch tools and servers that
+// load the library and resolve this symbol ( see KeyChainBridgeHeadless )
+QGISEXTERN bool headlessUnlock()
+{
+  KeyChainBridgeHeadless headless( sName );
+  KeyChainBridgeHeadless::Result result = headless.unlock();
+  if ( ! headless.errorMessage().isEmpty() )
+  {
+    KEYCHAINBRIDGE_WARNING( Plugin, headless.errorMessage() );
+  }
+  return result == KeyChainBridgeHeadless::AlreadyUnlocked ||
+         result == KeyChainBridgeHeadless::UnlockedFromWallet ||
+         result == KeyChainBridgeHeadless::UnlockedFromFile;
+}
@@ -22,6 +22,11 @@
 
 //QT4 includes
 #include <QObject>
+#include <QPointer>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QHash>
+#include <QTimer>
 
 //QGIS includes
 #include "qgisplugin.h"
@@ -29,12 +34,26 @@
 // QtKeyChain library
 #include "qtkeychain/keychain.h"
 
+#include "keychainbridgebundle.h"
+#include "keychainbridgesecret.h"
+
 //forward declarations
 class QAction;
 class QToolBar;
 
 class QgisInterface;
 class QgsAuthManager;
+class QgsMessageBar;
+class QgsCredentialDialog;
+
+class KeyChainBridgeCredentials;
+class KeyChainBridgeDialogFilter;
+class KeyChainBridgeGui;
+class KeyChainBridgeNotifier;
+class KeyChainBridgeReadAhead;
+class KeyChainBridgeSettings;
+class KeyChainBridgeWallet;
+class KeyChainBridgeWalletJob;
 
 
 /**
@@ -56,12 +75,23 @@ class KeyChainBridge: public QObject, public QgisPlugin
     /**
     * Constructor for a plugin. The QgisInterface pointer is passed by
     * QGIS when it attempts to instantiate the plugin.
-    * @param theInterface Pointer to the QgisInterface object.
+    * @param theInterface Pointer to the QgisInterface object, it can be null
+    * when running headless (tests and benchmarks): messages are then only logged
      */
     explicit KeyChainBridge( QgisInterface * theInterface );
     //! Destructor
     ~KeyChainBridge();
 
+    //! Master password name in the wallets, plain text entry of older
+    //! versions: read when the bundle does not have the master password
+    static const QLatin1String sMasterPasswordName;
+
+    //! Bundle name in the wallets
+    static const QLatin1String sBundleName;
+
+    //! Wallet folder in the wallets
+    static const QLatin1String sWalletFolderName;
+
   public slots:
 
     //! init the gui
@@ -73,6 +103,56 @@ class KeyChainBridge: public QObject, public QgisPlugin
     //! unload the plugin
     void unload() override;
 
+  protected slots:
+
+    //! Create the wallet and connect to the auth manager and the credentials
+    //! dialog, at load or, if deferred, on the first credentials request
+    void initialize();
+
+  protected:
+
+    // The plugin is not meant to be subclassed, but by the test harness:
+    // see KeyChainBridgeTestPlugin
+
+    //! Ask the user if he wants to store the master password
+    void askSaveMasterPassword( QString message );
+
+    //! Start deleting the master password from the wallet, the result is
+    //! delivered to masterPasswordDeleted()
+    void deleteMasterPassword();
+
+    //! Dirty flag setter, transitions are traced
+    void setIsDirty( bool dirty );
+
+    //! Dirty flag getter
+    bool isDirty( ) { return mIsDirty; }
+
+    //! Set the cached master password, and make it available to the
+    //! credentials provider if it comes from the wallet. The password is
+    //! copied in the locked buffer already held, if it fits
+    void setMasterPassword( const QString &password, bool fromWallet );
+
+    //! Ask the user, and then store
+    void saveMasterPassword();
+
+    //! Asynchronous wallet job engine, null until initialize() has run
+    KeyChainBridgeWallet *wallet() const { return mWallet; }
+
+    //! Credentials provider answering master password requests from the wallet
+    KeyChainBridgeCredentials *credentials() const { return mCredentials; }
+
+    //! Message bar notifications
+    KeyChainBridgeNotifier *notifier() const { return mNotifier; }
+
+    //! Plugin settings
+    KeyChainBridgeSettings *settings() const { return mSettings; }
+
+    //! Whether the plugin failed to initialize
+    bool failedInit() const { return mFailedInit; }
+
+    //! Whether initialize() has run
+    bool isInitialized() const { return mInitialized; }
+
   private slots:
 
     /**
@@ -84,6 +164,27 @@ class KeyChainBridge: public QObject, public QgisPlugin
     //! Capture the master password from the credentials dialog
     void credentialsDialogAccepted();
 
+    //! The credentials dialog is about to be shown to ask for the master password:
+    //! this is where the wallet password gets injected
+    void credentialsDialogMasterPasswordRequested();
+
+    //! A master password request has been answered from memory, without the dialog
+    void credentialsMasterPasswordServed();
+
+    //! The master password kept by the credentials provider has expired:
+    //! drop our copy too
+    void credentialsMasterPasswordExpired();
+
+    //! A master password request is about to fall back to the dialog: start
+    //! reading the wallet, and only wait for it when dialog-free unlock is on
+    void credentialsMasterPasswordMissing();
+
+    //! The auth DB has been changed (erased, reset ...)
+    void authDatabaseChanged();
+
+    //! A project is being loaded, \a i layers out of \a n are loaded
+    void projectLayerLoaded( int i, int n );
+
     //! Delete master password from wallet
     void on_deleteMasterPassword_triggered();
 
@@ -96,43 +197,74 @@ class KeyChainBridge: public QObject, public QgisPlugin
     //! Toggle plugin logging ( saved in the settings )
     void on_loggingEnabled_changed();
 
-  protected:
+    //! Toggle master password prefetch at startup ( saved in the settings )
+    void on_prefetchEnabled_changed();
 
-    bool eventFilter( QObject *obj, QEvent *event ) override;
+    //! Dump the operation metrics to the message log
+    void on_dumpMetrics_triggered();
 
-  private:
+    //! The wallet read started by readMasterPassword() is done
+    void masterPasswordRead( KeyChainBridgeWalletJob *job );
+
+    //! The read of the entry of older versions started by masterPasswordRead() is done
+    void legacyMasterPasswordRead( KeyChainBridgeWalletJob *job );
 
-    //! Print a debug message in QGIS
-    void debug( QString msg );
+    //! The wallet write started by storeMasterPassword() is done
+    void masterPasswordStored( KeyChainBridgeWalletJob *job );
 
-    //! Read settings
-    void readSettings();
+    //! The wallet delete started by deleteMasterPassword() is done
+    void masterPasswordDeleted( KeyChainBridgeWalletJob *job );
 
-    //! Write settings
-    void writeSettings();
+    //! The wallet entry has been read before changing it
+    void bundleRead( KeyChainBridgeWalletJob *job );
+
+  private:
+
+    //! The QGIS message bar, null when running headless
+    QgsMessageBar *messageBar();
 
     //! Plugin is enabled and authmanager too
     bool pluginIsEnabled();
 
-    //! Ask the user if he wants to store the master password
-    void askSaveMasterPassword( QString message );
+    //! Set the icons of the menu actions created so far
+    void setActionIcons();
 
     //! Cached master password getter
-    QString masterPassword() { return mMasterPassword; }
+    const KeyChainBridgeSecret &masterPassword() const { return mMasterPassword; }
 
     //! Check if password is the same as in auth manager
     //! This method will only return something meaningful if the auth manager password is set
     //! (check it with QgsAuthManager::instance()->masterPasswordIsSet())
-    bool passwordIsSame( QString password );
+    bool passwordIsSame( const KeyChainBridgeSecret &password );
 
-    //! Read Master password from the wallet
-    QString readMasterPassword();
+    //! Start reading the master password from the wallet, the result is
+    //! delivered to masterPasswordRead()
+    void readMasterPassword();
 
-    //! Delete master password from wallet
-    bool deleteMasterPassword();
+    //! The master password read is done, \a password is wiped
+    void finishMasterPasswordRead( KeyChainBridgeWalletJob *job, QString &password );
+
+    //! Start storing the master password in the wallet, the result is
+    //! delivered to masterPasswordStored()
+    void storeMasterPassword( const KeyChainBridgeSecret &password );
+
+    //! Name of the master password of the current auth DB in the bundle
+    QString masterPasswordKey();
+
+    //! Change the secret \a name in the wallet entry, a null \a secret removes
+    //! it: the result is delivered to the \a member slot
+    void updateBundle( const QString &name, const QString &secret, const char *member );
+
+    //! Whether the \a job bundle write is of the cached master password
+    bool isWrittenMasterPassword( KeyChainBridgeWalletJob *job );
+
+    //! Apply the pending changes to the bundle and write it in the wallet, the
+    //! entry is read first if it is not known yet
+    void writeBundle();
 
-    //! Store Master password in the wallet
-    bool storeMasterPassword( QString password );
+    //! Inject the cached master password into the credentials dialog and
+    //! accept it, if the dialog is still waiting for it
+    void injectMasterPassword();
 
     //! Error message setter
     void setErrorMessage( QString errorMessage ) { mErrorMessage = errorMessage; }
@@ -144,16 +276,32 @@ class KeyChainBridge: public QObject, public QgisPlugin
     void clearErrors();
 
     //! Use wallet  getter
-    bool useWallet() { return mUseWallet; }
+    bool useWallet();
 
-    //! Use wallet setter
-    void setUseWallet( bool useWallet ) { mUseWallet = useWallet; }
+    //! Use wallet setter ( saved in the settings )
+    void setUseWallet( bool useWallet );
 
     //! Logging getter
-    bool loggingEnabled() { return mLoggingEnabled; }
+    bool loggingEnabled();
 
-    //! Logging setter
-    void setLoggingEnabled( bool loggingEnabled ) { mLoggingEnabled = loggingEnabled; }
+    //! Logging setter ( saved in the settings )
+    void setLoggingEnabled( bool loggingEnabled );
+
+    //! Storage backend name getter, the setting is not exposed in the GUI
+    QString backendName();
+
+    //! Prefetch getter
+    bool prefetchEnabled();
+
+    //! Prefetch setter ( saved in the settings )
+    void setPrefetchEnabled( bool prefetchEnabled );
+
+    //! Apply the logging settings to KeyChainBridgeLog
+    void applyLogSettings();
+
+    //! Start reading the wallet in background, so that the master password
+    //! is already in memory when QGIS asks for it
+    void prefetchMasterPassword();
 
     //! Error code setter
     void setErrorCode( QKeychain::Error errorCode ) { mErrorCode = errorCode; }
@@ -161,15 +309,6 @@ class KeyChainBridge: public QObject, public QgisPlugin
     //! Error code getter
     QKeychain::Error errorCode() { return mErrorCode; }
 
-    //! Dirty flag setter
-    void setIsDirty( bool dirty ) { mIsDirty = dirty; }
-
-    //! Dirty flag getter
-    bool isDirty( ) { return mIsDirty; }
-
-    //! Ask the user, and then store
-    void saveMasterPassword();
-
     //! Show an error to the user (currently not used in favour of warnings)
     void showError();
 
@@ -203,11 +342,11 @@ class KeyChainBridge: public QObject, public QgisPlugin
     //
     ////////////////////////////////////////////////////////////////////
 
-    //! The user has chosen of using this plugin to store and retrieve the master pwd from his wallet
-    bool mUseWallet;
+    //! Plugin settings, the changes are persisted in background
+    KeyChainBridgeSettings *mSettings;
 
-    //! The cached master password
-    QString mMasterPassword;
+    //! The cached master password, in locked memory
+    KeyChainBridgeSecret mMasterPassword;
 
     //! Master password verification has failed
     bool mVerificationError;
@@ -233,20 +372,86 @@ class KeyChainBridge: public QObject, public QgisPlugin
 
     QAction* mClearMasterPasswordAction;
 
-    //! Enable logging
-    bool mLoggingEnabled;
+    QAction* mPrefetchEnabledAction;
+
+    QAction* mDumpMetricsAction;
+
+    //! Measure the time from the dialog being shown to the password injection
+    QElapsedTimer mUnlockTimer;
 
     //! The display name of the wallet (platform dependent)
     static const QString sWalletDisplayName;
 
-    //! Master password name in the wallets
-    static const QLatin1String sMasterPasswordName;
-
-    //! Wallet folder in the wallets
-    static const QLatin1String sWalletFolderName;
 
     //! Whether the plugin failed to initialize
     bool mFailedInit;
+
+    //! Whether initialize() has run
+    bool mInitialized;
+
+    //! Time spent in the constructor and initGui(), in microseconds
+    qint64 mLoadTime;
+
+    //! Asynchronous wallet job engine
+    KeyChainBridgeWallet *mWallet;
+
+    //! Event filter installed on the credentials dialog
+    KeyChainBridgeDialogFilter *mDialogFilter;
+
+    //! Credentials provider answering master password requests from the wallet
+    KeyChainBridgeCredentials *mCredentials;
+
+    //! Credentials read-ahead for the project being loaded
+    KeyChainBridgeReadAhead *mReadAhead;
+
+    //! Message bar notifications, deduplicated and batched
+    KeyChainBridgeNotifier *mNotifier;
+
+    //! The about dialog, while it is open
+    QPointer<KeyChainBridgeGui> mAboutDialog;
+
+    //! The wallet read in progress, if any
+    QPointer<KeyChainBridgeWalletJob> mReadJob;
+
+    //! The credentials dialog is waiting for the wallet read to complete
+    bool mInjectionPending;
+
+    //! The master password has been read from the entry of older versions,
+    //! it is copied in the bundle once verified
+    bool mMigrationPending;
+
+    //! A master password request is waiting for the wallet read to complete
+    QEventLoop mUnlockLoop;
+
+    //! Stops mUnlockLoop when the wallet is too slow: the dialog is shown
+    QTimer mUnlockDeadline;
+
+    //! credentialsMasterPasswordMissing() is waiting in mUnlockLoop
+    bool mUnlockWaiting;
+
+    //! The wallet read before the dialog failed: do not read it again when shown
+    bool mSkipDialogRead;
+
+    //! The master password was already in memory when the dialog asked for it
+    bool mUnlockPrefetched;
+
+    //! All the secrets stored in the wallet entry
+    KeyChainBridgeBundle mBundle;
+
+    //! mBundle is in sync with the wallet entry
+    bool mBundleLoaded;
+
+    //! The wallet read started by writeBundle(), if any
+    QPointer<KeyChainBridgeWalletJob> mBundleJob;
+
+    //! Changes waiting for the bundle to be loaded, null secrets are removed
+    QHash<QString, QString> mPendingSecrets;
+
+    //! Slot notified of the pending changes
+    const char *mPendingMember;
+
+    //! Bundle writes and deletes in progress
+    int mBundleWrites;
 };
 
 #endif //KeyChainBridge_H
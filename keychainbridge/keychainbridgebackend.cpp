@@ -0,0 +1,154 @@
+/***************************************************************************
+  keychainbridgebackend.cpp
+
+  Wallet storage backends
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgebackend.h"
+#include "keychainbridgecachebackend.h"
+#include "keychainbridgelog.h"
+#include "keychainbridgesecretcache.h"
+#include "keychainbridgesettings.h"
+#ifdef WITH_SECRET_SERVICE
+#include "keychainbridgesecretservice.h"
+#endif
+#ifdef WITH_MOCK_BACKEND
+#include "keychainbridgemockbackend.h"
+#endif
+
+
+KeyChainBridgeBackend::KeyChainBridgeBackend( QObject *parent ):
+    QObject( parent )
+{
+}
+
+KeyChainBridgeBackend::~KeyChainBridgeBackend()
+{
+}
+
+KeyChainBridgeBackend *KeyChainBridgeBackend::create( const QString &name, QObject *parent )
+{
+  if ( name == "mock" )
+  {
+#ifdef WITH_MOCK_BACKEND
+    return new KeyChainBridgeMockBackend( parent );
+#else
+    // Test builds only: the real wallet must never be silently replaced
+    KEYCHAINBRIDGE_DEBUG( Wallet, QString( "The mock backend is not available in this build, using the QtKeychain backend." ) );
+    return new KeyChainBridgeQtKeychainBackend( parent );
+#endif
+  }
+  if ( name == "cache" )
+  {
+    return new KeyChainBridgeCacheBackend( new KeyChainBridgeSecretCache( KeyChainBridgeSecretCache::defaultFileName() ), nullptr,
+                                           KeyChainBridgeCacheBackend::Primary, parent );
+  }
+#ifdef WITH_SECRET_SERVICE
+  if ( name == "secretservice" )
+  {
+    return new KeyChainBridgeSecretServiceBackend( QDBusConnection::sessionBus(), parent );
+  }
+#endif
+  return new KeyChainBridgeQtKeychainBackend( parent );
+}
+
+QStringList KeyChainBridgeBackend::availableBackends()
+{
+  QStringList backends;
+  backends << "qtkeychain" << "cache";
+#ifdef WITH_SECRET_SERVICE
+  backends << "secretservice";
+#endif
+#ifdef WITH_MOCK_BACKEND
+  backends << "mock";
+#endif
+  return backends;
+}
+
+KeyChainBridgeBackend *KeyChainBridgeBackend::create( const KeyChainBridgeSettings &settings, QObject *parent )
+{
+  KeyChainBridgeBackend *backend = create( settings.backend(), parent );
+  QString secretCache( settings.secretCache() );
+  if ( backend->name() == "cache" || ( secretCache != "primary" && secretCache != "fallback" ) )
+  {
+    return backend;
+  }
+  KeyChainBridgeCacheBackend *cacheBackend = new KeyChainBridgeCacheBackend(
+    new KeyChainBridgeSecretCache( KeyChainBridgeSecretCache::defaultFileName() ), backend,
+    secretCache == "primary" ? KeyChainBridgeCacheBackend::Primary : KeyChainBridgeCacheBackend::Fallback, parent );
+  cacheBackend->setFallbackDelay( settings.value( KeyChainBridgeSettings::SecretCacheDelay ).toInt() );
+  return cacheBackend;
+}
+
+void KeyChainBridgeBackend::startJob( KeyChainBridgeWalletJob *job )
+{
+  job->start();
+}
+
+void KeyChainBridgeBackend::finishJob( KeyChainBridgeWalletJob *job, QKeychain::Error error, const QString &errorString, const QString &textData )
+{
+  if ( ! job )
+  {
+    return;
+  }
+  job->complete( error, errorString, textData );
+}
+
+
+KeyChainBridgeQtKeychainBackend::KeyChainBridgeQtKeychainBackend( QObject *parent ):
+    KeyChainBridgeBackend( parent )
+{
+}
+
+void KeyChainBridgeQtKeychainBackend::start( KeyChainBridgeWalletJob *job )
+{
+  QKeychain::Job *keychainJob = nullptr;
+  switch ( job->type() )
+  {
+    case KeyChainBridgeWalletJob::Read:
+      keychainJob = new QKeychain::ReadPasswordJob( job->service() );
+      break;
+    case KeyChainBridgeWalletJob::Write:
+    {
+      QKeychain::WritePasswordJob *writeJob = new QKeychain::WritePasswordJob( job->service() );
+      writeJob->setTextData( job->textData() );
+      keychainJob = writeJob;
+      break;
+    }
+    case KeyChainBridgeWalletJob::Delete:
+      keychainJob = new QKeychain::DeletePasswordJob( job->service() );
+      break;
+  }
+  // The QtKeychain job deletes itself after emitting finished(), even if
+  // the wallet job has been cancelled in the meantime
+  keychainJob->setAutoDelete( true );
+  keychainJob->setKey( job->key() );
+  mJobs.insert( keychainJob, job );
+  connect( keychainJob, SIGNAL( finished( QKeychain::Job* ) ), this, SLOT( keychainJobFinished( QKeychain::Job* ) ) );
+  keychainJob->start();
+}
+
+void KeyChainBridgeQtKeychainBackend::keychainJobFinished( QKeychain::Job *keychainJob )
+{
+  QPointer<KeyChainBridgeWalletJob> job = mJobs.take( keychainJob );
+  QString textData;
+  if ( keychainJob->error() == QKeychain::NoError )
+  {
+    QKeychain::ReadPasswordJob *readJob = qobject_cast<QKeychain::ReadPasswordJob*>( keychainJob );
+    if ( readJob )
+    {
+      textData = readJob->textData();
+    }
+  }
+  finishJob( job, keychainJob->error(), keychainJob->errorString(), textData );
+}
@@ -0,0 +1,103 @@
+/***************************************************************************
+    keychainbridgebackend.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeBackend_H
+#define KeyChainBridgeBackend_H
+
+//QT4 includes
+#include <QHash>
+#include <QObject>
+#include <QPointer>
+#include <QString>
+#include <QStringList>
+
+// QtKeyChain library
+#include "qtkeychain/keychain.h"
+
+#include "keychainbridgewallet.h"
+
+//forward declarations
+class KeyChainBridgeSettings;
+
+
+/**
+* \class KeyChainBridgeBackend
+* \brief Interface for the wallet storage backends
+* A backend executes the jobs scheduled by KeyChainBridgeWallet, one at a
+* time, and reports the outcome with finishJob(). It must never complete
+* a job synchronously from start(), and it must cope with the job being
+* cancelled (or deleted) while it is working on it.
+*/
+class KeyChainBridgeBackend : public QObject
+{
+    Q_OBJECT
+  public:
+
+    explicit KeyChainBridgeBackend( QObject *parent = nullptr );
+    virtual ~KeyChainBridgeBackend();
+
+    //! Backend name, as accepted by create()
+    virtual QString name() const = 0;
+
+    //! Start executing \a job
+    virtual void start( KeyChainBridgeWalletJob *job ) = 0;
+
+    //! Create a backend by name, returns the QtKeychain backend if the name is unknown
+    static KeyChainBridgeBackend *create( const QString &name, QObject *parent = nullptr );
+
+    //! Create the backend configured in \a settings, with the secret cache
+    //! in front of or behind it if enabled
+    static KeyChainBridgeBackend *create( const KeyChainBridgeSettings &settings, QObject *parent = nullptr );
+
+    //! Names of the available backends
+    static QStringList availableBackends();
+
+  protected:
+
+    //! Mark \a job as running, for backends that delegate to other backends
+    static void startJob( KeyChainBridgeWalletJob *job );
+
+    //! Report the outcome of \a job, it is ignored if the job has been cancelled
+    static void finishJob( KeyChainBridgeWalletJob *job, QKeychain::Error error, const QString &errorString, const QString &textData = QString() );
+};
+
+
+/**
+* \class KeyChainBridgeQtKeychainBackend
+* \brief The default backend: the OS wallet through the QtKeychain library
+*/
+class KeyChainBridgeQtKeychainBackend : public KeyChainBridgeBackend
+{
+    Q_OBJECT
+  public:
+
+    explicit KeyChainBridgeQtKeychainBackend( QObject *parent = nullptr );
+
+    QString name() const override { return QString( "qtkeychain" ); }
+
+    void start( KeyChainBridgeWalletJob *job ) override;
+
+  private slots:
+
+    //! The QtKeychain job has completed
+    void keychainJobFinished( QKeychain::Job *keychainJob );
+
+  private:
+
+    //! Running QtKeychain jobs, they delete themselves when done
+    QHash<QKeychain::Job*, QPointer<KeyChainBridgeWalletJob> > mJobs;
+};
+
+#endif //KeyChainBridgeBackend_H
@@ -0,0 +1,298 @@
+/***************************************************************************
+  keychainbridgebundle.cpp
+
+  Many named secrets in a single wallet entry
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgebundle.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+#include <QList>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QVariant>
+
+#include <algorithm>
+#include <string.h>
+
+// Slots are padded to a multiple of this: small changes are made in place
+// and the secret lengths are not exposed
+const quint32 BUNDLE_SLOT_ALIGNMENT = 16;
+
+// Prefix of the text representation
+const QLatin1String BUNDLE_TEXT_PREFIX( "kcbb:" );
+
+const quint32 KeyChainBridgeBundle::MAGIC;
+const quint16 KeyChainBridgeBundle::VERSION;
+
+
+KeyChainBridgeBundle::KeyChainBridgeBundle():
+    mWasted( 0 )
+{
+}
+
+KeyChainBridgeBundle::~KeyChainBridgeBundle()
+{
+  clear();
+}
+
+QString KeyChainBridgeBundle::secret( const QString &name ) const
+{
+  QHash<QString, Slot>::const_iterator it = mIndex.constFind( name );
+  if ( it == mIndex.constEnd() )
+  {
+    return QString();
+  }
+  return QString::fromUtf8( mData.constData() + it->offset, it->length );
+}
+
+void KeyChainBridgeBundle::setSecret( const QString &name, const QString &secret )
+{
+  QByteArray utf8( secret.toUtf8() );
+  quint32 length = utf8.size();
+  QHash<QString, Slot>::iterator it = mIndex.find( name );
+  if ( it != mIndex.end() && length <= it->capacity )
+  {
+    // In place
+    wipe( *it );
+    memcpy( mData.data() + it->offset, utf8.constData(), length );
+    it->length = length;
+  }
+  else
+  {
+    if ( it != mIndex.end() )
+    {
+      wipe( *it );
+      mWasted += it->capacity;
+    }
+    Slot slot;
+    slot.offset = mData.size();
+    slot.length = length;
+    slot.capacity = slotCapacity( length );
+    mData.append( utf8 );
+    mData.append( QByteArray( slot.capacity - length, '\0' ) );
+    mIndex.insert( name, slot );
+    if ( mWasted > mData.size() / 2 )
+    {
+      compact();
+    }
+  }
+  utf8.fill( '\0' );
+}
+
+bool KeyChainBridgeBundle::removeSecret( const QString &name )
+{
+  QHash<QString, Slot>::iterator it = mIndex.find( name );
+  if ( it == mIndex.end() )
+  {
+    return false;
+  }
+  wipe( *it );
+  mWasted += it->capacity;
+  mIndex.erase( it );
+  if ( mIndex.isEmpty() )
+  {
+    clear();
+  }
+  else if ( mWasted > mData.size() / 2 )
+  {
+    compact();
+  }
+  return true;
+}
+
+void KeyChainBridgeBundle::clear()
+{
+  // A shared copy would only be detached, and then zeroed
+  if ( mData.isDetached() )
+  {
+    mData.fill( '\0' );
+  }
+  mData.clear();
+  mIndex.clear();
+  mWasted = 0;
+}
+
+QByteArray KeyChainBridgeBundle::toByteArray() const
+{
+  QByteArray data;
+  QDataStream stream( &data, QIODevice::WriteOnly );
+  stream.setVersion( QDataStream::Qt_4_8 );
+  stream << MAGIC << VERSION << static_cast<quint32>( mIndex.size() );
+  for ( QHash<QString, Slot>::const_iterator it = mIndex.constBegin(); it != mIndex.constEnd(); ++it )
+  {
+    stream << it.key() << it->offset << it->length << it->capacity;
+  }
+  stream << mData;
+  return data;
+}
+
+bool KeyChainBridgeBundle::slotBefore( const Slot &a, const Slot &b )
+{
+  return a.offset < b.offset;
+}
+
+bool KeyChainBridgeBundle::fromByteArray( const QByteArray &data )
+{
+  QDataStream stream( data );
+  stream.setVersion( QDataStream::Qt_4_8 );
+  quint32 magic;
+  quint16 version;
+  quint32 count;
+  stream >> magic >> version >> count;
+  if ( stream.status() != QDataStream::Ok || magic != MAGIC || version > VERSION )
+  {
+    return false;
+  }
+  QHash<QString, Slot> index;
+  for ( quint32 i = 0; i < count; ++i )
+  {
+    QString name;
+    Slot slot;
+    stream >> name >> slot.offset >> slot.length >> slot.capacity;
+    if ( stream.status() != QDataStream::Ok )
+    {
+      return false;
+    }
+    index.insert( name, slot );
+  }
+  QByteArray block;
+  stream >> block;
+  if ( stream.status() != QDataStream::Ok )
+  {
+    return false;
+  }
+  quint32 used = 0;
+  QList<Slot> ordered;
+  for ( QHash<QString, Slot>::const_iterator it = index.constBegin(); it != index.constEnd(); ++it )
+  {
+    if ( it->length > it->capacity || it->capacity > static_cast<quint32>( block.size() ) ||
+         it->offset > static_cast<quint32>( block.size() ) - it->capacity )
+    {
+      return false;
+    }
+    used += it->capacity;
+    ordered.append( *it );
+  }
+  // Secrets sharing bytes would overwrite each other
+  std::sort( ordered.begin(), ordered.end(), slotBefore );
+  for ( int i = 1; i < ordered.size(); ++i )
+  {
+    if ( ordered.at( i ).offset - ordered.at( i - 1 ).offset < ordered.at( i - 1 ).capacity )
+    {
+      return false;
+    }
+  }
+  clear();
+  mIndex = index;
+  mData = block;
+  mWasted = qMax( 0, mData.size() - static_cast<int>( used ) );
+  return true;
+}
+
+QString KeyChainBridgeBundle::toText() const
+{
+  return BUNDLE_TEXT_PREFIX + QString::fromLatin1( toByteArray().toBase64() );
+}
+
+bool KeyChainBridgeBundle::fromText( const QString &text )
+{
+  if ( ! isBundleText( text ) )
+  {
+    return false;
+  }
+  return fromByteArray( QByteArray::fromBase64( text.mid( BUNDLE_TEXT_PREFIX.size() ).toLatin1() ) );
+}
+
+bool KeyChainBridgeBundle::isBundleText( const QString &text )
+{
+  return text.startsWith( BUNDLE_TEXT_PREFIX );
+}
+
+QString KeyChainBridgeBundle::masterPasswordName( const QString &authDbPath )
+{
+  // One per auth DB: profiles do not share the master password
+  return QString( "masterPassword:%1" ).arg( authDbPath );
+}
+
+QString KeyChainBridgeBundle::authDbName( const QString &authDbId )
+{
+  return QString( "authDb:%1" ).arg( authDbId );
+}
+
+QString KeyChainBridgeBundle::authDbIdentity( const QString &authDbPath )
+{
+  QString identity;
+  if ( authDbPath.isEmpty() || ! QFile::exists( authDbPath ) )
+  {
+    return identity;
+  }
+  QString connectionName( "keychainbridge-authdb-identity" );
+  {
+    QSqlDatabase db( QSqlDatabase::addDatabase( "QSQLITE", connectionName ) );
+    db.setDatabaseName( authDbPath );
+    db.setConnectOptions( "QSQLITE_OPEN_READONLY" );
+    if ( db.open() )
+    {
+      QSqlQuery query( db );
+      // Random, and renewed when the master password is reset
+      if ( query.exec( "SELECT salt FROM auth_pass" ) && query.next() )
+      {
+        identity = QString::fromLatin1( QCryptographicHash::hash( query.value( 0 ).toString().toUtf8(), QCryptographicHash::Sha1 ).toHex() );
+      }
+      db.close();
+    }
+  }
+  QSqlDatabase::removeDatabase( connectionName );
+  return identity;
+}
+
+QString KeyChainBridgeBundle::movedMasterPassword( const QString &authDbId ) const
+{
+  if ( authDbId.isEmpty() )
+  {
+    return QString();
+  }
+  QString name( secret( authDbName( authDbId ) ) );
+  return contains( name ) ? name : QString();
+}
+
+quint32 KeyChainBridgeBundle::slotCapacity( quint32 length )
+{
+  return qMax( BUNDLE_SLOT_ALIGNMENT, ( length + BUNDLE_SLOT_ALIGNMENT - 1 ) / BUNDLE_SLOT_ALIGNMENT * BUNDLE_SLOT_ALIGNMENT );
+}
+
+void KeyChainBridgeBundle::wipe( const Slot &slot )
+{
+  memset( mData.data() + slot.offset, 0, slot.capacity );
+}
+
+void KeyChainBridgeBundle::compact()
+{
+  QByteArray data;
+  data.reserve( mData.size() - mWasted );
+  for ( QHash<QString, Slot>::iterator it = mIndex.begin(); it != mIndex.end(); ++it )
+  {
+    quint32 offset = data.size();
+    data.append( mData.constData() + it->offset, it->capacity );
+    it->offset = offset;
+  }
+  if ( mData.isDetached() )
+  {
+    mData.fill( '\0' );
+  }
+  mData = data;
+  mWasted = 0;
+}
@@ -0,0 +1,144 @@
+/***************************************************************************
+    keychainbridgebundle.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeBundle_H
+#define KeyChainBridgeBundle_H
+
+//QT4 includes
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+
+
+/**
+* \class KeyChainBridgeBundle
+* \brief Many named secrets in a single wallet entry
+* The secrets are packed in one data block, with an index mapping each name
+* to its slot: lookups are hash lookups, and a secret that still fits in its
+* slot is updated in place. Slots are padded, freed slots are wiped and the
+* block is compacted when more than half of it is unused.
+*
+* Binary format (QDataStream, big endian), version 1:
+* magic (quint32, "KCBB"), version (quint16), entry count (quint32),
+* then for each entry: name (QString), offset, length, capacity (quint32),
+* and finally the data block (QByteArray) with the UTF-8 secrets.
+*/
+class KeyChainBridgeBundle
+{
+  public:
+
+    //! Format magic number, "KCBB"
+    static const quint32 MAGIC = 0x4B434242;
+
+    //! Current format version
+    static const quint16 VERSION = 1;
+
+    KeyChainBridgeBundle();
+    ~KeyChainBridgeBundle();
+
+    //! Whether there are no secrets
+    bool isEmpty() const { return mIndex.isEmpty(); }
+
+    //! Number of secrets
+    int count() const { return mIndex.size(); }
+
+    //! Names of the secrets
+    QStringList names() const { return mIndex.keys(); }
+
+    //! Whether there is a secret named \a name
+    bool contains( const QString &name ) const { return mIndex.contains( name ); }
+
+    //! The secret named \a name, a null string if not found
+    QString secret( const QString &name ) const;
+
+    //! Add or replace the secret named \a name
+    void setSecret( const QString &name, const QString &secret );
+
+    //! Remove the secret named \a name, returns false if not found
+    bool removeSecret( const QString &name );
+
+    //! Remove all the secrets
+    void clear();
+
+    //! Bytes of the data block not used by any secret
+    int wastedBytes() const { return mWasted; }
+
+    //! Size of the data block
+    int dataSize() const { return mData.size(); }
+
+    //! Serialized bundle
+    QByteArray toByteArray() const;
+
+    //! Load a serialized bundle, returns false (and leaves the bundle
+    //! untouched) if \a data is not a valid bundle
+    bool fromByteArray( const QByteArray &data );
+
+    //! Serialized bundle, as text for text-only wallet entries
+    QString toText() const;
+
+    //! Load a bundle serialized by toText()
+    bool fromText( const QString &text );
+
+    //! Whether \a text looks like a bundle serialized by toText()
+    static bool isBundleText( const QString &text );
+
+    //! Name of the master password of the auth DB \a authDbPath
+    static QString masterPasswordName( const QString &authDbPath );
+
+    //! Name of the entry recording which master password belongs to the
+    //! auth DB with identity \a authDbId, see authDbIdentity()
+    static QString authDbName( const QString &authDbId );
+
+    //! Identity of the auth DB \a authDbPath, that survives moving the file
+    //! and changes with the master password: a hash of the master password
+    //! salt. Empty if the DB cannot be read
+    static QString authDbIdentity( const QString &authDbPath );
+
+    //! Name of the master password stored for the auth DB with identity
+    //! \a authDbId, possibly under a previous path of the DB: a null string
+    //! if there is none
+    QString movedMasterPassword( const QString &authDbId ) const;
+
+  private:
+
+    //! Position of a secret in the data block
+    struct Slot
+    {
+      quint32 offset;
+      quint32 length;
+      quint32 capacity;
+    };
+
+    //! Capacity of a new slot for \a length bytes
+    static quint32 slotCapacity( quint32 length );
+
+    //! Order of the slots in the data block
+    static bool slotBefore( const Slot &a, const Slot &b );
+
+    //! Overwrite the slot with zeros
+    void wipe( const Slot &slot );
+
+    //! Pack all the secrets at the beginning of the data block
+    void compact();
+
+    QHash<QString, Slot> mIndex;
+
+    QByteArray mData;
+
+    int mWasted;
+};
+
+#endif //KeyChainBridgeBundle_H
@@ -0,0 +1,203 @@
+/***************************************************************************
+  keychainbridgecachebackend.cpp
+
+  Encrypted secret cache backend
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgecachebackend.h"
+#include "keychainbridgelog.h"
+#include "keychainbridgeretry.h"
+#include "keychainbridgesecretcache.h"
+
+
+KeyChainBridgeCacheBackend::KeyChainBridgeCacheBackend( KeyChainBridgeSecretCache *cache, KeyChainBridgeBackend *wallet, Mode mode, QObject *parent ):
+    KeyChainBridgeBackend( parent ),
+    mCache( cache ),
+    mWallet( wallet ),
+    mMode( mode ),
+    mFallbackDelay( 0 ),
+    mFallbackCount( 0 )
+{
+  Q_ASSERT( mCache );
+  if ( mWallet )
+  {
+    mWallet->setParent( this );
+  }
+  mFallbackTimer.setSingleShot( true );
+  connect( &mFallbackTimer, SIGNAL( timeout() ), this, SLOT( fallbackTimeout() ) );
+}
+
+KeyChainBridgeCacheBackend::~KeyChainBridgeCacheBackend()
+{
+  delete mCache;
+}
+
+void KeyChainBridgeCacheBackend::start( KeyChainBridgeWalletJob *job )
+{
+  if ( ! mCache->isLoaded() && ! mCache->load() )
+  {
+    KEYCHAINBRIDGE_WARNING( Wallet, QString( "Secret cache unavailable: %1" ).arg( mCache->errorString() ) );
+  }
+  if ( ! mWallet || ( mMode == Primary && job->type() == KeyChainBridgeWalletJob::Read && mCache->contains( job->service(), job->key() ) ) )
+  {
+    answerLocally( job );
+    return;
+  }
+
+  KeyChainBridgeWalletJob *walletJob = new KeyChainBridgeWalletJob( job->type(), job->service(), job->key(), this );
+  walletJob->setTextData( job->textData() );
+  mForwarded.insert( walletJob, job );
+  connect( walletJob, SIGNAL( finished( KeyChainBridgeWalletJob* ) ), this, SLOT( walletJobFinished( KeyChainBridgeWalletJob* ) ) );
+  startJob( walletJob );
+  mWallet->start( walletJob );
+  // Only reads are answered early: a write or a delete reported before the
+  // wallet has done it could be lost. A slow wallet may also be one waiting
+  // for the user to unlock it, which is why the delay is opt-in
+  if ( mFallbackDelay > 0 && job->type() == KeyChainBridgeWalletJob::Read && mCache->isLoaded() )
+  {
+    mSlowJob = job;
+    mFallbackTimer.start( mFallbackDelay );
+  }
+}
+
+void KeyChainBridgeCacheBackend::answerLocally( KeyChainBridgeWalletJob *job )
+{
+  mLocal.enqueue( job );
+  // Never complete synchronously
+  QTimer::singleShot( 0, this, SLOT( processLocal() ) );
+}
+
+void KeyChainBridgeCacheBackend::processLocal()
+{
+  if ( mLocal.isEmpty() )
+  {
+    return;
+  }
+  QPointer<KeyChainBridgeWalletJob> job = mLocal.dequeue();
+  if ( ! job || job->isDone() )
+  {
+    return;
+  }
+  if ( ! mCache->isLoaded() )
+  {
+    finishJob( job, QKeychain::NoBackendAvailable, mCache->errorString() );
+  }
+  else if ( ! complete( job ) )
+  {
+    if ( job->type() == KeyChainBridgeWalletJob::Write )
+    {
+      finishJob( job, QKeychain::OtherError, mCache->errorString() );
+    }
+    else
+    {
+      finishJob( job, QKeychain::EntryNotFound, tr( "Entry not found" ) );
+    }
+  }
+}
+
+bool KeyChainBridgeCacheBackend::complete( KeyChainBridgeWalletJob *job )
+{
+  switch ( job->type() )
+  {
+    case KeyChainBridgeWalletJob::Read:
+    {
+      QString secret( mCache->secret( job->service(), job->key() ) );
+      if ( secret.isNull() )
+      {
+        return false;
+      }
+      finishJob( job, QKeychain::NoError, QString(), secret );
+      return true;
+    }
+    case KeyChainBridgeWalletJob::Write:
+      if ( ! mCache->setSecret( job->service(), job->key(), job->textData() ) )
+      {
+        return false;
+      }
+      finishJob( job, QKeychain::NoError, QString() );
+      return true;
+    case KeyChainBridgeWalletJob::Delete:
+      if ( ! mCache->removeSecret( job->service(), job->key() ) )
+      {
+        return false;
+      }
+      finishJob( job, QKeychain::NoError, QString() );
+      return true;
+  }
+  return false;
+}
+
+void KeyChainBridgeCacheBackend::walletJobFinished( KeyChainBridgeWalletJob *walletJob )
+{
+  QPointer<KeyChainBridgeWalletJob> job = mForwarded.take( walletJob );
+  walletJob->deleteLater();
+  if ( job && job == mSlowJob )
+  {
+    mFallbackTimer.stop();
+    mSlowJob = nullptr;
+  }
+  QKeychain::Error error = walletJob->error();
+
+  // Follow the wallet, even if the job has already been answered by the cache
+  if ( mCache->isLoaded() && walletJob->state() == KeyChainBridgeWalletJob::Finished )
+  {
+    QString service( walletJob->service() );
+    QString key( walletJob->key() );
+    if ( error == QKeychain::NoError && walletJob->type() == KeyChainBridgeWalletJob::Delete )
+    {
+      mCache->removeSecret( service, key );
+    }
+    else if ( error == QKeychain::NoError && mCache->secret( service, key ) != walletJob->textData() )
+    {
+      mCache->setSecret( service, key, walletJob->textData() );
+    }
+    else if ( error == QKeychain::EntryNotFound && walletJob->type() != KeyChainBridgeWalletJob::Write )
+    {
+      // Removed from the wallet behind our back
+      mCache->removeSecret( service, key );
+    }
+  }
+
+  if ( ! job || job->isDone() )
+  {
+    return;
+  }
+  // Writes and deletes report what the wallet did
+  if ( error != QKeychain::NoError && job->type() == KeyChainBridgeWalletJob::Read && canFallBack( error )
+       && mCache->isLoaded() && complete( job ) )
+  {
+    ++mFallbackCount;
+    KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Wallet error %1, answered from the secret cache." ).arg( error ) );
+    return;
+  }
+  finishJob( job, error, walletJob->errorString(), walletJob->textData() );
+}
+
+void KeyChainBridgeCacheBackend::fallbackTimeout()
+{
+  QPointer<KeyChainBridgeWalletJob> job = mSlowJob;
+  mSlowJob = nullptr;
+  // Nothing cached: keep waiting for the wallet
+  if ( job && ! job->isDone() && complete( job ) )
+  {
+    ++mFallbackCount;
+    KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Wallet slower than %1 ms, answered from the secret cache." ).arg( mFallbackDelay ) );
+  }
+}
+
+bool KeyChainBridgeCacheBackend::canFallBack( QKeychain::Error error )
+{
+  // The wallet is missing or broken, but not refusing
+  return error == QKeychain::NoBackendAvailable || error == QKeychain::NotImplemented
+         || KeyChainBridgeRetryScheduler::classify( error ) == KeyChainBridgeRetryScheduler::Transient;
+}
@@ -0,0 +1,121 @@
+/***************************************************************************
+    keychainbridgecachebackend.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeCacheBackend_H
+#define KeyChainBridgeCacheBackend_H
+
+//QT4 includes
+#include <QHash>
+#include <QPointer>
+#include <QQueue>
+#include <QTimer>
+
+#include "keychainbridgebackend.h"
+
+//forward declarations
+class KeyChainBridgeSecretCache;
+
+
+/**
+* \class KeyChainBridgeCacheBackend
+* \brief The encrypted secret cache in front of, or behind, another backend
+* Without a wallet backend the cache is the only store. With a wallet
+* backend, the cache follows every successful wallet operation and answers
+* reads in its place when the wallet is missing, failing or, if enabled,
+* slower than fallbackDelay(): an explicit denial from the user is never
+* bypassed. Writes and deletes always report the outcome of the wallet.
+*/
+class KeyChainBridgeCacheBackend : public KeyChainBridgeBackend
+{
+    Q_OBJECT
+  public:
+
+    //! Role of the cache
+    enum Mode
+    {
+      Primary,  //!< Reads are answered from the cache, the wallet is read on a miss
+      Fallback  //!< Reads are answered from the wallet, the cache stands in for it
+    };
+
+    //! Takes ownership of \a cache and \a wallet, that may be null
+    KeyChainBridgeCacheBackend( KeyChainBridgeSecretCache *cache, KeyChainBridgeBackend *wallet = nullptr, Mode mode = Fallback, QObject *parent = nullptr );
+    ~KeyChainBridgeCacheBackend();
+
+    QString name() const override { return QString( "cache" ); }
+
+    void start( KeyChainBridgeWalletJob *job ) override;
+
+    Mode mode() const { return mMode; }
+
+    KeyChainBridgeSecretCache *cache() const { return mCache; }
+
+    //! The wallet backend, null if the cache is the only store
+    KeyChainBridgeBackend *wallet() const { return mWallet; }
+
+    //! Time after which the cache answers a read for a wallet that has not
+    //! yet, in milliseconds, 0 (the default) to always wait for the wallet
+    int fallbackDelay() const { return mFallbackDelay; }
+
+    //! Set the time after which the cache answers for the wallet
+    void setFallbackDelay( int msecs ) { mFallbackDelay = msecs; }
+
+    //! Number of operations the cache has answered in place of the wallet
+    int fallbackCount() const { return mFallbackCount; }
+
+  private slots:
+
+    //! Answer the oldest job that does not involve the wallet
+    void processLocal();
+
+    //! The wallet backend has answered
+    void walletJobFinished( KeyChainBridgeWalletJob *walletJob );
+
+    //! The wallet is slow: answer the read from the cache
+    void fallbackTimeout();
+
+  private:
+
+    //! Answer \a job from the cache alone, on the next event loop turn
+    void answerLocally( KeyChainBridgeWalletJob *job );
+
+    //! Complete \a job from the cache, returns false if it cannot
+    bool complete( KeyChainBridgeWalletJob *job );
+
+    //! Whether the cache may answer after the wallet failed with \a error
+    static bool canFallBack( QKeychain::Error error );
+
+    KeyChainBridgeSecretCache *mCache;
+
+    KeyChainBridgeBackend *mWallet;
+
+    Mode mMode;
+
+    int mFallbackDelay;
+
+    int mFallbackCount;
+
+    //! Jobs answered by the cache alone
+    QQueue<QPointer<KeyChainBridgeWalletJob> > mLocal;
+
+    //! Jobs sent to the wallet backend, by wallet backend job
+    QHash<KeyChainBridgeWalletJob*, QPointer<KeyChainBridgeWalletJob> > mForwarded;
+
+    //! The read waiting for the wallet, if the fallback timer is running
+    QPointer<KeyChainBridgeWalletJob> mSlowJob;
+
+    QTimer mFallbackTimer;
+};
+
+#endif //KeyChainBridgeCacheBackend_H
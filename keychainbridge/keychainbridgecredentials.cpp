@@ -0,0 +1,195 @@
+/***************************************************************************
+  keychainbridgecredentials.cpp
+
+  Chaining QgsCredentials implementation backed by the wallet
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgecredentials.h"
+#include "keychainbridgetrace.h"
+
+#include <QMutexLocker>
+#include <QThread>
+
+
+KeyChainBridgeCredentials::KeyChainBridgeCredentials( QgsCredentials *fallback, QObject *parent ):
+    QObject( parent ),
+    mFallback( fallback ),
+    mTimeToLive( 0 ),
+    mIdleTimeout( 0 )
+{
+  Q_ASSERT( fallback );
+  mEvictionTimer.setSingleShot( true );
+  connect( &mEvictionTimer, SIGNAL( timeout() ), this, SLOT( evictExpired() ) );
+  setInstance( this );
+}
+
+KeyChainBridgeCredentials::~KeyChainBridgeCredentials()
+{
+  // Our code is about to be unloaded: give the instance back
+  if ( QgsCredentials::instance() == this )
+  {
+    setInstance( mFallback );
+  }
+}
+
+void KeyChainBridgeCredentials::setMasterPassword( const KeyChainBridgeSecret &password )
+{
+  {
+    QMutexLocker locker( &mMutex );
+    mMasterPassword.assign( password );
+    mSetTimer.start();
+    mUsedTimer.start();
+  }
+  scheduleEviction();
+}
+
+void KeyChainBridgeCredentials::clearMasterPassword()
+{
+  QMutexLocker locker( &mMutex );
+  mMasterPassword.clear();
+}
+
+bool KeyChainBridgeCredentials::hasMasterPassword() const
+{
+  QMutexLocker locker( &mMutex );
+  return ! mMasterPassword.isEmpty() && timeLeft() != 0;
+}
+
+void KeyChainBridgeCredentials::setTimeToLive( int msecs )
+{
+  {
+    QMutexLocker locker( &mMutex );
+    mTimeToLive = qMax( 0, msecs );
+  }
+  scheduleEviction();
+}
+
+void KeyChainBridgeCredentials::setIdleTimeout( int msecs )
+{
+  {
+    QMutexLocker locker( &mMutex );
+    mIdleTimeout = qMax( 0, msecs );
+  }
+  scheduleEviction();
+}
+
+qint64 KeyChainBridgeCredentials::timeLeft() const
+{
+  qint64 left = -1;
+  if ( mTimeToLive > 0 )
+  {
+    left = qMax( Q_INT64_C( 0 ), mTimeToLive - mSetTimer.elapsed() );
+  }
+  if ( mIdleTimeout > 0 )
+  {
+    qint64 idleLeft = qMax( Q_INT64_C( 0 ), mIdleTimeout - mUsedTimer.elapsed() );
+    left = left < 0 ? idleLeft : qMin( left, idleLeft );
+  }
+  return left;
+}
+
+void KeyChainBridgeCredentials::scheduleEviction()
+{
+  // Timers only work in their thread: the lookups check the expiry anyway
+  if ( QThread::currentThread() != thread() )
+  {
+    return;
+  }
+  qint64 left;
+  {
+    QMutexLocker locker( &mMutex );
+    left = mMasterPassword.isEmpty() ? -1 : timeLeft();
+  }
+  if ( left < 0 )
+  {
+    mEvictionTimer.stop();
+  }
+  else
+  {
+    mEvictionTimer.start( static_cast<int>( left ) );
+  }
+}
+
+void KeyChainBridgeCredentials::evictExpired()
+{
+  bool expired;
+  {
+    QMutexLocker locker( &mMutex );
+    expired = ! mMasterPassword.isEmpty() && timeLeft() == 0;
+    if ( expired )
+    {
+      mMasterPassword.clear();
+    }
+  }
+  if ( expired )
+  {
+    KeyChainBridgeTrace::instance()->record( KeyChainBridgeTrace::MasterPasswordExpired );
+    emit masterPasswordExpired();
+  }
+  else
+  {
+    // Used in the meantime
+    scheduleEviction();
+  }
+}
+
+bool KeyChainBridgeCredentials::request( const QString& realm, QString &username, QString &password, const QString& message )
+{
+  emit credentialsRequested();
+  // Not our business
+  return mFallback->get( realm, username, password, message );
+}
+
+bool KeyChainBridgeCredentials::fromMemory( QString &password )
+{
+  QMutexLocker locker( &mMutex );
+  // Expired: the timer wipes it, if it has not yet
+  if ( mMasterPassword.isEmpty() || timeLeft() == 0 )
+  {
+    return false;
+  }
+  mUsedTimer.start();
+  // The QgsCredentials API takes a QString: that copy belongs to the
+  // caller, it cannot be wiped here
+  password = mMasterPassword.toString();
+  return true;
+}
+
+bool KeyChainBridgeCredentials::requestMasterPassword( QString &password, bool stored )
+{
+  emit credentialsRequested();
+  // A new master password is being set: only the user can choose it
+  if ( ! stored )
+  {
+    return mFallback->getMasterPassword( password, stored );
+  }
+  bool served = fromMemory( password );
+  if ( ! served )
+  {
+    KeyChainBridgeTrace::instance()->record( KeyChainBridgeTrace::MasterPasswordMissing );
+  }
+  // Receivers may wait for the wallet: never from other threads
+  if ( ! served && QThread::currentThread() == thread() )
+  {
+    emit masterPasswordMissing();
+    served = fromMemory( password );
+  }
+  if ( served )
+  {
+    KeyChainBridgeTrace::instance()->record( KeyChainBridgeTrace::MasterPasswordServed );
+    emit masterPasswordServed();
+    return true;
+  }
+  // Miss: let the user type it
+  return mFallback->getMasterPassword( password, stored );
+}
@@ -0,0 +1,141 @@
+/***************************************************************************
+    keychainbridgecredentials.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeCredentials_H
+#define KeyChainBridgeCredentials_H
+
+//QT4 includes
+#include <QElapsedTimer>
+#include <QObject>
+#include <QMutex>
+#include <QString>
+#include <QTimer>
+
+//QGIS includes
+#include "qgscredentials.h"
+
+#include "keychainbridgesecret.h"
+
+
+/**
+* \class KeyChainBridgeCredentials
+* \brief Chaining QgsCredentials implementation
+* Registers itself as the QgsCredentials instance and answers the requests
+* for the stored master password with the password read from the wallet,
+* without any GUI. Everything else, including the requests for a new master
+* password and the requests that cannot be answered from memory, is
+* forwarded to the previous instance (normally the QGIS credentials dialog).
+* The master password is only kept for timeToLive() after it has been set,
+* and for idleTimeout() after it has last been used: it is then wiped, and
+* the next request misses.
+* The previous instance is restored when this object is destroyed.
+*/
+class KeyChainBridgeCredentials : public QObject, public QgsCredentials
+{
+    Q_OBJECT
+  public:
+
+    //! Register as the QgsCredentials instance, chaining \a fallback
+    explicit KeyChainBridgeCredentials( QgsCredentials *fallback, QObject *parent = nullptr );
+    //! Destructor, restores the fallback as the QgsCredentials instance
+    ~KeyChainBridgeCredentials();
+
+    //! The instance requests are forwarded to on a miss
+    QgsCredentials *fallback() const { return mFallback; }
+
+    //! Set the master password to answer requests with, copied in the
+    //! buffer already held if it fits
+    void setMasterPassword( const KeyChainBridgeSecret &password );
+
+    //! Forget the master password, next requests go to the fallback
+    void clearMasterPassword();
+
+    //! Whether a master password is available in memory, and not expired
+    bool hasMasterPassword() const;
+
+    //! Time the master password is kept for once set, in milliseconds
+    int timeToLive() const { return mTimeToLive; }
+
+    //! Set the time the master password is kept for once set, 0 for ever
+    void setTimeToLive( int msecs );
+
+    //! Time the master password is kept for without being used, in milliseconds
+    int idleTimeout() const { return mIdleTimeout; }
+
+    //! Set the time the master password is kept for without being used, 0 for ever
+    void setIdleTimeout( int msecs );
+
+  signals:
+
+    //! A request has been received, before it is answered
+    //! Note: this may be emitted from a thread other than the GUI thread
+    void credentialsRequested();
+
+    //! A master password request has been answered from memory
+    //! Note: this may be emitted from a thread other than the GUI thread
+    void masterPasswordServed();
+
+    //! A master password request cannot be answered from memory: receivers
+    //! connected directly may call setMasterPassword() before the request
+    //! falls back to the dialog. Only emitted in this object's thread
+    void masterPasswordMissing();
+
+    //! The master password in memory has expired and has been wiped
+    void masterPasswordExpired();
+
+  protected:
+
+    bool request( const QString& realm, QString &username, QString &password, const QString& message = QString::null ) override;
+
+    bool requestMasterPassword( QString &password, bool stored = false ) override;
+
+  private slots:
+
+    //! Wipe the master password if it has expired, or wait until it does
+    void evictExpired();
+
+  private:
+
+    //! Copy the master password in memory to \a password, if any
+    bool fromMemory( QString &password );
+
+    //! Milliseconds before the master password expires, -1 if it never
+    //! does. Call with the mutex locked
+    qint64 timeLeft() const;
+
+    //! Start the timer for the next expiry, if any
+    void scheduleEviction();
+
+    QgsCredentials *mFallback;
+
+    //! Requests may come from any thread
+    mutable QMutex mMutex;
+
+    KeyChainBridgeSecret mMasterPassword;
+
+    int mTimeToLive;
+
+    int mIdleTimeout;
+
+    //! Since the master password has been set
+    QElapsedTimer mSetTimer;
+
+    //! Since the master password has been set or last served
+    QElapsedTimer mUsedTimer;
+
+    QTimer mEvictionTimer;
+};
+
+#endif //KeyChainBridgeCredentials_H
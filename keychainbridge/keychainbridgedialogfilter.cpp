@@ -0,0 +1,86 @@
+/***************************************************************************
+  keychainbridgedialogfilter.cpp
+
+  Event filter for the QGIS credentials dialog
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgedialogfilter.h"
+
+#include <QEvent>
+#include <QLineEdit>
+#include <QStackedWidget>
+
+#include "qgscredentialdialog.h"
+
+
+KeyChainBridgeDialogFilter::KeyChainBridgeDialogFilter( QgsCredentialDialog *dialog, QObject *parent ):
+    QObject( parent ),
+    mDialog( dialog )
+{
+  Q_ASSERT( dialog );
+  resolveChildren();
+  dialog->installEventFilter( this );
+}
+
+KeyChainBridgeDialogFilter::~KeyChainBridgeDialogFilter()
+{
+  if ( mDialog )
+  {
+    mDialog->removeEventFilter( this );
+  }
+}
+
+bool KeyChainBridgeDialogFilter::eventFilter( QObject *obj, QEvent *event )
+{
+  // This runs for every single event the dialog gets: bail out first
+  if ( event->type() != QEvent::Show )
+  {
+    return false;
+  }
+  Q_UNUSED( obj );
+  if ( isMasterPasswordPage() )
+  {
+    emit masterPasswordRequested();
+  }
+  return false;
+}
+
+QLineEdit *KeyChainBridgeDialogFilter::masterPasswordEdit()
+{
+  resolveChildren();
+  return mMasterPasswordEdit;
+}
+
+bool KeyChainBridgeDialogFilter::isMasterPasswordPage()
+{
+  resolveChildren();
+  return mStackedWidget && mStackedWidget->currentIndex() == 1;
+}
+
+void KeyChainBridgeDialogFilter::resolveChildren()
+{
+  if ( ! mDialog )
+  {
+    return;
+  }
+  if ( ! mStackedWidget )
+  {
+    mStackedWidget = mDialog->findChild<QStackedWidget*>( "stackedWidget" );
+    Q_ASSERT( mStackedWidget );
+  }
+  if ( ! mMasterPasswordEdit )
+  {
+    mMasterPasswordEdit = mDialog->findChild<QLineEdit*>( "leMasterPass" );
+    Q_ASSERT( mMasterPasswordEdit );
+  }
+}
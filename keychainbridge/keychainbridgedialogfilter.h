@@ -0,0 +1,77 @@
+/***************************************************************************
+    keychainbridgedialogfilter.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeDialogFilter_H
+#define KeyChainBridgeDialogFilter_H
+
+//QT4 includes
+#include <QObject>
+#include <QPointer>
+
+//forward declarations
+class QEvent;
+class QLineEdit;
+class QStackedWidget;
+
+class QgsCredentialDialog;
+
+
+/**
+* \class KeyChainBridgeDialogFilter
+* \brief Event filter for the QGIS credentials dialog
+* The filter sees every event the dialog receives (paint, mouse, key ...),
+* so anything but a show event is rejected before any other work is done.
+* The dialog children are looked up once, and guarded in case the dialog
+* gets rebuilt or destroyed.
+*/
+class KeyChainBridgeDialogFilter : public QObject
+{
+    Q_OBJECT
+  public:
+
+    //! Install the filter on \a dialog
+    explicit KeyChainBridgeDialogFilter( QgsCredentialDialog *dialog, QObject *parent = nullptr );
+    //! Destructor, removes the filter from the dialog
+    ~KeyChainBridgeDialogFilter();
+
+    bool eventFilter( QObject *obj, QEvent *event ) override;
+
+    //! The filtered dialog, null if it has been destroyed
+    QgsCredentialDialog *dialog() const { return mDialog; }
+
+    //! The master password line edit, null if not available
+    QLineEdit *masterPasswordEdit();
+
+    //! Whether the dialog is showing the master password page
+    bool isMasterPasswordPage();
+
+  signals:
+
+    //! The dialog is about to be shown to ask for the master password
+    void masterPasswordRequested();
+
+  private:
+
+    //! Look up the dialog children, if not already done
+    void resolveChildren();
+
+    QPointer<QgsCredentialDialog> mDialog;
+
+    QPointer<QStackedWidget> mStackedWidget;
+
+    QPointer<QLineEdit> mMasterPasswordEdit;
+};
+
+#endif //KeyChainBridgeDialogFilter_H
@@ -0,0 +1,205 @@
+/***************************************************************************
+  keychainbridgeheadless.cpp
+
+  Unlock the auth manager without any GUI
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgeheadless.h"
+#include "keychainbridge.h"
+#include "keychainbridgebackend.h"
+#include "keychainbridgebundle.h"
+#include "keychainbridgelog.h"
+#include "keychainbridgesettings.h"
+#include "keychainbridgewallet.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+
+#include "qgsauthmanager.h"
+
+// Maximum time to wait for the wallet, in milliseconds
+const int HEADLESS_WALLET_TIMEOUT = 10000;
+
+const char *KeyChainBridgeHeadless::PASSWORD_FILE_VARIABLE = "QGIS_AUTH_PASSWORD_FILE";
+
+
+KeyChainBridgeHeadless::KeyChainBridgeHeadless( const QString &settingsGroup, QgsAuthManager *authManager, QObject *parent ):
+    QObject( parent ),
+    mSettingsGroup( settingsGroup ),
+    mAuthManager( authManager ? authManager : QgsAuthManager::instance() ),
+    mWalletTimeout( HEADLESS_WALLET_TIMEOUT ),
+    mWalletError( QKeychain::NoError )
+{
+}
+
+KeyChainBridgeHeadless::Result KeyChainBridgeHeadless::unlock()
+{
+  mErrorMessage.clear();
+  if ( mAuthManager->isDisabled() )
+  {
+    mErrorMessage = tr( "Authentication system is disabled: %1" ).arg( mAuthManager->disabledMessage() );
+    return AuthDisabled;
+  }
+  if ( mAuthManager->masterPasswordIsSet() )
+  {
+    return AlreadyUnlocked;
+  }
+  // Verification would otherwise ask for a new master password
+  if ( ! mAuthManager->masterPasswordHashInDb() )
+  {
+    mErrorMessage = tr( "No master password has been set in the authentication database." );
+    return NoPassword;
+  }
+
+  KeyChainBridgeSecret password;
+  readWallet( password );
+  if ( ! password.isEmpty() )
+  {
+    if ( setMasterPassword( password ) )
+    {
+      return UnlockedFromWallet;
+    }
+    KEYCHAINBRIDGE_WARNING( Plugin, tr( "The master password stored in the wallet is not valid." ) );
+  }
+
+  KeyChainBridgeSecret filePassword;
+  readPasswordFile( filePassword );
+  if ( ! filePassword.isEmpty() )
+  {
+    if ( setMasterPassword( filePassword ) )
+    {
+      return UnlockedFromFile;
+    }
+  }
+  if ( password.isEmpty() && filePassword.isEmpty() )
+  {
+    if ( mErrorMessage.isEmpty() )
+    {
+      mErrorMessage = tr( "No master password found in the wallet or in the file set by %1." ).arg( PASSWORD_FILE_VARIABLE );
+    }
+    return NoPassword;
+  }
+  mErrorMessage = tr( "The master password found is not valid." );
+  return InvalidPassword;
+}
+
+void KeyChainBridgeHeadless::readWallet( KeyChainBridgeSecret &password )
+{
+  KeyChainBridgeSettings settings( mSettingsGroup );
+  if ( ! settings.useWallet() )
+  {
+    return;
+  }
+  KeyChainBridgeWallet wallet( KeyChainBridge::sWalletFolderName, KeyChainBridgeBackend::create( settings ) );
+  // A single attempt: the batch job might as well use the file
+  wallet.retryScheduler()->setMaxRetries( 0 );
+  wallet.setTimeout( mWalletTimeout );
+  QElapsedTimer timer;
+  timer.start();
+  QString secret;
+  readEntry( wallet, KeyChainBridge::sBundleName );
+  if ( mWalletError == QKeychain::NoError )
+  {
+    KeyChainBridgeBundle bundle;
+    if ( bundle.fromText( mWalletText ) )
+    {
+      QString name( KeyChainBridgeBundle::masterPasswordName( mAuthManager->authenticationDbPath() ) );
+      // The profile may have been moved
+      if ( ! bundle.contains( name ) )
+      {
+        name = bundle.movedMasterPassword( KeyChainBridgeBundle::authDbIdentity( mAuthManager->authenticationDbPath() ) );
+      }
+      if ( ! name.isNull() )
+      {
+        secret = bundle.secret( name );
+      }
+    }
+    KeyChainBridgeSecret::wipe( mWalletText );
+  }
+  // Not in the bundle: it may have been stored by an older version
+  if ( secret.isEmpty() && ( mWalletError == QKeychain::NoError || mWalletError == QKeychain::EntryNotFound ) )
+  {
+    // Both reads together within the timeout
+    wallet.setTimeout( qMax( 1, mWalletTimeout - static_cast<int>( timer.elapsed() ) ) );
+    readEntry( wallet, KeyChainBridge::sMasterPasswordName );
+    if ( mWalletError == QKeychain::NoError )
+    {
+      secret = mWalletText;
+      KeyChainBridgeSecret::wipe( mWalletText );
+    }
+  }
+  if ( mWalletError != QKeychain::NoError )
+  {
+    KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Headless wallet READ failed with error %1." ).arg( mWalletError ) );
+    return;
+  }
+  password.assign( secret );
+  KeyChainBridgeSecret::wipe( secret );
+}
+
+void KeyChainBridgeHeadless::readEntry( KeyChainBridgeWallet &wallet, const QString &key )
+{
+  mWalletText.clear();
+  mWalletError = QKeychain::OtherError;
+  wallet.readPassword( key, this, SLOT( walletRead( KeyChainBridgeWalletJob* ) ) );
+  // Completion (or timeout) quits the loop
+  mLoop.exec( QEventLoop::ExcludeUserInputEvents );
+}
+
+void KeyChainBridgeHeadless::walletRead( KeyChainBridgeWalletJob *job )
+{
+  if ( job->state() == KeyChainBridgeWalletJob::Finished )
+  {
+    mWalletError = job->error();
+    mWalletText = job->textData();
+  }
+  mLoop.quit();
+}
+
+void KeyChainBridgeHeadless::readPasswordFile( KeyChainBridgeSecret &password )
+{
+  QString fileName( QString::fromLocal8Bit( qgetenv( PASSWORD_FILE_VARIABLE ) ) );
+  if ( fileName.isEmpty() )
+  {
+    return;
+  }
+  QFile file( fileName );
+  if ( ! file.open( QIODevice::ReadOnly ) )
+  {
+    mErrorMessage = tr( "The master password file %1 cannot be read." ).arg( fileName );
+    return;
+  }
+  if ( file.permissions() & ( QFile::ReadOther | QFile::ReadGroup ) )
+  {
+    KEYCHAINBRIDGE_WARNING( Plugin, tr( "The master password file %1 can be read by other users." ).arg( fileName ) );
+  }
+  // First line, without the line terminator
+  QByteArray line( file.readLine() );
+  while ( line.endsWith( '\n' ) || line.endsWith( '\r' ) )
+  {
+    line.chop( 1 );
+  }
+  QString text( QString::fromUtf8( line ) );
+  KeyChainBridgeSecret::wipe( line );
+  password.assign( text );
+  KeyChainBridgeSecret::wipe( text );
+}
+
+bool KeyChainBridgeHeadless::setMasterPassword( const KeyChainBridgeSecret &password )
+{
+  // The auth manager takes a QString
+  QString plain( password.toString() );
+  bool ok = mAuthManager->setMasterPassword( plain, true );
+  KeyChainBridgeSecret::wipe( plain );
+  return ok;
+}
@@ -0,0 +1,116 @@
+/***************************************************************************
+    keychainbridgeheadless.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeHeadless_H
+#define KeyChainBridgeHeadless_H
+
+//QT4 includes
+#include <QEventLoop>
+#include <QObject>
+#include <QString>
+
+// QtKeyChain library
+#include "qtkeychain/keychain.h"
+
+#include "keychainbridgesecret.h"
+
+//forward declarations
+class QgsAuthManager;
+
+class KeyChainBridgeWallet;
+class KeyChainBridgeWalletJob;
+
+
+/**
+* \class KeyChainBridgeHeadless
+* \brief Unlock the auth manager without any GUI
+* For batch tools and servers: the master password is read from the wallet
+* or, failing that, from the file named by the QGIS_AUTH_PASSWORD_FILE
+* environment variable, and it is verified and set in the auth manager.
+* Nothing is ever asked to the user, not even on the console.
+* QgsApplication must have been initialized.
+*/
+class KeyChainBridgeHeadless : public QObject
+{
+    Q_OBJECT
+  public:
+
+    //! Outcome of unlock()
+    enum Result
+    {
+      AlreadyUnlocked,     //!< The master password was already set
+      UnlockedFromWallet,  //!< Unlocked with the password from the wallet
+      UnlockedFromFile,    //!< Unlocked with the password from the file
+      NoPassword,          //!< No password was found (or there is nothing to unlock)
+      InvalidPassword,     //!< The password found was rejected
+      AuthDisabled         //!< The auth system is disabled
+    };
+
+    //! \a settingsGroup is the plugin settings group
+    explicit KeyChainBridgeHeadless( const QString &settingsGroup, QgsAuthManager *authManager = nullptr, QObject *parent = nullptr );
+
+    //! Unlock the auth manager, blocking for at most walletTimeout() on the wallet
+    Result unlock();
+
+    //! Description of the last unlock() failure
+    QString errorMessage() const { return mErrorMessage; }
+
+    //! Maximum time to wait for the wallet, in milliseconds
+    int walletTimeout() const { return mWalletTimeout; }
+
+    //! Set the maximum time to wait for the wallet, in milliseconds
+    void setWalletTimeout( int msecs ) { mWalletTimeout = msecs; }
+
+    //! Environment variable with the path of the fallback password file
+    static const char *PASSWORD_FILE_VARIABLE;
+
+  private slots:
+
+    //! The wallet read started by readWallet() is done
+    void walletRead( KeyChainBridgeWalletJob *job );
+
+  private:
+
+    //! Master password from the wallet in \a password, left empty if not available
+    void readWallet( KeyChainBridgeSecret &password );
+
+    //! Read the \a key entry into mWalletText and mWalletError
+    void readEntry( KeyChainBridgeWallet &wallet, const QString &key );
+
+    //! Master password from the fallback file in \a password, left empty if
+    //! not available
+    void readPasswordFile( KeyChainBridgeSecret &password );
+
+    //! Verify and set \a password
+    bool setMasterPassword( const KeyChainBridgeSecret &password );
+
+    QString mSettingsGroup;
+
+    QgsAuthManager *mAuthManager;
+
+    int mWalletTimeout;
+
+    QString mErrorMessage;
+
+    //! Runs while waiting for the wallet
+    QEventLoop mLoop;
+
+    //! Outcome of the wallet read
+    QString mWalletText;
+
+    QKeychain::Error mWalletError;
+};
+
+#endif //KeyChainBridgeHeadless_H
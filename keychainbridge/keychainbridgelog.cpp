@@ -0,0 +1,55 @@
+/***************************************************************************
+  keychainbridgelog.cpp
+
+  Plugin logging, by category and level
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgelog.h"
+
+#include "qgsmessagelog.h"
+
+// Off by default, like the plugin setting
+int KeyChainBridgeLog::sLevel = KeyChainBridgeLog::Disabled;
+int KeyChainBridgeLog::sCategories = KeyChainBridgeLog::AllCategories;
+
+static QString sTag( "KeyChain" );
+
+
+void KeyChainBridgeLog::setTag( const QString &tag )
+{
+  sTag = tag;
+}
+
+void KeyChainBridgeLog::log( Category category, Level level, const QString &message )
+{
+  QgsMessageLog::logMessage( QString( "[%1] %2" ).arg( categoryName( category ), message ),
+                             sTag,
+                             level >= Warning ? QgsMessageLog::WARNING : QgsMessageLog::INFO );
+}
+
+QString KeyChainBridgeLog::categoryName( Category category )
+{
+  switch ( category )
+  {
+    case Plugin:
+      return QString( "plugin" );
+    case Wallet:
+      return QString( "wallet" );
+    case Dialog:
+      return QString( "dialog" );
+    case Verification:
+      return QString( "verification" );
+    default:
+      return QString( "all" );
+  }
+}
@@ -0,0 +1,99 @@
+/***************************************************************************
+    keychainbridgelog.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeLog_H
+#define KeyChainBridgeLog_H
+
+//QT4 includes
+#include <QString>
+
+
+/**
+* \class KeyChainBridgeLog
+* \brief Plugin logging, by category and level
+* Always log through the KEYCHAINBRIDGE_LOG macros: the message expression
+* (translation, formatting, temporaries) is only evaluated when the
+* category and level are enabled, so disabled logging costs an integer
+* comparison.
+*/
+class KeyChainBridgeLog
+{
+  public:
+
+    //! Message categories, can be combined in a mask
+    enum Category
+    {
+      Plugin = 1,
+      Wallet = 2,
+      Dialog = 4,
+      Verification = 8,
+      AllCategories = Plugin | Wallet | Dialog | Verification
+    };
+
+    //! Message levels, messages below the current level are discarded
+    enum Level
+    {
+      Debug = 0,
+      Info = 1,
+      Warning = 2,
+      Disabled = 3
+    };
+
+    //! Whether messages of \a category and \a level are logged
+    static bool isEnabled( Category category, Level level )
+    {
+      return level >= sLevel && ( sCategories & category );
+    }
+
+    //! Current level
+    static Level level() { return static_cast<Level>( sLevel ); }
+
+    //! Set the level, Disabled turns logging off
+    static void setLevel( Level level ) { sLevel = level; }
+
+    //! Enabled categories mask
+    static int categories() { return sCategories; }
+
+    //! Set the enabled categories mask
+    static void setCategories( int categories ) { sCategories = categories; }
+
+    //! Message log tab the messages go to
+    static void setTag( const QString &tag );
+
+    //! Log \a message unconditionally, use the macros instead
+    static void log( Category category, Level level, const QString &message );
+
+    //! Human readable category name
+    static QString categoryName( Category category );
+
+  private:
+
+    static int sLevel;
+
+    static int sCategories;
+};
+
+//! Log \a msg if \a category and \a level are enabled, \a msg is not evaluated otherwise
+#define KEYCHAINBRIDGE_LOG( category, level, msg ) \
+  do { \
+    if ( KeyChainBridgeLog::isEnabled( KeyChainBridgeLog::category, KeyChainBridgeLog::level ) ) \
+      KeyChainBridgeLog::log( KeyChainBridgeLog::category, KeyChainBridgeLog::level, msg ); \
+  } while ( false )
+
+#define KEYCHAINBRIDGE_DEBUG( category, msg ) KEYCHAINBRIDGE_LOG( category, Debug, msg )
+#define KEYCHAINBRIDGE_INFO( category, msg ) KEYCHAINBRIDGE_LOG( category, Info, msg )
+#define KEYCHAINBRIDGE_WARNING( category, msg ) KEYCHAINBRIDGE_LOG( category, Warning, msg )
+
+#endif //KeyChainBridgeLog_H
@@ -0,0 +1,232 @@
+/***************************************************************************
+  keychainbridgemetrics.cpp
+
+  Lock-free operation counters and latency histograms
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgemetrics.h"
+
+#include <QStringList>
+
+#include <limits.h>
+
+// Bucket upper bounds in microseconds
+static const qint64 sBucketBounds[KeyChainBridgeMetrics::BUCKET_COUNT - 1] =
+{
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+
+
+KeyChainBridgeMetrics::KeyChainBridgeMetrics()
+{
+  reset();
+}
+
+KeyChainBridgeMetrics *KeyChainBridgeMetrics::instance()
+{
+  static KeyChainBridgeMetrics sInstance;
+  return &sInstance;
+}
+
+int KeyChainBridgeMetrics::bucketFor( qint64 usecs )
+{
+  for ( int i = 0; i < BUCKET_COUNT - 1; ++i )
+  {
+    if ( usecs <= sBucketBounds[i] )
+    {
+      return i;
+    }
+  }
+  return BUCKET_COUNT - 1;
+}
+
+void KeyChainBridgeMetrics::record( Operation operation, qint64 usecs, QKeychain::Error error )
+{
+  Q_ASSERT( operation < OperationCount );
+  mBuckets[operation][bucketFor( usecs )].fetchAndAddRelaxed( 1 );
+  int errorIndex = ( error >= 0 && error < ERROR_COUNT ) ? error : QKeychain::OtherError;
+  mErrors[operation][errorIndex].fetchAndAddRelaxed( 1 );
+  int value = usecs > INT_MAX ? INT_MAX : static_cast<int>( usecs );
+  int current = mMaximum[operation].fetchAndAddRelaxed( 0 );
+  while ( value > current && ! mMaximum[operation].testAndSetRelaxed( current, value ) )
+  {
+    current = mMaximum[operation].fetchAndAddRelaxed( 0 );
+  }
+}
+
+void KeyChainBridgeMetrics::recordCancelled( Operation operation )
+{
+  Q_ASSERT( operation < OperationCount );
+  mCancelled[operation].fetchAndAddRelaxed( 1 );
+}
+
+void KeyChainBridgeMetrics::recordTimeout( Operation operation )
+{
+  Q_ASSERT( operation < OperationCount );
+  mTimeouts[operation].fetchAndAddRelaxed( 1 );
+}
+
+int KeyChainBridgeMetrics::count( Operation operation ) const
+{
+  int total = 0;
+  for ( int i = 0; i < BUCKET_COUNT; ++i )
+  {
+    total += bucketCount( operation, i );
+  }
+  return total;
+}
+
+int KeyChainBridgeMetrics::errorCount( Operation operation, QKeychain::Error error ) const
+{
+  if ( error < 0 || error >= ERROR_COUNT )
+  {
+    return 0;
+  }
+  return mErrors[operation][error].fetchAndAddRelaxed( 0 );
+}
+
+int KeyChainBridgeMetrics::cancelledCount( Operation operation ) const
+{
+  return mCancelled[operation].fetchAndAddRelaxed( 0 );
+}
+
+int KeyChainBridgeMetrics::timeoutCount( Operation operation ) const
+{
+  return mTimeouts[operation].fetchAndAddRelaxed( 0 );
+}
+
+int KeyChainBridgeMetrics::bucketCount( Operation operation, int bucket ) const
+{
+  Q_ASSERT( bucket >= 0 && bucket < BUCKET_COUNT );
+  return mBuckets[operation][bucket].fetchAndAddRelaxed( 0 );
+}
+
+qint64 KeyChainBridgeMetrics::bucketUpperBound( int bucket )
+{
+  return bucket < BUCKET_COUNT - 1 ? sBucketBounds[bucket] : -1;
+}
+
+int KeyChainBridgeMetrics::maximum( Operation operation ) const
+{
+  return mMaximum[operation].fetchAndAddRelaxed( 0 );
+}
+
+qint64 KeyChainBridgeMetrics::percentile( Operation operation, double percent ) const
+{
+  int total = count( operation );
+  if ( total == 0 )
+  {
+    return 0;
+  }
+  double threshold = total * percent / 100.0;
+  int seen = 0;
+  for ( int i = 0; i < BUCKET_COUNT - 1; ++i )
+  {
+    seen += bucketCount( operation, i );
+    if ( seen >= threshold )
+    {
+      return sBucketBounds[i];
+    }
+  }
+  return maximum( operation );
+}
+
+QString KeyChainBridgeMetrics::operationName( Operation operation )
+{
+  switch ( operation )
+  {
+    case WalletRead:
+      return QString( "wallet read" );
+    case WalletWrite:
+      return QString( "wallet write" );
+    case WalletDelete:
+      return QString( "wallet delete" );
+    case Verification:
+      return QString( "verification" );
+    case ReadAhead:
+      return QString( "read-ahead" );
+    case PluginLoad:
+      return QString( "plugin load" );
+    case Initialization:
+      return QString( "initialization" );
+    case UnlockPrefetched:
+      return QString( "unlock, prefetched" );
+    case UnlockWalletRead:
+      return QString( "unlock, wallet read" );
+    default:
+      return QString( "unknown" );
+  }
+}
+
+QString KeyChainBridgeMetrics::toString() const
+{
+  QStringList lines;
+  for ( int op = 0; op < OperationCount; ++op )
+  {
+    Operation operation = static_cast<Operation>( op );
+    int total = count( operation );
+    lines << QString( "%1: %2 completed, %3 cancelled, %4 timed out, p50 <= %5 us, p99 <= %6 us, max %7 us" )
+    .arg( operationName( operation ) )
+    .arg( total )
+    .arg( cancelledCount( operation ) )
+    .arg( timeoutCount( operation ) )
+    .arg( percentile( operation, 50 ) )
+    .arg( percentile( operation, 99 ) )
+    .arg( maximum( operation ) );
+    if ( total == 0 )
+    {
+      continue;
+    }
+    QStringList outcomes;
+    for ( int error = 0; error < ERROR_COUNT; ++error )
+    {
+      int errors = errorCount( operation, static_cast<QKeychain::Error>( error ) );
+      if ( errors )
+      {
+        outcomes << QString( "error %1: %2" ).arg( error ).arg( errors );
+      }
+    }
+    lines << QString( "  outcomes: %1" ).arg( outcomes.join( ", " ) );
+    QStringList buckets;
+    for ( int i = 0; i < BUCKET_COUNT; ++i )
+    {
+      int n = bucketCount( operation, i );
+      if ( n )
+      {
+        buckets << ( i < BUCKET_COUNT - 1 ? QString( "<=%1us: %2" ).arg( sBucketBounds[i] ).arg( n )
+                     : QString( ">%1us: %2" ).arg( sBucketBounds[BUCKET_COUNT - 2] ).arg( n ) );
+      }
+    }
+    lines << QString( "  histogram: %1" ).arg( buckets.join( ", " ) );
+  }
+  return lines.join( "\n" );
+}
+
+void KeyChainBridgeMetrics::reset()
+{
+  for ( int op = 0; op < OperationCount; ++op )
+  {
+    for ( int i = 0; i < BUCKET_COUNT; ++i )
+    {
+      mBuckets[op][i].fetchAndStoreRelaxed( 0 );
+    }
+    for ( int i = 0; i < ERROR_COUNT; ++i )
+    {
+      mErrors[op][i].fetchAndStoreRelaxed( 0 );
+    }
+    mCancelled[op].fetchAndStoreRelaxed( 0 );
+    mTimeouts[op].fetchAndStoreRelaxed( 0 );
+    mMaximum[op].fetchAndStoreRelaxed( 0 );
+  }
+}
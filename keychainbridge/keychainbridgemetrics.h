@@ -0,0 +1,124 @@
+/***************************************************************************
+    keychainbridgemetrics.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeMetrics_H
+#define KeyChainBridgeMetrics_H
+
+//QT4 includes
+#include <QAtomicInt>
+#include <QString>
+
+// QtKeyChain library
+#include "qtkeychain/keychain.h"
+
+
+/**
+* \class KeyChainBridgeMetrics
+* \brief Lock-free operation counters and latency histograms
+* Every wallet operation and master password verification is counted, per
+* outcome, and its latency is added to a fixed-bucket histogram. Recording
+* is a handful of relaxed atomic increments, safe from any thread.
+*/
+class KeyChainBridgeMetrics
+{
+  public:
+
+    //! Measured operations
+    enum Operation
+    {
+      WalletRead,
+      WalletWrite,
+      WalletDelete,
+      Verification,
+      ReadAhead,
+      PluginLoad,      //!< Plugin constructor and initGui(), at QGIS startup
+      Initialization,  //!< Wallet and verification wiring, maybe deferred
+      UnlockPrefetched,  //!< Master password request answered with the prefetched password
+      UnlockWalletRead,  //!< Master password request that waited for the wallet read
+      OperationCount
+    };
+
+    //! Number of histogram buckets, the last one is unbounded
+    static const int BUCKET_COUNT = 16;
+
+    //! Number of tracked QKeychain::Error outcomes, OtherError included
+    static const int ERROR_COUNT = QKeychain::OtherError + 1;
+
+    //! The process wide instance
+    static KeyChainBridgeMetrics *instance();
+
+    //! Record an operation that took \a usecs microseconds
+    void record( Operation operation, qint64 usecs, QKeychain::Error error = QKeychain::NoError );
+
+    //! Record an operation that was cancelled before completion
+    void recordCancelled( Operation operation );
+
+    //! Record an operation abandoned because it missed its deadline
+    void recordTimeout( Operation operation );
+
+    //! Number of completed operations
+    int count( Operation operation ) const;
+
+    //! Number of completed operations with the given outcome
+    int errorCount( Operation operation, QKeychain::Error error ) const;
+
+    //! Number of cancelled operations
+    int cancelledCount( Operation operation ) const;
+
+    //! Number of operations that missed their deadline
+    int timeoutCount( Operation operation ) const;
+
+    //! Number of operations in histogram \a bucket
+    int bucketCount( Operation operation, int bucket ) const;
+
+    //! Upper bound of histogram \a bucket in microseconds, -1 for the last one
+    static qint64 bucketUpperBound( int bucket );
+
+    //! Slowest operation in microseconds
+    int maximum( Operation operation ) const;
+
+    //! Estimated latency percentile ( 0 - 100 ) in microseconds: the upper
+    //! bound of the bucket it falls in
+    qint64 percentile( Operation operation, double percent ) const;
+
+    //! Human readable name of the operation
+    static QString operationName( Operation operation );
+
+    //! Human readable report of all the metrics
+    QString toString() const;
+
+    //! Clear all the metrics
+    void reset();
+
+  private:
+
+    KeyChainBridgeMetrics();
+
+    static int bucketFor( qint64 usecs );
+
+    // Qt 4 atomics have no const load(): reads are fetchAndAddRelaxed( 0 )
+    mutable QAtomicInt mBuckets[OperationCount][BUCKET_COUNT];
+
+    mutable QAtomicInt mErrors[OperationCount][ERROR_COUNT];
+
+    mutable QAtomicInt mCancelled[OperationCount];
+
+    mutable QAtomicInt mTimeouts[OperationCount];
+
+    //! Microseconds, saturated at INT_MAX
+    mutable QAtomicInt mMaximum[OperationCount];
+};
+
+#endif //KeyChainBridgeMetrics_H
@@ -0,0 +1,131 @@
+/***************************************************************************
+  keychainbridgemockbackend.cpp
+
+  In-memory wallet backend for tests and benchmarks
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgemockbackend.h"
+
+#include <QTimer>
+
+
+KeyChainBridgeMockBackend::KeyChainBridgeMockBackend( QObject *parent ):
+    KeyChainBridgeBackend( parent ),
+    mLatency( 0 ),
+    mFailureRate( 0.0 ),
+    mFailureError( QKeychain::OtherError ),
+    mSeed( 1 ),
+    mOperationCount( 0 )
+{
+}
+
+void KeyChainBridgeMockBackend::start( KeyChainBridgeWalletJob *job )
+{
+  mPending.enqueue( job );
+  // Never complete synchronously, like a real backend
+  QTimer::singleShot( mLatency, this, SLOT( processNext() ) );
+}
+
+void KeyChainBridgeMockBackend::injectError( QKeychain::Error error, int count )
+{
+  for ( int i = 0; i < count; ++i )
+  {
+    mInjectedErrors.enqueue( error );
+  }
+}
+
+void KeyChainBridgeMockBackend::setSecret( const QString &service, const QString &key, const QString &secret )
+{
+  mSecrets.insert( storageKey( service, key ), secret );
+}
+
+QString KeyChainBridgeMockBackend::secret( const QString &service, const QString &key ) const
+{
+  return mSecrets.value( storageKey( service, key ) );
+}
+
+void KeyChainBridgeMockBackend::reset()
+{
+  mSecrets.clear();
+  mInjectedErrors.clear();
+}
+
+void KeyChainBridgeMockBackend::processNext()
+{
+  if ( mPending.isEmpty() )
+  {
+    return;
+  }
+  QPointer<KeyChainBridgeWalletJob> job = mPending.dequeue();
+  ++mOperationCount;
+  // Cancelled and gone
+  if ( ! job )
+  {
+    return;
+  }
+  QKeychain::Error error = nextError();
+  if ( error != QKeychain::NoError )
+  {
+    finishJob( job, error, QString( "Injected error %1" ).arg( error ) );
+    return;
+  }
+  QString key( storageKey( job->service(), job->key() ) );
+  switch ( job->type() )
+  {
+    case KeyChainBridgeWalletJob::Read:
+      if ( ! mSecrets.contains( key ) )
+      {
+        finishJob( job, QKeychain::EntryNotFound, QString( "Entry not found" ) );
+      }
+      else
+      {
+        finishJob( job, QKeychain::NoError, QString(), mSecrets.value( key ) );
+      }
+      break;
+    case KeyChainBridgeWalletJob::Write:
+      mSecrets.insert( key, job->textData() );
+      finishJob( job, QKeychain::NoError, QString() );
+      break;
+    case KeyChainBridgeWalletJob::Delete:
+      if ( mSecrets.remove( key ) == 0 )
+      {
+        finishJob( job, QKeychain::EntryNotFound, QString( "Entry not found" ) );
+      }
+      else
+      {
+        finishJob( job, QKeychain::NoError, QString() );
+      }
+      break;
+  }
+}
+
+QKeychain::Error KeyChainBridgeMockBackend::nextError()
+{
+  if ( ! mInjectedErrors.isEmpty() )
+  {
+    return mInjectedErrors.dequeue();
+  }
+  if ( mFailureRate <= 0.0 )
+  {
+    return QKeychain::NoError;
+  }
+  // Private LCG: do not disturb nor depend on the global qrand() sequence
+  mSeed = mSeed * 1103515245u + 12345u;
+  double draw = ( ( mSeed >> 16 ) & 0x7fff ) / 32768.0;
+  return draw < mFailureRate ? mFailureError : QKeychain::NoError;
+}
+
+QString KeyChainBridgeMockBackend::storageKey( const QString &service, const QString &key )
+{
+  return QString( "%1/%2" ).arg( service, key );
+}
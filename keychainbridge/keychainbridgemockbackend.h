@@ -0,0 +1,112 @@
+/***************************************************************************
+    keychainbridgemockbackend.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeMockBackend_H
+#define KeyChainBridgeMockBackend_H
+
+//QT4 includes
+#include <QHash>
+#include <QPointer>
+#include <QQueue>
+
+#include "keychainbridgebackend.h"
+
+
+/**
+* \class KeyChainBridgeMockBackend
+* \brief In-memory backend for tests and benchmarks
+* Nothing leaves the process. The latency of every operation, a random
+* failure rate and specific QKeychain errors can be injected, so that the
+* unlock path can be measured and tested without a desktop keyring.
+* Only built in the test library, where WITH_MOCK_BACKEND is defined.
+*/
+class KeyChainBridgeMockBackend : public KeyChainBridgeBackend
+{
+    Q_OBJECT
+  public:
+
+    explicit KeyChainBridgeMockBackend( QObject *parent = nullptr );
+
+    QString name() const override { return QString( "mock" ); }
+
+    void start( KeyChainBridgeWalletJob *job ) override;
+
+    //! Latency of each operation in milliseconds, 0 means next event loop turn
+    int latency() const { return mLatency; }
+
+    //! Set the latency of each operation in milliseconds
+    void setLatency( int latency ) { mLatency = latency; }
+
+    //! Probability ( 0 - 1 ) that an operation fails with failureError()
+    double failureRate() const { return mFailureRate; }
+
+    //! Set the probability ( 0 - 1 ) that an operation fails
+    void setFailureRate( double failureRate ) { mFailureRate = failureRate; }
+
+    //! Error returned by random failures
+    QKeychain::Error failureError() const { return mFailureError; }
+
+    //! Set the error returned by random failures
+    void setFailureError( QKeychain::Error error ) { mFailureError = error; }
+
+    //! Seed for the random failures, for reproducible runs
+    void setSeed( uint seed ) { mSeed = seed; }
+
+    //! Make the next \a count operations fail with \a error
+    void injectError( QKeychain::Error error, int count = 1 );
+
+    //! Direct access to the stored secrets, keyed by service and key
+    void setSecret( const QString &service, const QString &key, const QString &secret );
+
+    //! Stored secret, a null string if not found
+    QString secret( const QString &service, const QString &key ) const;
+
+    //! Remove all the stored secrets and the injected errors
+    void reset();
+
+    //! Number of operations executed so far
+    int operationCount() const { return mOperationCount; }
+
+  private slots:
+
+    //! Complete the oldest operation
+    void processNext();
+
+  private:
+
+    //! Whether the next operation must fail, and with which error
+    QKeychain::Error nextError();
+
+    //! Storage key
+    static QString storageKey( const QString &service, const QString &key );
+
+    int mLatency;
+
+    double mFailureRate;
+
+    QKeychain::Error mFailureError;
+
+    uint mSeed;
+
+    QQueue<QKeychain::Error> mInjectedErrors;
+
+    QHash<QString, QString> mSecrets;
+
+    QQueue<QPointer<KeyChainBridgeWalletJob> > mPending;
+
+    int mOperationCount;
+};
+
+#endif //KeyChainBridgeMockBackend_H
@@ -0,0 +1,176 @@
+/***************************************************************************
+  keychainbridgenotifier.cpp
+
+  Message bar notifications
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgenotifier.h"
+
+#include <QHBoxLayout>
+#include <QLabel>
+#include <QPushButton>
+#include <QWidget>
+
+#include "qgsmessagebar.h"
+#include "qgsmessagebaritem.h"
+
+
+KeyChainBridgeNotifier::KeyChainBridgeNotifier( QgsMessageBar *messageBar, QObject *parent ):
+    QObject( parent ),
+    mMessageBar( messageBar ),
+    mBatchDelay( 200 ),
+    mRepeatInterval( 30000 ),
+    mPushedCount( 0 ),
+    mUpdatedCount( 0 ),
+    mDroppedCount( 0 )
+{
+  mFlushTimer.setSingleShot( true );
+  connect( &mFlushTimer, SIGNAL( timeout() ), this, SLOT( flush() ) );
+}
+
+KeyChainBridgeNotifier::~KeyChainBridgeNotifier()
+{
+}
+
+void KeyChainBridgeNotifier::notify( Kind kind, const QString &title, const QString &message, int duration )
+{
+  if ( ! mMessageBar )
+  {
+    return;
+  }
+  Channel &channel = mChannels[kind];
+  if ( isRepeated( channel, message ) )
+  {
+    ++mDroppedCount;
+    return;
+  }
+  channel.title = title;
+  channel.duration = duration;
+  channel.pending.append( message );
+  scheduleFlush();
+}
+
+void KeyChainBridgeNotifier::prompt( const QString &message, const QString &buttonText )
+{
+  if ( ! mMessageBar )
+  {
+    return;
+  }
+  if ( mPromptItem && mPromptLabel && mPromptLabel->text() == message && mPendingPrompt.isNull() )
+  {
+    ++mDroppedCount;
+    return;
+  }
+  mPendingPrompt = message;
+  mPromptButtonText = buttonText;
+  scheduleFlush();
+}
+
+void KeyChainBridgeNotifier::dismissPrompt()
+{
+  mPendingPrompt.clear();
+  if ( mMessageBar && mPromptItem )
+  {
+    mMessageBar->popWidget( mPromptItem );
+  }
+}
+
+void KeyChainBridgeNotifier::flush()
+{
+  mFlushTimer.stop();
+  for ( int kind = 0; kind < KIND_COUNT; ++kind )
+  {
+    if ( mMessageBar && ! mChannels[kind].pending.isEmpty() )
+    {
+      deliver( static_cast<Kind>( kind ) );
+    }
+    mChannels[kind].pending.clear();
+  }
+  if ( mMessageBar && ! mPendingPrompt.isNull() )
+  {
+    deliverPrompt();
+  }
+  mPendingPrompt.clear();
+}
+
+void KeyChainBridgeNotifier::promptButtonClicked()
+{
+  dismissPrompt();
+  emit promptAccepted();
+}
+
+bool KeyChainBridgeNotifier::isRepeated( const Channel &channel, const QString &message ) const
+{
+  if ( channel.pending.contains( message ) )
+  {
+    return true;
+  }
+  // Still in the bar, or it was not long ago
+  return channel.shown.contains( message ) && ( channel.item || ( channel.shownTimer.isValid() && channel.shownTimer.elapsed() < mRepeatInterval ) );
+}
+
+void KeyChainBridgeNotifier::deliver( Kind kind )
+{
+  Channel &channel = mChannels[kind];
+  // A new repeat window, unless the previous messages are still on screen
+  if ( ! channel.item && ( ! channel.shownTimer.isValid() || channel.shownTimer.elapsed() >= mRepeatInterval ) )
+  {
+    channel.shown.clear();
+  }
+  if ( channel.item )
+  {
+    // The messages already in the item stay there
+    channel.displayed.append( channel.pending );
+    channel.item->setTitle( channel.title );
+    channel.item->setText( channel.displayed.join( "<br/>" ) );
+    ++mUpdatedCount;
+  }
+  else
+  {
+    channel.displayed = channel.pending;
+    QgsMessageBar::MessageLevel level( kind == Critical ? QgsMessageBar::CRITICAL : kind == Warning ? QgsMessageBar::WARNING : QgsMessageBar::INFO );
+    channel.item = new QgsMessageBarItem( channel.title, channel.displayed.join( "<br/>" ), level, channel.duration );
+    mMessageBar->pushItem( channel.item );
+    ++mPushedCount;
+  }
+  channel.shown.append( channel.pending );
+  channel.shownTimer.start();
+}
+
+void KeyChainBridgeNotifier::deliverPrompt()
+{
+  if ( mPromptItem && mPromptLabel )
+  {
+    mPromptLabel->setText( mPendingPrompt );
+    ++mUpdatedCount;
+    return;
+  }
+  QWidget *wdg = new QWidget();
+  QHBoxLayout *hlay = new QHBoxLayout( wdg );
+  mPromptLabel = new QLabel( mPendingPrompt, wdg );
+  hlay->addWidget( mPromptLabel );
+  QPushButton *btn = new QPushButton( mPromptButtonText, wdg );
+  connect( btn, SIGNAL( clicked() ), this, SLOT( promptButtonClicked() ) );
+  hlay->addWidget( btn );
+  mPromptItem = new QgsMessageBarItem( wdg, QgsMessageBar::INFO, 0 );
+  mMessageBar->pushItem( mPromptItem );
+  ++mPushedCount;
+}
+
+void KeyChainBridgeNotifier::scheduleFlush()
+{
+  if ( ! mFlushTimer.isActive() )
+  {
+    mFlushTimer.start( mBatchDelay );
+  }
+}
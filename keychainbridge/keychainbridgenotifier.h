@@ -0,0 +1,174 @@
+/***************************************************************************
+    keychainbridgenotifier.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeNotifier_H
+#define KeyChainBridgeNotifier_H
+
+//QT4 includes
+#include <QElapsedTimer>
+#include <QObject>
+#include <QPointer>
+#include <QString>
+#include <QStringList>
+#include <QTimer>
+
+//forward declarations
+class QLabel;
+class QgsMessageBar;
+class QgsMessageBarItem;
+
+
+/**
+* \class KeyChainBridgeNotifier
+* \brief Message bar notifications of the plugin
+* Messages are collected and delivered in batches: the messages of a kind
+* received within batchDelay() are shown together, in a single bar item.
+* The item is kept and updated in place, rather than pushing a new one, as
+* long as it is in the bar, and a message already shown within
+* repeatInterval() is dropped. The prompt is a single widget, reused too.
+* Without a message bar, the messages are dropped: log them as well.
+*/
+class KeyChainBridgeNotifier : public QObject
+{
+    Q_OBJECT
+  public:
+
+    //! Kind of message, a bar item each
+    enum Kind
+    {
+      Info,
+      Warning,
+      Critical
+    };
+
+    explicit KeyChainBridgeNotifier( QgsMessageBar *messageBar = nullptr, QObject *parent = nullptr );
+    ~KeyChainBridgeNotifier();
+
+    QgsMessageBar *messageBar() const { return mMessageBar; }
+
+    //! Set the bar the messages are shown in, null to drop them
+    void setMessageBar( QgsMessageBar *messageBar ) { mMessageBar = messageBar; }
+
+    //! Queue \a message, shown for \a duration seconds, 0 until dismissed
+    void notify( Kind kind, const QString &title, const QString &message, int duration = 5 );
+
+    //! Ask the user to confirm \a message with \a buttonText, promptAccepted()
+    //! is emitted when the button is clicked
+    void prompt( const QString &message, const QString &buttonText );
+
+    //! Remove the prompt from the bar
+    void dismissPrompt();
+
+    //! Time the messages are collected for before being shown, in milliseconds
+    int batchDelay() const { return mBatchDelay; }
+
+    //! Set the time the messages are collected for before being shown
+    void setBatchDelay( int msecs ) { mBatchDelay = msecs; }
+
+    //! Time within which a message is not shown again, in milliseconds
+    int repeatInterval() const { return mRepeatInterval; }
+
+    //! Set the time within which a message is not shown again
+    void setRepeatInterval( int msecs ) { mRepeatInterval = msecs; }
+
+    //! Number of items pushed to the bar
+    int pushedCount() const { return mPushedCount; }
+
+    //! Number of times an item in the bar has been updated in place
+    int updatedCount() const { return mUpdatedCount; }
+
+    //! Number of messages dropped as repeated
+    int droppedCount() const { return mDroppedCount; }
+
+  public slots:
+
+    //! Show the queued messages now
+    void flush();
+
+  signals:
+
+    //! The prompt button has been clicked
+    void promptAccepted();
+
+  private slots:
+
+    void promptButtonClicked();
+
+  private:
+
+    //! Messages of a kind, waiting and shown
+    struct Channel
+    {
+      Channel() : duration( 0 ) {}
+
+      QString title;
+
+      //! Waiting for the next flush
+      QStringList pending;
+
+      int duration;
+
+      //! The bar item, while it is in the bar
+      QPointer<QgsMessageBarItem> item;
+
+      //! Messages in the text of the bar item
+      QStringList displayed;
+
+      //! Shown messages, by the time they were last shown
+      QStringList shown;
+
+      QElapsedTimer shownTimer;
+    };
+
+    static const int KIND_COUNT = Critical + 1;
+
+    //! Whether \a message is in the bar or has been shown recently
+    bool isRepeated( const Channel &channel, const QString &message ) const;
+
+    //! Push the item of \a kind or update it in place
+    void deliver( Kind kind );
+
+    //! Build the prompt widget and push it, or update it in place
+    void deliverPrompt();
+
+    void scheduleFlush();
+
+    QPointer<QgsMessageBar> mMessageBar;
+
+    Channel mChannels[KIND_COUNT];
+
+    //! The prompt bar item, while it is in the bar
+    QPointer<QgsMessageBarItem> mPromptItem;
+
+    QPointer<QLabel> mPromptLabel;
+
+    QString mPendingPrompt;
+
+    QString mPromptButtonText;
+
+    int mBatchDelay;
+
+    int mRepeatInterval;
+
+    int mPushedCount;
+
+    int mUpdatedCount;
+
+    int mDroppedCount;
+
+    QTimer mFlushTimer;
+};
+
+#endif //KeyChainBridgeNotifier_H
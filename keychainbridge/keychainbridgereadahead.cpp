@@ -0,0 +1,118 @@
+/***************************************************************************
+  keychainbridgereadahead.cpp
+
+  Credentials read-ahead for the project being loaded
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgereadahead.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QNetworkRequest>
+#include <QRegExp>
+#include <QSet>
+
+#include "qgsauthmanager.h"
+#include "qgsauthmethod.h"
+
+#include "keychainbridgelog.h"
+#include "keychainbridgemetrics.h"
+
+
+KeyChainBridgeReadAhead::KeyChainBridgeReadAhead( QgsAuthManager *authManager ):
+    mAuthManager( authManager )
+{
+  Q_ASSERT( authManager );
+}
+
+int KeyChainBridgeReadAhead::warm( const QString &fileName )
+{
+  QFile file( fileName );
+  if ( ! file.open( QIODevice::ReadOnly ) )
+  {
+    return 0;
+  }
+  QStringList ids( authConfigIds( file.readAll() ) );
+  if ( ids.isEmpty() )
+  {
+    return 0;
+  }
+  QElapsedTimer timer;
+  timer.start();
+  // Unlock once, the credentials request is answered by the plugin
+  if ( ! mAuthManager->masterPasswordIsSet() && ! mAuthManager->setMasterPassword( true ) )
+  {
+    KEYCHAINBRIDGE_DEBUG( Plugin, "Read-ahead skipped: the auth manager is locked." );
+    return 0;
+  }
+  int warmed = 0;
+  Q_FOREACH ( const QString &authcfg, ids )
+  {
+    if ( warmConfig( authcfg ) )
+    {
+      ++warmed;
+    }
+  }
+  KeyChainBridgeMetrics::instance()->record( KeyChainBridgeMetrics::ReadAhead, timer.nsecsElapsed() / 1000 );
+  KEYCHAINBRIDGE_DEBUG( Plugin, QString( "Read-ahead: %1 of %2 authentication configurations loaded in %3 ms." )
+                        .arg( warmed ).arg( ids.size() ).arg( timer.elapsed() ) );
+  return warmed;
+}
+
+QStringList KeyChainBridgeReadAhead::authConfigIds( const QByteArray &projectXml )
+{
+  // Data sources reference the configurations as authcfg=<7 chars id>,
+  // optionally quoted
+  QRegExp rx( "authcfg=['\"]?([a-z0-9]{7})(?![a-z0-9])" );
+  QString xml( QString::fromUtf8( projectXml ) );
+  QStringList ids;
+  QSet<QString> seen;
+  int pos = 0;
+  while ( ( pos = rx.indexIn( xml, pos ) ) != -1 )
+  {
+    QString id( rx.cap( 1 ) );
+    if ( ! seen.contains( id ) )
+    {
+      seen.insert( id );
+      ids << id;
+    }
+    pos += rx.matchedLength();
+  }
+  return ids;
+}
+
+bool KeyChainBridgeReadAhead::warmConfig( const QString &authcfg )
+{
+  if ( ! mAuthManager->configIds().contains( authcfg ) )
+  {
+    return false;
+  }
+  QgsAuthMethod *method = mAuthManager->authMethod( mAuthManager->configAuthMethodKey( authcfg ) );
+  if ( ! method )
+  {
+    return false;
+  }
+  // Any expansion makes the method load the configuration and cache it,
+  // the throw-away request and items are discarded
+  if ( method->supportedExpansions() & QgsAuthMethod::NetworkRequest )
+  {
+    QNetworkRequest request;
+    return mAuthManager->updateNetworkRequest( request, authcfg );
+  }
+  if ( method->supportedExpansions() & QgsAuthMethod::DataSourceURI )
+  {
+    QStringList items;
+    return mAuthManager->updateDataSourceUriItems( items, authcfg );
+  }
+  return false;
+}
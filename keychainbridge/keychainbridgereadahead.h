@@ -0,0 +1,59 @@
+/***************************************************************************
+    keychainbridgereadahead.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeReadAhead_H
+#define KeyChainBridgeReadAhead_H
+
+//QT4 includes
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+
+//forward declarations
+class QgsAuthManager;
+
+
+/**
+* \class KeyChainBridgeReadAhead
+* \brief Credentials read-ahead for the project being loaded
+* The project file is scanned for the authentication configurations
+* referenced by the layers, the auth manager is unlocked once and all the
+* configurations are loaded in a batch, before the providers ask for them.
+* The decrypted configurations are kept by the auth methods themselves,
+* which cache them on first use.
+*/
+class KeyChainBridgeReadAhead
+{
+  public:
+
+    explicit KeyChainBridgeReadAhead( QgsAuthManager *authManager );
+
+    //! Warm the configurations referenced by the project \a fileName,
+    //! returns the number of configurations loaded
+    int warm( const QString &fileName );
+
+    //! Authentication configuration IDs referenced by \a projectXml, in order
+    //! of appearance and without duplicates
+    static QStringList authConfigIds( const QByteArray &projectXml );
+
+  private:
+
+    //! Let the auth method load and cache \a authcfg
+    bool warmConfig( const QString &authcfg );
+
+    QgsAuthManager *mAuthManager;
+};
+
+#endif //KeyChainBridgeReadAhead_H
@@ -0,0 +1,127 @@
+/***************************************************************************
+  keychainbridgeretry.cpp
+
+  Retry policy and circuit breaker for the wallet operations
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgeretry.h"
+
+#include <QDateTime>
+
+
+KeyChainBridgeRetryScheduler::KeyChainBridgeRetryScheduler():
+    mState( Closed ),
+    mFailures( 0 ),
+    mMaxRetries( 2 ),
+    mBaseDelay( 250 ),
+    mMaxDelay( 4000 ),
+    mFailureThreshold( 3 ),
+    mOpenInterval( 60000 ),
+    mSeed( QDateTime::currentDateTime().toTime_t() )
+{
+}
+
+KeyChainBridgeRetryScheduler::ErrorClass KeyChainBridgeRetryScheduler::classify( QKeychain::Error error )
+{
+  switch ( error )
+  {
+    case QKeychain::NoError:
+    case QKeychain::EntryNotFound:
+      return Success;
+    // The user or the system said no, or there is no wallet at all
+    case QKeychain::AccessDenied:
+    case QKeychain::AccessDeniedByUser:
+    case QKeychain::NoBackendAvailable:
+    case QKeychain::NotImplemented:
+      return Permanent;
+    // D-Bus timeouts, locked or busy daemons ...
+    case QKeychain::CouldNotDeleteEntry:
+    case QKeychain::OtherError:
+    default:
+      return Transient;
+  }
+}
+
+bool KeyChainBridgeRetryScheduler::allowRequest()
+{
+  switch ( mState )
+  {
+    case Closed:
+      return true;
+    case Open:
+      if ( mOpenTimer.elapsed() < mOpenInterval )
+      {
+        return false;
+      }
+      mState = HalfOpen;
+      return true;
+    case HalfOpen:
+    default:
+      // The trial is still running
+      return false;
+  }
+}
+
+void KeyChainBridgeRetryScheduler::record( QKeychain::Error error )
+{
+  if ( classify( error ) != Transient )
+  {
+    // The wallet is alive, even if it said no
+    mFailures = 0;
+    mState = Closed;
+    return;
+  }
+  ++mFailures;
+  if ( mState == HalfOpen || ( mState == Closed && mFailures >= mFailureThreshold ) )
+  {
+    mState = Open;
+    mOpenTimer.start();
+  }
+}
+
+void KeyChainBridgeRetryScheduler::cancelTrial()
+{
+  // Back to open, with the interval already expired
+  if ( mState == HalfOpen )
+  {
+    mState = Open;
+  }
+}
+
+int KeyChainBridgeRetryScheduler::retryDelay( QKeychain::Error error, int attempt )
+{
+  if ( classify( error ) != Transient || attempt >= mMaxRetries || mState != Closed )
+  {
+    return -1;
+  }
+  // Equal jitter: half fixed, half random, so that concurrent clients
+  // do not retry in lockstep
+  int delay = mMaxDelay;
+  if ( attempt < 16 )
+  {
+    delay = qMin( mMaxDelay, mBaseDelay << attempt );
+  }
+  return delay / 2 + static_cast<int>( random() * ( delay / 2 ) );
+}
+
+void KeyChainBridgeRetryScheduler::reset()
+{
+  mState = Closed;
+  mFailures = 0;
+}
+
+double KeyChainBridgeRetryScheduler::random()
+{
+  mSeed = mSeed * 1103515245u + 12345u;
+  return ( ( mSeed >> 16 ) & 0x7fff ) / 32768.0;
+}
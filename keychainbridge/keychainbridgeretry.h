@@ -0,0 +1,133 @@
+/***************************************************************************
+    keychainbridgeretry.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeRetry_H
+#define KeyChainBridgeRetry_H
+
+//QT4 includes
+#include <QElapsedTimer>
+
+// QtKeyChain library
+#include "qtkeychain/keychain.h"
+
+
+/**
+* \class KeyChainBridgeRetryScheduler
+* \brief Retry policy and circuit breaker for the wallet operations
+* Errors are classified as transient (worth retrying) or permanent. Transient
+* failures are retried after a jittered exponential backoff; after too many
+* consecutive failed operations, once their retries are exhausted, the
+* circuit opens and the wallet is not contacted
+* anymore until the open interval expires, when a single trial operation is
+* let through: its success closes the circuit, its failure opens it again.
+*/
+class KeyChainBridgeRetryScheduler
+{
+  public:
+
+    //! Error classes
+    enum ErrorClass
+    {
+      Success,    //!< A definitive answer, EntryNotFound included
+      Transient,  //!< The wallet might answer if asked again
+      Permanent   //!< Asking again is pointless
+    };
+
+    //! Circuit breaker states
+    enum CircuitState
+    {
+      Closed,    //!< Operations go through
+      Open,      //!< Operations fail immediately
+      HalfOpen   //!< A trial operation is going through
+    };
+
+    KeyChainBridgeRetryScheduler();
+
+    //! Class of \a error
+    static ErrorClass classify( QKeychain::Error error );
+
+    //! Whether an operation may be sent to the wallet now, in half open
+    //! state this lets the trial operation through
+    bool allowRequest();
+
+    //! Record the final outcome of an operation, after its retries
+    void record( QKeychain::Error error );
+
+    //! The operation let through by allowRequest() has been cancelled before
+    //! its outcome was known: in half open state, the next one is the trial
+    void cancelTrial();
+
+    //! Delay before retry number \a attempt (starting from 0) of an operation
+    //! that failed, or -1 if it must not be retried
+    int retryDelay( QKeychain::Error error, int attempt );
+
+    //! Current circuit breaker state
+    CircuitState state() const { return mState; }
+
+    //! Consecutive operations that failed with a transient error
+    int failures() const { return mFailures; }
+
+    //! Force the circuit closed and forget the failures
+    void reset();
+
+    //! Retries of a failed operation
+    int maxRetries() const { return mMaxRetries; }
+    void setMaxRetries( int maxRetries ) { mMaxRetries = maxRetries; }
+
+    //! Backoff before the first retry, in milliseconds, doubled at each retry
+    int baseDelay() const { return mBaseDelay; }
+    void setBaseDelay( int msecs ) { mBaseDelay = msecs; }
+
+    //! Maximum backoff, in milliseconds
+    int maxDelay() const { return mMaxDelay; }
+    void setMaxDelay( int msecs ) { mMaxDelay = msecs; }
+
+    //! Consecutive failed operations that open the circuit
+    int failureThreshold() const { return mFailureThreshold; }
+    void setFailureThreshold( int failures ) { mFailureThreshold = failures; }
+
+    //! How long the circuit stays open, in milliseconds
+    int openInterval() const { return mOpenInterval; }
+    void setOpenInterval( int msecs ) { mOpenInterval = msecs; }
+
+    //! Seed for the jitter, for reproducible runs
+    void setSeed( uint seed ) { mSeed = seed; }
+
+  private:
+
+    //! Random number in [0, 1)
+    double random();
+
+    CircuitState mState;
+
+    int mFailures;
+
+    //! Started when the circuit opens
+    QElapsedTimer mOpenTimer;
+
+    int mMaxRetries;
+
+    int mBaseDelay;
+
+    int mMaxDelay;
+
+    int mFailureThreshold;
+
+    int mOpenInterval;
+
+    uint mSeed;
+};
+
+#endif //KeyChainBridgeRetry_H
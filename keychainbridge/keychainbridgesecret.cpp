@@ -0,0 +1,411 @@
+/***************************************************************************
+  keychainbridgesecret.cpp
+
+  Move-only secret in locked memory
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgesecret.h"
+
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <string.h>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Allocation unit of the arena, in bytes
+const int SECRET_BLOCK_SIZE = 64;
+// Blocks in a chunk, a bit each in the chunk mask
+const int SECRET_CHUNK_BLOCKS = 64;
+// A page on most platforms: chunks are locked as a whole
+const int SECRET_CHUNK_SIZE = SECRET_BLOCK_SIZE * SECRET_CHUNK_BLOCKS;
+
+
+// Overwrite with zeros, through a volatile pointer so that it is not
+// optimized away as a dead store
+static void secureZero( void *data, size_t size )
+{
+  volatile char *bytes = static_cast<volatile char *>( data );
+  while ( size-- )
+  {
+    *bytes++ = 0;
+  }
+}
+
+/**
+ * Locked pages, split in blocks. Small secrets take contiguous blocks of a
+ * shared chunk, large ones a chunk of their own, unmapped on release.
+ * Shared chunks are kept: the arena is as large as the most secrets ever
+ * held at the same time, which is a handful.
+ */
+class KeyChainBridgeSecretArena
+{
+  public:
+
+    static KeyChainBridgeSecretArena *instance()
+    {
+      static KeyChainBridgeSecretArena sInstance;
+      return &sInstance;
+    }
+
+    //! At least \a bytes of locked memory, \a capacity is set to the actual size
+    char *acquire( int bytes, int &capacity );
+
+    //! Give back the wiped memory from acquire(), of \a capacity bytes
+    void release( char *data, int capacity );
+
+    int allocations() const
+    {
+      QMutexLocker locker( &mMutex );
+      return mAllocations;
+    }
+
+    bool isLocked() const
+    {
+      QMutexLocker locker( &mMutex );
+      return mLocked;
+    }
+
+  private:
+
+    struct Chunk
+    {
+      char *memory;
+      int size;
+      //! Blocks in use, shared chunks only
+      quint64 used;
+    };
+
+    KeyChainBridgeSecretArena() : mAllocations( 0 ), mLocked( true ) {}
+
+    //! Map and lock \a size bytes, null on failure
+    char *map( int size );
+
+    void unmap( char *memory, int size );
+
+    mutable QMutex mMutex;
+
+    QList<Chunk> mChunks;
+
+    int mAllocations;
+
+    bool mLocked;
+};
+
+char *KeyChainBridgeSecretArena::map( int size )
+{
+#ifdef Q_OS_WIN
+  char *memory = static_cast<char *>( VirtualAlloc( nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE ) );
+  if ( ! memory || ! VirtualLock( memory, size ) )
+  {
+    mLocked = false;
+  }
+  return memory;
+#else
+  void *memory = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0 );
+  if ( memory == MAP_FAILED )
+  {
+    // The secret goes to the heap
+    mLocked = false;
+    return nullptr;
+  }
+  if ( mlock( memory, size ) != 0 )
+  {
+    mLocked = false;
+  }
+#ifdef MADV_DONTDUMP
+  madvise( memory, size, MADV_DONTDUMP );
+#endif
+  return static_cast<char *>( memory );
+#endif
+}
+
+void KeyChainBridgeSecretArena::unmap( char *memory, int size )
+{
+#ifdef Q_OS_WIN
+  VirtualUnlock( memory, size );
+  VirtualFree( memory, 0, MEM_RELEASE );
+#else
+  munlock( memory, size );
+  munmap( memory, size );
+#endif
+}
+
+char *KeyChainBridgeSecretArena::acquire( int bytes, int &capacity )
+{
+  int blocks = qMax( 1, ( bytes + SECRET_BLOCK_SIZE - 1 ) / SECRET_BLOCK_SIZE );
+  QMutexLocker locker( &mMutex );
+  ++mAllocations;
+  if ( blocks > SECRET_CHUNK_BLOCKS )
+  {
+    Chunk chunk;
+    chunk.size = ( ( bytes + SECRET_CHUNK_SIZE - 1 ) / SECRET_CHUNK_SIZE ) * SECRET_CHUNK_SIZE;
+    chunk.memory = map( chunk.size );
+    chunk.used = ~Q_UINT64_C( 0 );
+    if ( ! chunk.memory )
+    {
+      return nullptr;
+    }
+    mChunks.append( chunk );
+    capacity = chunk.size;
+    return chunk.memory;
+  }
+
+  quint64 mask( blocks == SECRET_CHUNK_BLOCKS ? ~Q_UINT64_C( 0 ) : ( Q_UINT64_C( 1 ) << blocks ) - 1 );
+  capacity = blocks * SECRET_BLOCK_SIZE;
+  for ( int i = 0; i < mChunks.size(); ++i )
+  {
+    Chunk &chunk = mChunks[i];
+    if ( chunk.size != SECRET_CHUNK_SIZE )
+    {
+      continue;
+    }
+    for ( int first = 0; first + blocks <= SECRET_CHUNK_BLOCKS; ++first )
+    {
+      if ( ! ( chunk.used & ( mask << first ) ) )
+      {
+        chunk.used |= mask << first;
+        return chunk.memory + first * SECRET_BLOCK_SIZE;
+      }
+    }
+  }
+  Chunk chunk;
+  chunk.size = SECRET_CHUNK_SIZE;
+  chunk.memory = map( chunk.size );
+  chunk.used = mask;
+  if ( ! chunk.memory )
+  {
+    return nullptr;
+  }
+  mChunks.append( chunk );
+  return chunk.memory;
+}
+
+void KeyChainBridgeSecretArena::release( char *data, int capacity )
+{
+  QMutexLocker locker( &mMutex );
+  for ( int i = 0; i < mChunks.size(); ++i )
+  {
+    Chunk &chunk = mChunks[i];
+    if ( data < chunk.memory || data >= chunk.memory + chunk.size )
+    {
+      continue;
+    }
+    if ( chunk.size != SECRET_CHUNK_SIZE )
+    {
+      unmap( chunk.memory, chunk.size );
+      mChunks.removeAt( i );
+      return;
+    }
+    int blocks = capacity / SECRET_BLOCK_SIZE;
+    quint64 mask( blocks == SECRET_CHUNK_BLOCKS ? ~Q_UINT64_C( 0 ) : ( Q_UINT64_C( 1 ) << blocks ) - 1 );
+    chunk.used &= ~( mask << ( static_cast<int>( data - chunk.memory ) / SECRET_BLOCK_SIZE ) );
+    return;
+  }
+  Q_ASSERT( false );
+}
+
+
+KeyChainBridgeSecret::KeyChainBridgeSecret():
+    mData( nullptr ),
+    mSize( 0 ),
+    mCapacity( 0 ),
+    mOnHeap( false )
+{
+}
+
+KeyChainBridgeSecret::KeyChainBridgeSecret( const QString &text ):
+    mData( nullptr ),
+    mSize( 0 ),
+    mCapacity( 0 ),
+    mOnHeap( false )
+{
+  assign( text.constData(), text.size() );
+}
+
+#ifdef Q_COMPILER_RVALUE_REFS
+KeyChainBridgeSecret::KeyChainBridgeSecret( KeyChainBridgeSecret &&other ):
+    mData( other.mData ),
+    mSize( other.mSize ),
+    mCapacity( other.mCapacity ),
+    mOnHeap( other.mOnHeap )
+{
+  other.mData = nullptr;
+  other.mSize = 0;
+  other.mCapacity = 0;
+  other.mOnHeap = false;
+}
+
+KeyChainBridgeSecret &KeyChainBridgeSecret::operator=( KeyChainBridgeSecret &&other )
+{
+  if ( &other != this )
+  {
+    release();
+    swap( other );
+  }
+  return *this;
+}
+#endif
+
+KeyChainBridgeSecret::~KeyChainBridgeSecret()
+{
+  release();
+}
+
+void KeyChainBridgeSecret::assign( const QString &text )
+{
+  assign( text.constData(), text.size() );
+}
+
+void KeyChainBridgeSecret::assign( const KeyChainBridgeSecret &other )
+{
+  if ( &other != this )
+  {
+    assign( other.mData, other.mSize );
+  }
+}
+
+void KeyChainBridgeSecret::assign( const QChar *data, int size )
+{
+  if ( size > mCapacity )
+  {
+    release();
+    int bytes = 0;
+    mData = reinterpret_cast<QChar *>( KeyChainBridgeSecretArena::instance()->acquire( size * sizeof( QChar ), bytes ) );
+    if ( mData )
+    {
+      mCapacity = bytes / sizeof( QChar );
+    }
+    else
+    {
+      // Out of address space or mappings: not locked, but still wiped
+      mData = new QChar[size];
+      mCapacity = size;
+      mOnHeap = true;
+    }
+  }
+  else if ( size < mSize )
+  {
+    secureZero( mData + size, ( mSize - size ) * sizeof( QChar ) );
+  }
+  if ( size )
+  {
+    memcpy( mData, data, size * sizeof( QChar ) );
+  }
+  mSize = size;
+}
+
+void KeyChainBridgeSecret::clear()
+{
+  if ( mData )
+  {
+    secureZero( mData, mSize * sizeof( QChar ) );
+  }
+  mSize = 0;
+}
+
+void KeyChainBridgeSecret::release()
+{
+  if ( mData )
+  {
+    clear();
+    if ( mOnHeap )
+    {
+      delete [] mData;
+    }
+    else
+    {
+      KeyChainBridgeSecretArena::instance()->release( reinterpret_cast<char *>( mData ), mCapacity * sizeof( QChar ) );
+    }
+  }
+  mData = nullptr;
+  mSize = 0;
+  mCapacity = 0;
+  mOnHeap = false;
+}
+
+void KeyChainBridgeSecret::swap( KeyChainBridgeSecret &other )
+{
+  qSwap( mData, other.mData );
+  qSwap( mSize, other.mSize );
+  qSwap( mCapacity, other.mCapacity );
+  qSwap( mOnHeap, other.mOnHeap );
+}
+
+bool KeyChainBridgeSecret::equals( const QString &text ) const
+{
+  // The length is not secret
+  if ( text.size() != mSize )
+  {
+    return false;
+  }
+  const QChar *chars = text.constData();
+  ushort diff = 0;
+  for ( int i = 0; i < mSize; ++i )
+  {
+    diff |= mData[i].unicode() ^ chars[i].unicode();
+  }
+  return diff == 0;
+}
+
+bool KeyChainBridgeSecret::operator==( const KeyChainBridgeSecret &other ) const
+{
+  if ( other.mSize != mSize )
+  {
+    return false;
+  }
+  ushort diff = 0;
+  for ( int i = 0; i < mSize; ++i )
+  {
+    diff |= mData[i].unicode() ^ other.mData[i].unicode();
+  }
+  return diff == 0;
+}
+
+QString KeyChainBridgeSecret::toString() const
+{
+  return mSize ? QString( mData, mSize ) : QString( "" );
+}
+
+void KeyChainBridgeSecret::wipe( QString &text )
+{
+  // Another QString would see its characters change
+  if ( text.isDetached() )
+  {
+    secureZero( text.data(), text.size() * sizeof( QChar ) );
+  }
+  text.clear();
+}
+
+void KeyChainBridgeSecret::wipe( QByteArray &data )
+{
+  if ( data.isDetached() )
+  {
+    secureZero( data.data(), data.size() );
+  }
+  data.clear();
+}
+
+int KeyChainBridgeSecret::allocations()
+{
+  return KeyChainBridgeSecretArena::instance()->allocations();
+}
+
+bool KeyChainBridgeSecret::isLocked()
+{
+  return KeyChainBridgeSecretArena::instance()->isLocked();
+}
@@ -0,0 +1,130 @@
+/***************************************************************************
+    keychainbridgesecret.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeSecret_H
+#define KeyChainBridgeSecret_H
+
+//QT4 includes
+#include <QByteArray>
+#include <QChar>
+#include <QString>
+
+
+/**
+* \class KeyChainBridgeSecret
+* \brief Move-only secret in locked memory
+* The characters live in an arena of pages locked in RAM (never swapped,
+* and excluded from core dumps where supported) and are wiped as soon as
+* they are replaced or released. The type cannot be copied: a secret is
+* swapped (or moved, with C++11), passed by reference, or duplicated
+* explicitly with assign().
+* assign() reuses the buffer when the new secret fits in it, so that a
+* secret replaced over and over does not allocate at all.
+* A QString copy, from toString(), is only made where a Qt, QGIS or
+* QtKeychain API requires one; wipe() clears such copies when we own them.
+* The copies handed over to those APIs (the auth manager, the credentials
+* dialog line edit, the wallet job text) and the ones they make are out of
+* reach: they are neither locked nor wiped.
+* If the pages cannot be locked (e.g. RLIMIT_MEMLOCK) the arena works all
+* the same, without the locking; if they cannot even be mapped the secret
+* falls back to an unlocked heap buffer, and isLocked() returns false.
+*/
+class KeyChainBridgeSecret
+{
+  public:
+
+    //! An empty secret, nothing is allocated
+    KeyChainBridgeSecret();
+
+    //! A secret with the characters of \a text
+    explicit KeyChainBridgeSecret( const QString &text );
+
+#ifdef Q_COMPILER_RVALUE_REFS
+    KeyChainBridgeSecret( KeyChainBridgeSecret &&other );
+
+    KeyChainBridgeSecret &operator=( KeyChainBridgeSecret &&other );
+#endif
+
+    //! The secret is wiped and its buffer given back to the arena
+    ~KeyChainBridgeSecret();
+
+    bool isEmpty() const { return mSize == 0; }
+
+    //! Number of characters
+    int size() const { return mSize; }
+
+    //! Number of characters that fit in the buffer
+    int capacity() const { return mCapacity; }
+
+    //! The characters, not null terminated
+    const QChar *constData() const { return mData; }
+
+    //! Replace the secret with the characters of \a text
+    void assign( const QString &text );
+
+    //! Replace the secret with a copy of \a other
+    void assign( const KeyChainBridgeSecret &other );
+
+    //! Wipe the secret, the buffer is kept for the next assign()
+    void clear();
+
+    //! Wipe the secret and give the buffer back to the arena
+    void release();
+
+    void swap( KeyChainBridgeSecret &other );
+
+    //! Whether the secret is \a text, in a time that does not depend on
+    //! where they differ
+    bool equals( const QString &text ) const;
+
+    bool operator==( const KeyChainBridgeSecret &other ) const;
+
+    bool operator!=( const KeyChainBridgeSecret &other ) const { return ! operator==( other ); }
+
+    //! A copy for the APIs taking a QString, wipe() it when done if possible
+    QString toString() const;
+
+    //! Overwrite the characters of \a text, if no other QString shares
+    //! them, and clear it
+    static void wipe( QString &text );
+
+    //! Overwrite the bytes of \a data, if no other QByteArray shares them,
+    //! and clear it
+    static void wipe( QByteArray &data );
+
+    //! Number of secret buffers allocated so far, in the arena or on the
+    //! heap. QString copies, from toString() or elsewhere, are not counted
+    static int allocations();
+
+    //! Whether the arena pages are locked in RAM
+    static bool isLocked();
+
+  private:
+
+    Q_DISABLE_COPY( KeyChainBridgeSecret )
+
+    void assign( const QChar *data, int size );
+
+    QChar *mData;
+
+    int mSize;
+
+    int mCapacity;
+
+    //! mData is a heap buffer, not arena memory
+    bool mOnHeap;
+};
+
+#endif //KeyChainBridgeSecret_H
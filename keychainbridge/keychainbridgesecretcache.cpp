@@ -0,0 +1,674 @@
+/***************************************************************************
+  keychainbridgesecretcache.cpp
+
+  Encrypted on-disk secret store
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgesecretcache.h"
+#include "keychainbridgelog.h"
+
+#include "qgsapplication.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QHostInfo>
+#include <QStringList>
+#include <QtEndian>
+
+#include <stdio.h>
+#include <string.h>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// File layout: magic, version, salt, HMAC of the previous fields
+const quint32 CACHE_MAGIC = 0x4B434243;
+const quint32 CACHE_VERSION = 1;
+const int CACHE_SALT_SIZE = 16;
+const int CACHE_MAC_SIZE = 32;
+const int CACHE_HEADER_SIZE = 8 + CACHE_SALT_SIZE + CACHE_MAC_SIZE;
+
+// Record layout: body length, IV, ciphertext, HMAC of the previous fields
+const int CACHE_IV_SIZE = 16;
+const int CACHE_BLOCK_SIZE = 16;
+// Upper bound of the body length: secrets are passwords, not blobs
+const quint32 CACHE_MAX_RECORD_SIZE = 1024 * 1024;
+
+// Key derivation cost, paid once per load
+const unsigned int CACHE_PBKDF2_ITERATIONS = 10000;
+
+// Compact when there are more dead records than this, and than live ones
+const int CACHE_COMPACT_THRESHOLD = 32;
+
+// How long to wait for another process to release the file, in ms
+const int CACHE_LOCK_TIMEOUT = 10000;
+
+
+/**
+ * Exclusive lock on the cache file, between processes, held for the life
+ * of the object. The lock is taken on a separate file, that survives the
+ * rename done by compact()
+ */
+class KeyChainBridgeSecretCacheLock
+{
+  public:
+
+    explicit KeyChainBridgeSecretCacheLock( const QString &fileName );
+    ~KeyChainBridgeSecretCacheLock();
+
+    bool isLocked() const;
+
+  private:
+
+#ifdef Q_OS_WIN
+    HANDLE mHandle;
+#else
+    int mFd;
+#endif
+};
+
+KeyChainBridgeSecretCacheLock::KeyChainBridgeSecretCacheLock( const QString &fileName )
+{
+  QString lockFileName( fileName + ".lock" );
+  QDir().mkpath( QFileInfo( lockFileName ).absolutePath() );
+#ifdef Q_OS_WIN
+  // An exclusive open is the lock: retry until the holder closes it
+  QElapsedTimer timer;
+  timer.start();
+  do
+  {
+    mHandle = CreateFileW( reinterpret_cast<const wchar_t *>( QDir::toNativeSeparators( lockFileName ).utf16() ),
+                           GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+    if ( mHandle != INVALID_HANDLE_VALUE || GetLastError() != ERROR_SHARING_VIOLATION )
+    {
+      break;
+    }
+    Sleep( 10 );
+  }
+  while ( timer.elapsed() < CACHE_LOCK_TIMEOUT );
+#else
+  mFd = ::open( QFile::encodeName( lockFileName ).constData(), O_RDWR | O_CREAT, 0600 );
+  if ( mFd != -1 )
+  {
+    struct flock lock;
+    memset( &lock, 0, sizeof( lock ) );
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    QElapsedTimer timer;
+    timer.start();
+    while ( fcntl( mFd, F_SETLK, &lock ) == -1 )
+    {
+      if ( timer.elapsed() >= CACHE_LOCK_TIMEOUT )
+      {
+        ::close( mFd );
+        mFd = -1;
+        break;
+      }
+      usleep( 10000 );
+    }
+  }
+#endif
+}
+
+KeyChainBridgeSecretCacheLock::~KeyChainBridgeSecretCacheLock()
+{
+  // Closing releases the lock
+#ifdef Q_OS_WIN
+  if ( mHandle != INVALID_HANDLE_VALUE )
+  {
+    CloseHandle( mHandle );
+  }
+#else
+  if ( mFd != -1 )
+  {
+    ::close( mFd );
+  }
+#endif
+}
+
+bool KeyChainBridgeSecretCacheLock::isLocked() const
+{
+#ifdef Q_OS_WIN
+  return mHandle != INVALID_HANDLE_VALUE;
+#else
+  return mFd != -1;
+#endif
+}
+
+
+KeyChainBridgeSecretCache::KeyChainBridgeSecretCache( const QString &fileName, const QByteArray &binding ):
+    mFileName( fileName ),
+    mBinding( binding.isEmpty() ? defaultBinding() : binding ),
+    mMap( nullptr ),
+    mSize( 0 ),
+    mDeadRecords( 0 ),
+    mCorruptRecords( 0 ),
+    mLoaded( false )
+{
+}
+
+KeyChainBridgeSecretCache::~KeyChainBridgeSecretCache()
+{
+  close();
+  mBinding.fill( 0 );
+}
+
+QString KeyChainBridgeSecretCache::defaultFileName()
+{
+  return QgsApplication::qgisSettingsDirPath() + "keychainbridge-secrets.cache";
+}
+
+bool KeyChainBridgeSecretCache::isSupported()
+{
+  return QCA::isSupported( "aes256-cbc-pkcs7" ) && QCA::isSupported( "hmac(sha256)" ) && QCA::isSupported( "pbkdf2(sha1)" );
+}
+
+QByteArray KeyChainBridgeSecretCache::defaultBinding()
+{
+  QByteArray user( qgetenv( "USER" ) );
+  if ( user.isEmpty() )
+  {
+    user = qgetenv( "USERNAME" );
+  }
+  QByteArray machine;
+  Q_FOREACH ( const QString &path, QStringList() << "/etc/machine-id" << "/var/lib/dbus/machine-id" )
+  {
+    QFile file( path );
+    if ( file.open( QIODevice::ReadOnly ) )
+    {
+      machine = file.readLine().trimmed();
+      break;
+    }
+  }
+  if ( machine.isEmpty() )
+  {
+    machine = QHostInfo::localHostName().toUtf8();
+  }
+  return user + '\n' + machine;
+}
+
+QString KeyChainBridgeSecretCache::recordKey( const QString &service, const QString &key )
+{
+  return QString( "%1/%2" ).arg( service, key );
+}
+
+void KeyChainBridgeSecretCache::deriveKeys( const QByteArray &salt )
+{
+  if ( salt == mSalt && ! mCipherKey.isEmpty() )
+  {
+    return;
+  }
+  QCA::PBKDF2 pbkdf2( "sha1" );
+  QCA::SymmetricKey keys( pbkdf2.makeKey( QCA::SecureArray( mBinding ), QCA::InitializationVector( salt ), 64, CACHE_PBKDF2_ITERATIONS ) );
+  QByteArray bytes( keys.toByteArray() );
+  mCipherKey = QCA::SymmetricKey( bytes.left( 32 ) );
+  mMacKey = QCA::SymmetricKey( bytes.mid( 32 ) );
+  bytes.fill( 0 );
+  mSalt = salt;
+}
+
+QByteArray KeyChainBridgeSecretCache::mac( const QByteArray &data ) const
+{
+  QCA::MessageAuthenticationCode hmac( "hmac(sha256)", mMacKey );
+  hmac.update( QCA::MemoryRegion( data ) );
+  return hmac.final().toByteArray();
+}
+
+// Comparison in constant time: the MAC must not leak through timing
+static bool sameMac( const QByteArray &expected, const uchar *actual )
+{
+  if ( expected.size() != CACHE_MAC_SIZE )
+  {
+    return false;
+  }
+  uchar diff = 0;
+  for ( int i = 0; i < CACHE_MAC_SIZE; ++i )
+  {
+    diff |= static_cast<uchar>( expected.at( i ) ) ^ actual[i];
+  }
+  return diff == 0;
+}
+
+QByteArray KeyChainBridgeSecretCache::seal( const QByteArray &plain ) const
+{
+  QCA::InitializationVector iv( CACHE_IV_SIZE );
+  QCA::Cipher cipher( "aes256", QCA::Cipher::CBC, QCA::Cipher::DefaultPadding, QCA::Encode, mCipherKey, iv );
+  QCA::SecureArray encrypted( cipher.process( QCA::SecureArray( plain ) ) );
+  if ( ! cipher.ok() )
+  {
+    return QByteArray();
+  }
+  QByteArray record( 4, '\0' );
+  qToBigEndian<quint32>( CACHE_IV_SIZE + encrypted.size(), reinterpret_cast<uchar *>( record.data() ) );
+  record += iv.toByteArray();
+  record += encrypted.toByteArray();
+  record += mac( record );
+  return record;
+}
+
+bool KeyChainBridgeSecretCache::open( qint64 offset, QByteArray &plain, qint64 &size ) const
+{
+  qint64 available = mSize - offset;
+  if ( available < 4 )
+  {
+    return false;
+  }
+  const uchar *data = mMap + offset;
+  quint32 length = qFromBigEndian<quint32>( data );
+  if ( length < CACHE_IV_SIZE + CACHE_BLOCK_SIZE || length > CACHE_MAX_RECORD_SIZE
+       || ( length - CACHE_IV_SIZE ) % CACHE_BLOCK_SIZE != 0
+       || qint64( length ) + 4 + CACHE_MAC_SIZE > available )
+  {
+    return false;
+  }
+  const char *bytes = reinterpret_cast<const char *>( data );
+  if ( ! sameMac( mac( QByteArray::fromRawData( bytes, 4 + length ) ), data + 4 + length ) )
+  {
+    return false;
+  }
+  QCA::InitializationVector iv( QByteArray( bytes + 4, CACHE_IV_SIZE ) );
+  QCA::Cipher cipher( "aes256", QCA::Cipher::CBC, QCA::Cipher::DefaultPadding, QCA::Decode, mCipherKey, iv );
+  QCA::SecureArray decrypted( cipher.process( QCA::SecureArray( QByteArray( bytes + 4 + CACHE_IV_SIZE, length - CACHE_IV_SIZE ) ) ) );
+  if ( ! cipher.ok() )
+  {
+    return false;
+  }
+  plain = decrypted.toByteArray();
+  size = 4 + length + CACHE_MAC_SIZE;
+  return true;
+}
+
+bool KeyChainBridgeSecretCache::load()
+{
+  KeyChainBridgeSecretCacheLock lock( mFileName );
+  if ( ! lock.isLocked() )
+  {
+    close();
+    mErrorString = QObject::tr( "%1 is locked by another process" ).arg( mFileName );
+    return false;
+  }
+  return loadLocked();
+}
+
+bool KeyChainBridgeSecretCache::loadLocked()
+{
+  close();
+  mIndex.clear();
+  mDeadRecords = 0;
+  mCorruptRecords = 0;
+  mErrorString.clear();
+  if ( ! isSupported() )
+  {
+    mErrorString = QObject::tr( "QCA does not provide AES-256, HMAC-SHA256 and PBKDF2" );
+    return false;
+  }
+  mFile.setFileName( mFileName );
+  bool exists = mFile.exists() && mFile.size() > 0;
+  if ( ! exists )
+  {
+    QDir().mkpath( QFileInfo( mFileName ).absolutePath() );
+  }
+  if ( ! mFile.open( exists ? QIODevice::ReadWrite : QIODevice::ReadWrite | QIODevice::Truncate ) )
+  {
+    mErrorString = mFile.errorString();
+    return false;
+  }
+
+  if ( exists )
+  {
+    QByteArray header( mFile.read( CACHE_HEADER_SIZE ) );
+    const uchar *data = reinterpret_cast<const uchar *>( header.constData() );
+    if ( header.size() != CACHE_HEADER_SIZE || qFromBigEndian<quint32>( data ) != CACHE_MAGIC
+         || qFromBigEndian<quint32>( data + 4 ) != CACHE_VERSION )
+    {
+      mErrorString = QObject::tr( "%1 is not a secret cache" ).arg( mFileName );
+      close();
+      return false;
+    }
+    deriveKeys( header.mid( 8, CACHE_SALT_SIZE ) );
+    if ( ! sameMac( mac( header.left( 8 + CACHE_SALT_SIZE ) ), data + 8 + CACHE_SALT_SIZE ) )
+    {
+      mErrorString = QObject::tr( "%1 belongs to another user or machine" ).arg( mFileName );
+      close();
+      return false;
+    }
+  }
+  else
+  {
+    QByteArray header( 8, '\0' );
+    qToBigEndian<quint32>( CACHE_MAGIC, reinterpret_cast<uchar *>( header.data() ) );
+    qToBigEndian<quint32>( CACHE_VERSION, reinterpret_cast<uchar *>( header.data() ) + 4 );
+    header += QCA::Random::randomArray( CACHE_SALT_SIZE ).toByteArray();
+    deriveKeys( header.mid( 8 ) );
+    header += mac( header );
+    mFile.setPermissions( QFile::ReadOwner | QFile::WriteOwner );
+    if ( mFile.write( header ) != header.size() || ! mFile.flush() )
+    {
+      mErrorString = mFile.errorString();
+      close();
+      QFile::remove( mFileName );
+      return false;
+    }
+  }
+
+  // Index the records, up to the first damaged one: after that the
+  // framing cannot be trusted
+  mSize = mFile.size();
+  if ( ! remap() )
+  {
+    return false;
+  }
+  qint64 offset = CACHE_HEADER_SIZE;
+  while ( offset < mSize )
+  {
+    QByteArray plain;
+    qint64 size;
+    quint8 operation = 0;
+    QString service;
+    QString key;
+    if ( open( offset, plain, size ) )
+    {
+      QDataStream stream( plain );
+      stream.setVersion( QDataStream::Qt_4_8 );
+      stream >> operation >> service >> key;
+      plain.fill( 0 );
+      if ( stream.status() != QDataStream::Ok )
+      {
+        operation = 0;
+      }
+    }
+    if ( operation != Set && operation != Remove )
+    {
+      ++mCorruptRecords;
+      break;
+    }
+    QString name( recordKey( service, key ) );
+    if ( mIndex.contains( name ) )
+    {
+      ++mDeadRecords;
+    }
+    if ( operation == Set )
+    {
+      mIndex.insert( name, offset );
+    }
+    else
+    {
+      mIndex.remove( name );
+      ++mDeadRecords;
+    }
+    offset += size;
+  }
+  if ( mCorruptRecords )
+  {
+    KEYCHAINBRIDGE_WARNING( Wallet, QString( "Secret cache %1 is damaged, dropping %2 bytes." ).arg( mFileName ).arg( mSize - offset ) );
+    mSize = offset;
+    mFile.unmap( mMap );
+    mMap = nullptr;
+    if ( ! mFile.resize( mSize ) )
+    {
+      mErrorString = mFile.errorString();
+      close();
+      return false;
+    }
+    if ( ! remap() )
+    {
+      return false;
+    }
+  }
+  mLoaded = true;
+  return true;
+}
+
+bool KeyChainBridgeSecretCache::isStale() const
+{
+  // Appended to, or compacted, by another process
+  QFileInfo info( mFileName );
+  if ( ! info.exists() || info.size() != mSize )
+  {
+    return true;
+  }
+#ifdef Q_OS_UNIX
+  struct stat current;
+  struct stat opened;
+  if ( ::stat( QFile::encodeName( mFileName ).constData(), &current ) != 0 || fstat( mFile.handle(), &opened ) != 0
+       || current.st_ino != opened.st_ino || current.st_dev != opened.st_dev )
+  {
+    return true;
+  }
+#endif
+  return false;
+}
+
+bool KeyChainBridgeSecretCache::remap()
+{
+  if ( mMap )
+  {
+    mFile.unmap( mMap );
+    mMap = nullptr;
+  }
+  mMap = mFile.map( 0, mSize );
+  if ( ! mMap )
+  {
+    mErrorString = mFile.errorString();
+    close();
+    return false;
+  }
+  return true;
+}
+
+void KeyChainBridgeSecretCache::close()
+{
+  if ( mMap )
+  {
+    mFile.unmap( mMap );
+    mMap = nullptr;
+  }
+  mFile.close();
+  mSize = 0;
+  mLoaded = false;
+}
+
+bool KeyChainBridgeSecretCache::contains( const QString &service, const QString &key ) const
+{
+  return mIndex.contains( recordKey( service, key ) );
+}
+
+QString KeyChainBridgeSecretCache::secret( const QString &service, const QString &key ) const
+{
+  QHash<QString, qint64>::const_iterator it = mIndex.constFind( recordKey( service, key ) );
+  QByteArray plain;
+  qint64 size;
+  if ( it == mIndex.constEnd() || ! open( it.value(), plain, size ) )
+  {
+    return QString();
+  }
+  quint8 operation;
+  QString storedService;
+  QString storedKey;
+  QString value;
+  QDataStream stream( plain );
+  stream.setVersion( QDataStream::Qt_4_8 );
+  stream >> operation >> storedService >> storedKey >> value;
+  plain.fill( 0 );
+  return stream.status() == QDataStream::Ok ? value : QString();
+}
+
+bool KeyChainBridgeSecretCache::setSecret( const QString &service, const QString &key, const QString &secret )
+{
+  QByteArray plain;
+  QDataStream stream( &plain, QIODevice::WriteOnly );
+  stream.setVersion( QDataStream::Qt_4_8 );
+  stream << static_cast<quint8>( Set ) << service << key << secret;
+  qint64 offset;
+  bool ok = append( plain, offset );
+  plain.fill( 0 );
+  if ( ! ok )
+  {
+    return false;
+  }
+  if ( mIndex.contains( recordKey( service, key ) ) )
+  {
+    ++mDeadRecords;
+  }
+  mIndex.insert( recordKey( service, key ), offset );
+  if ( mDeadRecords > CACHE_COMPACT_THRESHOLD && mDeadRecords > mIndex.size() )
+  {
+    compact();
+  }
+  return true;
+}
+
+bool KeyChainBridgeSecretCache::removeSecret( const QString &service, const QString &key )
+{
+  if ( ! contains( service, key ) )
+  {
+    return false;
+  }
+  QByteArray plain;
+  QDataStream stream( &plain, QIODevice::WriteOnly );
+  stream.setVersion( QDataStream::Qt_4_8 );
+  stream << static_cast<quint8>( Remove ) << service << key;
+  qint64 offset;
+  if ( ! append( plain, offset ) )
+  {
+    return false;
+  }
+  // Another process may have removed it already
+  if ( mIndex.remove( recordKey( service, key ) ) )
+  {
+    mDeadRecords += 2;
+  }
+  return true;
+}
+
+bool KeyChainBridgeSecretCache::append( const QByteArray &plain, qint64 &offset )
+{
+  if ( ! mLoaded )
+  {
+    mErrorString = QObject::tr( "The secret cache is not loaded" );
+    return false;
+  }
+  KeyChainBridgeSecretCacheLock lock( mFileName );
+  if ( ! lock.isLocked() )
+  {
+    mErrorString = QObject::tr( "%1 is locked by another process" ).arg( mFileName );
+    return false;
+  }
+  // Never write over the records of another process
+  if ( isStale() && ! loadLocked() )
+  {
+    return false;
+  }
+  QByteArray record( seal( plain ) );
+  if ( record.isEmpty() )
+  {
+    mErrorString = QObject::tr( "Encryption failed" );
+    return false;
+  }
+  // A single write: a crash leaves at most a torn record at the end, that
+  // does not authenticate and is dropped at the next load
+  if ( ! mFile.seek( mSize ) || mFile.write( record ) != record.size() || ! mFile.flush() )
+  {
+    mErrorString = mFile.errorString();
+    mFile.resize( mSize );
+    return false;
+  }
+#ifdef Q_OS_UNIX
+  fsync( mFile.handle() );
+#endif
+  offset = mSize;
+  mSize += record.size();
+  return remap();
+}
+
+bool KeyChainBridgeSecretCache::compact()
+{
+  if ( ! mLoaded )
+  {
+    return false;
+  }
+  KeyChainBridgeSecretCacheLock lock( mFileName );
+  if ( ! lock.isLocked() )
+  {
+    mErrorString = QObject::tr( "%1 is locked by another process" ).arg( mFileName );
+    return false;
+  }
+  // The records of other processes are live too
+  if ( isStale() && ! loadLocked() )
+  {
+    return false;
+  }
+  QByteArray contents( reinterpret_cast<const char *>( mMap ), CACHE_HEADER_SIZE );
+  QHash<QString, qint64>::const_iterator it = mIndex.constBegin();
+  for ( ; it != mIndex.constEnd(); ++it )
+  {
+    QByteArray plain;
+    qint64 size;
+    if ( open( it.value(), plain, size ) )
+    {
+      contents += seal( plain );
+      plain.fill( 0 );
+    }
+  }
+
+  QString tempFileName( mFileName + ".tmp" );
+  QFile temp( tempFileName );
+  if ( ! temp.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+  {
+    mErrorString = temp.errorString();
+    return false;
+  }
+  temp.setPermissions( QFile::ReadOwner | QFile::WriteOwner );
+  bool ok = temp.write( contents ) == contents.size() && temp.flush();
+#ifdef Q_OS_UNIX
+  ok = ok && fsync( temp.handle() ) == 0;
+#endif
+  temp.close();
+  if ( ! ok )
+  {
+    mErrorString = temp.errorString();
+    QFile::remove( tempFileName );
+    return false;
+  }
+
+  // Readers see either the old or the new file, never a mix
+  close();
+#ifdef Q_OS_WIN
+  // Fails, leaving the old file, while another process has it open
+  ok = MoveFileExW( reinterpret_cast<const wchar_t *>( QDir::toNativeSeparators( tempFileName ).utf16() ),
+                    reinterpret_cast<const wchar_t *>( QDir::toNativeSeparators( mFileName ).utf16() ),
+                    MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH ) != 0;
+#else
+  ok = ::rename( QFile::encodeName( tempFileName ).constData(), QFile::encodeName( mFileName ).constData() ) == 0;
+#endif
+  if ( ! ok )
+  {
+    QFile::remove( tempFileName );
+  }
+  return loadLocked() && ok;
+}
+
+bool KeyChainBridgeSecretCache::clear()
+{
+  KeyChainBridgeSecretCacheLock lock( mFileName );
+  close();
+  mIndex.clear();
+  mDeadRecords = 0;
+  return ! QFile::exists( mFileName ) || QFile::remove( mFileName );
+}
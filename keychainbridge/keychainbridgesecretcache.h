@@ -0,0 +1,171 @@
+/***************************************************************************
+    keychainbridgesecretcache.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeSecretCache_H
+#define KeyChainBridgeSecretCache_H
+
+//QT4 includes
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QString>
+
+#include <QtCrypto>
+
+
+/**
+* \class KeyChainBridgeSecretCache
+* \brief Encrypted on-disk secret store
+* The file is a header followed by an append-only log of records, each one
+* encrypted with AES-256 and authenticated with HMAC-SHA256: an update is a
+* single append, a torn or tampered record is detected and dropped, together
+* with everything after it. The log is compacted, through an atomic rename,
+* when it is mostly made of overwritten records. Loads, appends and
+* compactions hold a lock on "<fileName>.lock", so that several QGIS
+* instances can share the file.
+* The keys are derived from the user name, the machine id and a random salt,
+* all of which can be read by anyone able to read the file: the encryption
+* is obfuscation, it only makes a copy of the file useless on another
+* machine. The secrets are protected by the permissions of the file (owner
+* only) and nothing else, unlike in the wallet.
+* The file is memory mapped: a lookup decrypts a single record, with no I/O,
+* and sees the file as of the last load or write.
+* QCA must be initialized, as QgsAuthManager does.
+*/
+class KeyChainBridgeSecretCache
+{
+  public:
+
+    //! Store in \a fileName, the keys are bound to \a binding or, if empty,
+    //! to the current user and machine
+    explicit KeyChainBridgeSecretCache( const QString &fileName, const QByteArray &binding = QByteArray() );
+    ~KeyChainBridgeSecretCache();
+
+    //! Default location, in the QGIS settings directory
+    static QString defaultFileName();
+
+    //! Whether QCA provides the required algorithms
+    static bool isSupported();
+
+    QString fileName() const { return mFileName; }
+
+    //! Open the file, creating it if missing, and index the records
+    //! Returns false if the file cannot be used, see errorString()
+    bool load();
+
+    //! Whether load() has succeeded
+    bool isLoaded() const { return mLoaded; }
+
+    //! Whether a secret is stored for \a service and \a key
+    bool contains( const QString &service, const QString &key ) const;
+
+    //! Stored secret, a null string if not found
+    QString secret( const QString &service, const QString &key ) const;
+
+    //! Store \a secret, the file is updated before returning
+    bool setSecret( const QString &service, const QString &key, const QString &secret );
+
+    //! Remove the secret, returns false if it was not stored or on error
+    bool removeSecret( const QString &service, const QString &key );
+
+    //! Remove the file
+    bool clear();
+
+    //! Number of stored secrets
+    int count() const { return mIndex.size(); }
+
+    //! Records dropped by the last load() because they were damaged
+    int corruptRecords() const { return mCorruptRecords; }
+
+    //! Rewrite the file with the live records only
+    bool compact();
+
+    //! Description of the last error
+    QString errorString() const { return mErrorString; }
+
+  private:
+
+    //! Record operation
+    enum Operation
+    {
+      Set = 1,
+      Remove = 2
+    };
+
+    //! Derive the cipher and MAC keys from the binding and \a salt
+    void deriveKeys( const QByteArray &salt );
+
+    //! HMAC of \a data with the MAC key
+    QByteArray mac( const QByteArray &data ) const;
+
+    //! Encrypted and authenticated record of \a plain
+    QByteArray seal( const QByteArray &plain ) const;
+
+    //! Decrypt the record at \a offset in the mapping, sets its \a size
+    //! Returns false if it is truncated or does not authenticate
+    bool open( qint64 offset, QByteArray &plain, qint64 &size ) const;
+
+    //! Append the record of \a plain, atomically, at \a offset
+    bool append( const QByteArray &plain, qint64 &offset );
+
+    //! load() with the lock already held
+    bool loadLocked();
+
+    //! Whether another process has changed the file since it was mapped
+    bool isStale() const;
+
+    //! Map the valid part of the file
+    bool remap();
+
+    //! Unmap and close the file
+    void close();
+
+    //! Index key
+    static QString recordKey( const QString &service, const QString &key );
+
+    //! Default binding: user name and machine id, not secret
+    static QByteArray defaultBinding();
+
+    QString mFileName;
+
+    QByteArray mBinding;
+
+    QByteArray mSalt;
+
+    QCA::SymmetricKey mCipherKey;
+
+    QCA::SymmetricKey mMacKey;
+
+    QFile mFile;
+
+    uchar *mMap;
+
+    //! Size of the valid part of the file, header included
+    qint64 mSize;
+
+    //! Offset of the latest record of each stored secret
+    QHash<QString, qint64> mIndex;
+
+    //! Overwritten and removed records, reclaimed by compact()
+    int mDeadRecords;
+
+    int mCorruptRecords;
+
+    bool mLoaded;
+
+    QString mErrorString;
+};
+
+#endif //KeyChainBridgeSecretCache_H
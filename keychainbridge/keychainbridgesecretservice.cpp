@@ -0,0 +1,586 @@
+/***************************************************************************
+  keychainbridgesecretservice.cpp
+
+  Secret Service backend with a persistent session
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgesecretservice.h"
+#include "keychainbridgelog.h"
+
+#include <QDBusMessage>
+#include <QDBusMetaType>
+#include <QDBusPendingCallWatcher>
+#include <QDBusServiceWatcher>
+#include <QDBusVariant>
+#include <QVariantMap>
+
+const char *KeyChainBridgeSecretServiceBackend::SERVICE_NAME = "org.freedesktop.secrets";
+
+static const char *SERVICE_PATH = "/org/freedesktop/secrets";
+static const char *SERVICE_INTERFACE = "org.freedesktop.Secret.Service";
+static const char *SESSION_INTERFACE = "org.freedesktop.Secret.Session";
+static const char *COLLECTION_INTERFACE = "org.freedesktop.Secret.Collection";
+static const char *ITEM_INTERFACE = "org.freedesktop.Secret.Item";
+static const char *PROMPT_INTERFACE = "org.freedesktop.Secret.Prompt";
+
+// Returned instead of a prompt path when no prompt is needed
+static const char *NO_PROMPT = "/";
+
+
+QDBusArgument &operator<<( QDBusArgument &argument, const KeyChainBridgeDBusSecret &secret )
+{
+  argument.beginStructure();
+  argument << secret.session << secret.parameters << secret.value << secret.contentType;
+  argument.endStructure();
+  return argument;
+}
+
+const QDBusArgument &operator>>( const QDBusArgument &argument, KeyChainBridgeDBusSecret &secret )
+{
+  argument.beginStructure();
+  argument >> secret.session >> secret.parameters >> secret.value >> secret.contentType;
+  argument.endStructure();
+  return argument;
+}
+
+QDBusArgument &operator<<( QDBusArgument &argument, const KeyChainBridgeObjectPathList &list )
+{
+  argument.beginArray( qMetaTypeId<QDBusObjectPath>() );
+  Q_FOREACH ( const QDBusObjectPath &path, list.paths )
+  {
+    argument << path;
+  }
+  argument.endArray();
+  return argument;
+}
+
+const QDBusArgument &operator>>( const QDBusArgument &argument, KeyChainBridgeObjectPathList &list )
+{
+  list.paths.clear();
+  argument.beginArray();
+  while ( ! argument.atEnd() )
+  {
+    QDBusObjectPath path;
+    argument >> path;
+    list.paths.append( path );
+  }
+  argument.endArray();
+  return argument;
+}
+
+QDBusArgument &operator<<( QDBusArgument &argument, const KeyChainBridgeSecretAttributes &attributes )
+{
+  argument.beginMap( QVariant::String, QVariant::String );
+  QMap<QString, QString>::const_iterator it = attributes.attributes.constBegin();
+  for ( ; it != attributes.attributes.constEnd(); ++it )
+  {
+    argument.beginMapEntry();
+    argument << it.key() << it.value();
+    argument.endMapEntry();
+  }
+  argument.endMap();
+  return argument;
+}
+
+const QDBusArgument &operator>>( const QDBusArgument &argument, KeyChainBridgeSecretAttributes &attributes )
+{
+  attributes.attributes.clear();
+  argument.beginMap();
+  while ( ! argument.atEnd() )
+  {
+    QString key;
+    QString value;
+    argument.beginMapEntry();
+    argument >> key >> value;
+    argument.endMapEntry();
+    attributes.attributes.insert( key, value );
+  }
+  argument.endMap();
+  return argument;
+}
+
+QDBusArgument &operator<<( QDBusArgument &argument, const KeyChainBridgeSecretMap &map )
+{
+  argument.beginMap( qMetaTypeId<QDBusObjectPath>(), qMetaTypeId<KeyChainBridgeDBusSecret>() );
+  for ( int i = 0; i < map.secrets.size(); ++i )
+  {
+    argument.beginMapEntry();
+    argument << map.secrets.at( i ).first << map.secrets.at( i ).second;
+    argument.endMapEntry();
+  }
+  argument.endMap();
+  return argument;
+}
+
+const QDBusArgument &operator>>( const QDBusArgument &argument, KeyChainBridgeSecretMap &map )
+{
+  map.secrets.clear();
+  argument.beginMap();
+  while ( ! argument.atEnd() )
+  {
+    QPair<QDBusObjectPath, KeyChainBridgeDBusSecret> entry;
+    argument.beginMapEntry();
+    argument >> entry.first >> entry.second;
+    argument.endMapEntry();
+    map.secrets.append( entry );
+  }
+  argument.endMap();
+  return argument;
+}
+
+
+KeyChainBridgeSecretServiceBackend::KeyChainBridgeSecretServiceBackend( const QDBusConnection &connection, QObject *parent ):
+    KeyChainBridgeBackend( parent ),
+    mConnection( connection ),
+    mServiceWatcher( new QDBusServiceWatcher( SERVICE_NAME, connection, QDBusServiceWatcher::WatchForUnregistration, this ) ),
+    mConnecting( false ),
+    mSessionCount( 0 )
+{
+  registerTypes();
+  connect( mServiceWatcher, SIGNAL( serviceUnregistered( QString ) ), this, SLOT( serviceUnregistered() ) );
+}
+
+KeyChainBridgeSecretServiceBackend::~KeyChainBridgeSecretServiceBackend()
+{
+  disconnectService();
+}
+
+void KeyChainBridgeSecretServiceBackend::registerTypes()
+{
+  qDBusRegisterMetaType<KeyChainBridgeDBusSecret>();
+  qDBusRegisterMetaType<KeyChainBridgeObjectPathList>();
+  qDBusRegisterMetaType<KeyChainBridgeSecretAttributes>();
+  qDBusRegisterMetaType<KeyChainBridgeSecretMap>();
+}
+
+bool KeyChainBridgeSecretServiceBackend::isConnected() const
+{
+  return ! mConnecting && ! mSession.path().isEmpty() && ! mCollection.path().isEmpty();
+}
+
+void KeyChainBridgeSecretServiceBackend::start( KeyChainBridgeWalletJob *job )
+{
+  mReconnected.removeAll( QPointer<KeyChainBridgeWalletJob>() );
+  if ( isConnected() )
+  {
+    run( job );
+    return;
+  }
+  mWaiting.append( job );
+  connectService();
+}
+
+void KeyChainBridgeSecretServiceBackend::disconnectService()
+{
+  if ( ! mSession.path().isEmpty() && mConnection.isConnected() )
+  {
+    // Nobody waits for the answer
+    QDBusMessage message = QDBusMessage::createMethodCall( SERVICE_NAME, mSession.path(), SESSION_INTERFACE, "Close" );
+    mConnection.asyncCall( message );
+  }
+  mSession = QDBusObjectPath();
+  mCollection = QDBusObjectPath();
+}
+
+void KeyChainBridgeSecretServiceBackend::serviceUnregistered()
+{
+  KEYCHAINBRIDGE_DEBUG( Wallet, QString( "The Secret Service has left the bus." ) );
+  mSession = QDBusObjectPath();
+  mCollection = QDBusObjectPath();
+}
+
+void KeyChainBridgeSecretServiceBackend::connectService()
+{
+  if ( mConnecting )
+  {
+    return;
+  }
+  mConnecting = true;
+  disconnectService();
+  KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Opening a Secret Service session." ) );
+  // Plain transfer: the secrets never leave the machine, the bus is local
+  call( SERVICE_PATH, SERVICE_INTERFACE, "OpenSession",
+        QList<QVariant>() << QString( "plain" ) << QVariant::fromValue( QDBusVariant( QString() ) ),
+        SLOT( sessionOpened( QDBusPendingCallWatcher* ) ) );
+}
+
+void KeyChainBridgeSecretServiceBackend::sessionOpened( QDBusPendingCallWatcher *watcher )
+{
+  mCalls.remove( watcher );
+  watcher->deleteLater();
+  if ( watcher->isError() )
+  {
+    connectionFailed( keychainError( watcher->error() ), watcher->error().message() );
+    return;
+  }
+  mSession = watcher->reply().arguments().value( 1 ).value<QDBusObjectPath>();
+  ++mSessionCount;
+  call( SERVICE_PATH, SERVICE_INTERFACE, "ReadAlias", QList<QVariant>() << QString( "default" ),
+        SLOT( collectionFound( QDBusPendingCallWatcher* ) ) );
+}
+
+void KeyChainBridgeSecretServiceBackend::collectionFound( QDBusPendingCallWatcher *watcher )
+{
+  mCalls.remove( watcher );
+  watcher->deleteLater();
+  if ( watcher->isError() )
+  {
+    connectionFailed( keychainError( watcher->error() ), watcher->error().message() );
+    return;
+  }
+  QDBusObjectPath collection = watcher->reply().arguments().value( 0 ).value<QDBusObjectPath>();
+  if ( collection.path().isEmpty() || collection.path() == NO_PROMPT )
+  {
+    connectionFailed( QKeychain::NoBackendAvailable, tr( "The Secret Service has no default collection" ) );
+    return;
+  }
+  mCollection = collection;
+  KeyChainBridgeObjectPathList objects;
+  objects.paths << mCollection;
+  call( SERVICE_PATH, SERVICE_INTERFACE, "Unlock", QList<QVariant>() << QVariant::fromValue( objects ),
+        SLOT( collectionUnlocked( QDBusPendingCallWatcher* ) ) );
+}
+
+void KeyChainBridgeSecretServiceBackend::collectionUnlocked( QDBusPendingCallWatcher *watcher )
+{
+  mCalls.remove( watcher );
+  watcher->deleteLater();
+  if ( watcher->isError() )
+  {
+    connectionFailed( keychainError( watcher->error() ), watcher->error().message() );
+    return;
+  }
+  QString prompt = watcher->reply().arguments().value( 1 ).value<QDBusObjectPath>().path();
+  if ( prompt.isEmpty() || prompt == NO_PROMPT )
+  {
+    serviceConnected();
+    return;
+  }
+  // The user must unlock the collection, this happens at most once per session
+  mPrompt = prompt;
+  mConnection.connect( SERVICE_NAME, mPrompt, PROMPT_INTERFACE, "Completed", this, SLOT( promptCompleted( bool, QDBusVariant ) ) );
+  call( mPrompt, PROMPT_INTERFACE, "Prompt", QList<QVariant>() << QString(),
+        SLOT( promptFailed( QDBusPendingCallWatcher* ) ) );
+}
+
+void KeyChainBridgeSecretServiceBackend::promptFailed( QDBusPendingCallWatcher *watcher )
+{
+  mCalls.remove( watcher );
+  watcher->deleteLater();
+  // Success is notified by the Completed signal
+  if ( ! watcher->isError() || mPrompt.isEmpty() )
+  {
+    return;
+  }
+  mConnection.disconnect( SERVICE_NAME, mPrompt, PROMPT_INTERFACE, "Completed", this, SLOT( promptCompleted( bool, QDBusVariant ) ) );
+  mPrompt.clear();
+  connectionFailed( keychainError( watcher->error() ), watcher->error().message() );
+}
+
+void KeyChainBridgeSecretServiceBackend::promptCompleted( bool dismissed, const QDBusVariant &result )
+{
+  Q_UNUSED( result );
+  if ( mPrompt.isEmpty() )
+  {
+    return;
+  }
+  mConnection.disconnect( SERVICE_NAME, mPrompt, PROMPT_INTERFACE, "Completed", this, SLOT( promptCompleted( bool, QDBusVariant ) ) );
+  mPrompt.clear();
+  if ( dismissed )
+  {
+    connectionFailed( QKeychain::AccessDeniedByUser, tr( "The wallet unlock has been dismissed" ) );
+    return;
+  }
+  serviceConnected();
+}
+
+void KeyChainBridgeSecretServiceBackend::serviceConnected()
+{
+  KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Secret Service session %1 open on %2." ).arg( mSession.path(), mCollection.path() ) );
+  mConnecting = false;
+  QList< QPointer<KeyChainBridgeWalletJob> > waiting( mWaiting );
+  mWaiting.clear();
+  Q_FOREACH ( const QPointer<KeyChainBridgeWalletJob> &job, waiting )
+  {
+    if ( job && ! job->isDone() )
+    {
+      run( job );
+    }
+  }
+}
+
+void KeyChainBridgeSecretServiceBackend::connectionFailed( QKeychain::Error error, const QString &errorString )
+{
+  KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Secret Service handshake failed: %1" ).arg( errorString ) );
+  mConnecting = false;
+  disconnectService();
+  QList< QPointer<KeyChainBridgeWalletJob> > waiting( mWaiting );
+  mWaiting.clear();
+  Q_FOREACH ( const QPointer<KeyChainBridgeWalletJob> &job, waiting )
+  {
+    finishJob( job, error, errorString );
+  }
+}
+
+void KeyChainBridgeSecretServiceBackend::run( KeyChainBridgeWalletJob *job )
+{
+  switch ( job->type() )
+  {
+    case KeyChainBridgeWalletJob::Read:
+    case KeyChainBridgeWalletJob::Delete:
+      call( mCollection.path(), COLLECTION_INTERFACE, "SearchItems", QList<QVariant>() << QVariant::fromValue( attributes( job ) ),
+            SLOT( itemsFound( QDBusPendingCallWatcher* ) ), job );
+      break;
+    case KeyChainBridgeWalletJob::Write:
+    {
+      // Same attributes as QtKeychain's libsecret backend
+      KeyChainBridgeSecretAttributes itemAttributes( attributes( job ) );
+      itemAttributes.attributes.insert( "type", "plaintext" );
+      itemAttributes.attributes.insert( "xdg:schema", "org.qt.keychain" );
+      QVariantMap properties;
+      properties.insert( "org.freedesktop.Secret.Item.Label", QString( "%1/%2" ).arg( job->service(), job->key() ) );
+      properties.insert( "org.freedesktop.Secret.Item.Attributes", QVariant::fromValue( itemAttributes ) );
+      KeyChainBridgeDBusSecret secret;
+      secret.session = mSession;
+      secret.value = job->textData().toUtf8();
+      secret.contentType = "text/plain";
+      call( mCollection.path(), COLLECTION_INTERFACE, "CreateItem",
+            QList<QVariant>() << properties << QVariant::fromValue( secret ) << true,
+            SLOT( itemCreated( QDBusPendingCallWatcher* ) ), job );
+      break;
+    }
+  }
+}
+
+void KeyChainBridgeSecretServiceBackend::itemsFound( QDBusPendingCallWatcher *watcher )
+{
+  QPointer<KeyChainBridgeWalletJob> job = mCalls.take( watcher );
+  watcher->deleteLater();
+  if ( ! job || job->isDone() )
+  {
+    return;
+  }
+  if ( watcher->isError() )
+  {
+    fail( job, watcher->error() );
+    return;
+  }
+  KeyChainBridgeObjectPathList items = qdbus_cast<KeyChainBridgeObjectPathList>( watcher->reply().arguments().value( 0 ) );
+  if ( items.paths.isEmpty() )
+  {
+    finishJob( job, QKeychain::EntryNotFound, tr( "Entry not found" ) );
+    return;
+  }
+  if ( job->type() == KeyChainBridgeWalletJob::Read )
+  {
+    KeyChainBridgeObjectPathList item;
+    item.paths << items.paths.first();
+    call( SERVICE_PATH, SERVICE_INTERFACE, "GetSecrets", QList<QVariant>() << QVariant::fromValue( item ) << QVariant::fromValue( mSession ),
+          SLOT( secretsRead( QDBusPendingCallWatcher* ) ), job );
+  }
+  else
+  {
+    call( items.paths.first().path(), ITEM_INTERFACE, "Delete", QList<QVariant>(),
+          SLOT( itemDeleted( QDBusPendingCallWatcher* ) ), job );
+  }
+}
+
+void KeyChainBridgeSecretServiceBackend::secretsRead( QDBusPendingCallWatcher *watcher )
+{
+  QPointer<KeyChainBridgeWalletJob> job = mCalls.take( watcher );
+  watcher->deleteLater();
+  if ( ! job || job->isDone() )
+  {
+    return;
+  }
+  if ( watcher->isError() )
+  {
+    fail( job, watcher->error() );
+    return;
+  }
+  KeyChainBridgeSecretMap secrets = qdbus_cast<KeyChainBridgeSecretMap>( watcher->reply().arguments().value( 0 ) );
+  if ( secrets.secrets.isEmpty() )
+  {
+    finishJob( job, QKeychain::EntryNotFound, tr( "Entry not found" ) );
+    return;
+  }
+  finishJob( job, QKeychain::NoError, QString(), QString::fromUtf8( secrets.secrets.first().second.value ) );
+}
+
+void KeyChainBridgeSecretServiceBackend::itemCreated( QDBusPendingCallWatcher *watcher )
+{
+  QPointer<KeyChainBridgeWalletJob> job = mCalls.take( watcher );
+  watcher->deleteLater();
+  if ( ! job || job->isDone() )
+  {
+    return;
+  }
+  if ( watcher->isError() )
+  {
+    fail( job, watcher->error() );
+    return;
+  }
+  QString prompt = watcher->reply().arguments().value( 1 ).value<QDBusObjectPath>().path();
+  if ( ! prompt.isEmpty() && prompt != NO_PROMPT )
+  {
+    // The collection was locked again, or the service wants a confirmation
+    runItemPrompt( prompt, job );
+    return;
+  }
+  finishJob( job, QKeychain::NoError, QString() );
+}
+
+void KeyChainBridgeSecretServiceBackend::itemDeleted( QDBusPendingCallWatcher *watcher )
+{
+  QPointer<KeyChainBridgeWalletJob> job = mCalls.take( watcher );
+  watcher->deleteLater();
+  if ( ! job || job->isDone() )
+  {
+    return;
+  }
+  if ( watcher->isError() )
+  {
+    fail( job, watcher->error() );
+    return;
+  }
+  QString prompt = watcher->reply().arguments().value( 0 ).value<QDBusObjectPath>().path();
+  if ( ! prompt.isEmpty() && prompt != NO_PROMPT )
+  {
+    runItemPrompt( prompt, job );
+    return;
+  }
+  finishJob( job, QKeychain::NoError, QString() );
+}
+
+void KeyChainBridgeSecretServiceBackend::runItemPrompt( const QString &prompt, KeyChainBridgeWalletJob *job )
+{
+  mItemPrompts.append( qMakePair( prompt, QPointer<KeyChainBridgeWalletJob>( job ) ) );
+  // One dialog at a time
+  if ( mItemPrompts.size() == 1 )
+  {
+    showItemPrompt();
+  }
+}
+
+void KeyChainBridgeSecretServiceBackend::showItemPrompt()
+{
+  QString prompt( mItemPrompts.first().first );
+  mConnection.connect( SERVICE_NAME, prompt, PROMPT_INTERFACE, "Completed", this, SLOT( itemPromptCompleted( bool, QDBusVariant ) ) );
+  call( prompt, PROMPT_INTERFACE, "Prompt", QList<QVariant>() << QString(),
+        SLOT( itemPromptFailed( QDBusPendingCallWatcher* ) ) );
+}
+
+void KeyChainBridgeSecretServiceBackend::itemPromptCompleted( bool dismissed, const QDBusVariant &result )
+{
+  Q_UNUSED( result );
+  if ( mItemPrompts.isEmpty() )
+  {
+    return;
+  }
+  QPair<QString, QPointer<KeyChainBridgeWalletJob> > prompt( mItemPrompts.takeFirst() );
+  mConnection.disconnect( SERVICE_NAME, prompt.first, PROMPT_INTERFACE, "Completed", this, SLOT( itemPromptCompleted( bool, QDBusVariant ) ) );
+  if ( dismissed )
+  {
+    finishJob( prompt.second, QKeychain::AccessDeniedByUser, tr( "The wallet confirmation has been dismissed" ) );
+  }
+  else
+  {
+    finishJob( prompt.second, QKeychain::NoError, QString() );
+  }
+  if ( ! mItemPrompts.isEmpty() )
+  {
+    showItemPrompt();
+  }
+}
+
+void KeyChainBridgeSecretServiceBackend::itemPromptFailed( QDBusPendingCallWatcher *watcher )
+{
+  mCalls.remove( watcher );
+  watcher->deleteLater();
+  // Success is notified by the Completed signal
+  if ( ! watcher->isError() || mItemPrompts.isEmpty() )
+  {
+    return;
+  }
+  QPair<QString, QPointer<KeyChainBridgeWalletJob> > prompt( mItemPrompts.takeFirst() );
+  mConnection.disconnect( SERVICE_NAME, prompt.first, PROMPT_INTERFACE, "Completed", this, SLOT( itemPromptCompleted( bool, QDBusVariant ) ) );
+  finishJob( prompt.second, keychainError( watcher->error() ), watcher->error().message() );
+  if ( ! mItemPrompts.isEmpty() )
+  {
+    showItemPrompt();
+  }
+}
+
+QDBusPendingCallWatcher *KeyChainBridgeSecretServiceBackend::call( const QString &path, const QString &interface, const QString &method,
+    const QList<QVariant> &arguments, const char *member, KeyChainBridgeWalletJob *job )
+{
+  QDBusMessage message = QDBusMessage::createMethodCall( SERVICE_NAME, path, interface, method );
+  message.setArguments( arguments );
+  // Errors, including a missing bus, are always notified asynchronously
+  QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher( mConnection.asyncCall( message ), this );
+  mCalls.insert( watcher, job );
+  connect( watcher, SIGNAL( finished( QDBusPendingCallWatcher* ) ), this, member );
+  return watcher;
+}
+
+void KeyChainBridgeSecretServiceBackend::fail( KeyChainBridgeWalletJob *job, const QDBusError &error )
+{
+  // The service has been restarted or has dropped our session: open a new
+  // one, but only once per job, a service that keeps rejecting us is broken
+  if ( isStale( error ) && ! mReconnected.contains( job ) )
+  {
+    KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Secret Service handle lost ( %1 ), reconnecting." ).arg( error.name() ) );
+    mReconnected.append( job );
+    mWaiting.append( job );
+    connectService();
+    return;
+  }
+  finishJob( job, keychainError( error ), error.message() );
+}
+
+KeyChainBridgeSecretAttributes KeyChainBridgeSecretServiceBackend::attributes( KeyChainBridgeWalletJob *job )
+{
+  KeyChainBridgeSecretAttributes result;
+  result.attributes.insert( "user", job->key() );
+  result.attributes.insert( "server", job->service() );
+  return result;
+}
+
+QKeychain::Error KeyChainBridgeSecretServiceBackend::keychainError( const QDBusError &error )
+{
+  QString name( error.name() );
+  if ( name == "org.freedesktop.Secret.Error.IsLocked" || name == "org.freedesktop.DBus.Error.AccessDenied" )
+  {
+    return QKeychain::AccessDenied;
+  }
+  if ( name == "org.freedesktop.Secret.Error.NoSuchObject" )
+  {
+    return QKeychain::EntryNotFound;
+  }
+  if ( name == "org.freedesktop.DBus.Error.ServiceUnknown" || name == "org.freedesktop.DBus.Error.NameHasNoOwner"
+       || name == "org.freedesktop.DBus.Error.Disconnected" )
+  {
+    return QKeychain::NoBackendAvailable;
+  }
+  return QKeychain::OtherError;
+}
+
+bool KeyChainBridgeSecretServiceBackend::isStale( const QDBusError &error )
+{
+  QString name( error.name() );
+  return name == "org.freedesktop.Secret.Error.NoSession"
+         || name == "org.freedesktop.Secret.Error.NoSuchObject"
+         || name == "org.freedesktop.DBus.Error.UnknownObject"
+         || name == "org.freedesktop.DBus.Error.UnknownMethod"
+         || name == "org.freedesktop.DBus.Error.ServiceUnknown";
+}
@@ -0,0 +1,205 @@
+/***************************************************************************
+    keychainbridgesecretservice.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeSecretService_H
+#define KeyChainBridgeSecretService_H
+
+//QT4 includes
+#include <QDBusArgument>
+#include <QDBusConnection>
+#include <QDBusError>
+#include <QDBusObjectPath>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMetaType>
+#include <QPair>
+#include <QPointer>
+#include <QStringList>
+
+#include "keychainbridgebackend.h"
+
+//forward declarations
+class QDBusPendingCallWatcher;
+class QDBusServiceWatcher;
+class QDBusVariant;
+
+
+//! A secret as transferred by the Secret Service API: (oayays)
+struct KeyChainBridgeDBusSecret
+{
+  QDBusObjectPath session;
+  QByteArray parameters;
+  QByteArray value;
+  QString contentType;
+};
+
+//! A list of object paths: ao
+struct KeyChainBridgeObjectPathList
+{
+  QList<QDBusObjectPath> paths;
+};
+
+//! Lookup attributes of an item: a{ss}
+struct KeyChainBridgeSecretAttributes
+{
+  QMap<QString, QString> attributes;
+};
+
+//! Secrets by item: a{o(oayays)}
+struct KeyChainBridgeSecretMap
+{
+  QList< QPair<QDBusObjectPath, KeyChainBridgeDBusSecret> > secrets;
+};
+
+Q_DECLARE_METATYPE( KeyChainBridgeDBusSecret )
+Q_DECLARE_METATYPE( KeyChainBridgeObjectPathList )
+Q_DECLARE_METATYPE( KeyChainBridgeSecretAttributes )
+Q_DECLARE_METATYPE( KeyChainBridgeSecretMap )
+
+QDBusArgument &operator<<( QDBusArgument &argument, const KeyChainBridgeDBusSecret &secret );
+const QDBusArgument &operator>>( const QDBusArgument &argument, KeyChainBridgeDBusSecret &secret );
+QDBusArgument &operator<<( QDBusArgument &argument, const KeyChainBridgeObjectPathList &list );
+const QDBusArgument &operator>>( const QDBusArgument &argument, KeyChainBridgeObjectPathList &list );
+QDBusArgument &operator<<( QDBusArgument &argument, const KeyChainBridgeSecretAttributes &attributes );
+const QDBusArgument &operator>>( const QDBusArgument &argument, KeyChainBridgeSecretAttributes &attributes );
+QDBusArgument &operator<<( QDBusArgument &argument, const KeyChainBridgeSecretMap &map );
+const QDBusArgument &operator>>( const QDBusArgument &argument, KeyChainBridgeSecretMap &map );
+
+
+/**
+* \class KeyChainBridgeSecretServiceBackend
+* \brief The freedesktop.org Secret Service, spoken directly over D-Bus
+* QtKeychain opens a new session, looks up the collection and unlocks it
+* for every single job. This backend does the handshake once and keeps the
+* session and the collection handle until the service goes away or rejects
+* them: then it reconnects, once per job, transparently.
+* Entries are stored with the attributes used by QtKeychain (schema
+* "org.qt.keychain"), so that the two backends can be swapped freely.
+*/
+class KeyChainBridgeSecretServiceBackend : public KeyChainBridgeBackend
+{
+    Q_OBJECT
+  public:
+
+    //! Well known name of the Secret Service
+    static const char *SERVICE_NAME;
+
+    //! Talk to the Secret Service on \a connection, the session bus by default
+    explicit KeyChainBridgeSecretServiceBackend( const QDBusConnection &connection = QDBusConnection::sessionBus(), QObject *parent = nullptr );
+    //! Destructor, closes the session
+    ~KeyChainBridgeSecretServiceBackend();
+
+    QString name() const override { return QString( "secretservice" ); }
+
+    void start( KeyChainBridgeWalletJob *job ) override;
+
+    //! Whether the session and the collection handle are open
+    bool isConnected() const;
+
+    //! Number of sessions opened so far, reconnections included
+    int sessionCount() const { return mSessionCount; }
+
+    //! Close the session and forget the handles, the next job reconnects
+    void disconnectService();
+
+    //! Register the D-Bus types of the Secret Service API, idempotent
+    static void registerTypes();
+
+  private slots:
+
+    void sessionOpened( QDBusPendingCallWatcher *watcher );
+    void collectionFound( QDBusPendingCallWatcher *watcher );
+    void collectionUnlocked( QDBusPendingCallWatcher *watcher );
+    void promptCompleted( bool dismissed, const QDBusVariant &result );
+    void promptFailed( QDBusPendingCallWatcher *watcher );
+
+    void itemsFound( QDBusPendingCallWatcher *watcher );
+    void secretsRead( QDBusPendingCallWatcher *watcher );
+    void itemCreated( QDBusPendingCallWatcher *watcher );
+    void itemDeleted( QDBusPendingCallWatcher *watcher );
+    void itemPromptCompleted( bool dismissed, const QDBusVariant &result );
+    void itemPromptFailed( QDBusPendingCallWatcher *watcher );
+
+    //! The service has left the bus: the handles are gone with it
+    void serviceUnregistered();
+
+  private:
+
+    //! Open the session, find and unlock the default collection
+    void connectService();
+
+    //! The handshake is complete: run the waiting jobs
+    void serviceConnected();
+
+    //! The handshake failed: fail the waiting jobs
+    void connectionFailed( QKeychain::Error error, const QString &errorString );
+
+    //! Send the first call of \a job, the service must be connected
+    void run( KeyChainBridgeWalletJob *job );
+
+    //! Show \a prompt, returned for \a job, when the previous ones are done
+    void runItemPrompt( const QString &prompt, KeyChainBridgeWalletJob *job );
+
+    //! Show the first queued item prompt
+    void showItemPrompt();
+
+    //! Asynchronous call of \a method, \a member is invoked with the watcher
+    QDBusPendingCallWatcher *call( const QString &path, const QString &interface, const QString &method,
+                                   const QList<QVariant> &arguments, const char *member, KeyChainBridgeWalletJob *job = nullptr );
+
+    //! Complete \a job with the D-Bus \a error, or reconnect if it was
+    //! caused by a stale session or collection handle
+    void fail( KeyChainBridgeWalletJob *job, const QDBusError &error );
+
+    //! Lookup attributes of \a job's entry
+    static KeyChainBridgeSecretAttributes attributes( KeyChainBridgeWalletJob *job );
+
+    //! Map a D-Bus error to the closest QtKeychain one
+    static QKeychain::Error keychainError( const QDBusError &error );
+
+    //! Whether \a error means that our handles are no longer valid
+    static bool isStale( const QDBusError &error );
+
+    QDBusConnection mConnection;
+
+    QDBusServiceWatcher *mServiceWatcher;
+
+    QDBusObjectPath mSession;
+
+    QDBusObjectPath mCollection;
+
+    //! The handshake is in progress
+    bool mConnecting;
+
+    int mSessionCount;
+
+    //! Jobs waiting for the handshake
+    QList< QPointer<KeyChainBridgeWalletJob> > mWaiting;
+
+    //! Jobs that have already reconnected once
+    QList< QPointer<KeyChainBridgeWalletJob> > mReconnected;
+
+    //! Jobs of the calls in flight, a null job for the handshake calls
+    QHash<QDBusPendingCallWatcher*, QPointer<KeyChainBridgeWalletJob> > mCalls;
+
+    //! Pending unlock prompt, if any
+    QString mPrompt;
+
+    //! Prompts of item writes and deletes, the first one is being shown
+    QList< QPair<QString, QPointer<KeyChainBridgeWalletJob> > > mItemPrompts;
+};
+
+#endif //KeyChainBridgeSecretService_H
@@ -0,0 +1,212 @@
+/***************************************************************************
+  keychainbridgesettings.cpp
+
+  In-memory snapshot of the plugin settings
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgesettings.h"
+#include "keychainbridgelog.h"
+
+#include <QList>
+#include <QPair>
+#include <QRunnable>
+#include <QSettings>
+
+// Quiet period before the changes are written, in milliseconds
+const int SETTINGS_WRITE_DELAY = 1000;
+
+typedef QList< QPair<QString, QVariant> > KeyChainBridgeSettingsValues;
+
+/**
+ * Writes a batch of settings, in the writer thread
+ */
+class KeyChainBridgeSettingsWriter : public QRunnable
+{
+  public:
+
+    explicit KeyChainBridgeSettingsWriter( const KeyChainBridgeSettingsValues &values )
+        : mValues( values )
+    {}
+
+    void run() override
+    {
+      QSettings settings;
+      for ( int i = 0; i < mValues.size(); ++i )
+      {
+        settings.setValue( mValues.at( i ).first, mValues.at( i ).second );
+      }
+    }
+
+  private:
+
+    KeyChainBridgeSettingsValues mValues;
+};
+
+
+KeyChainBridgeSettings::KeyChainBridgeSettings( const QString &group, QObject *parent ):
+    QObject( parent )
+{
+  QSettings settings;
+  for ( int i = 0; i < KeyCount; ++i )
+  {
+    Key key = static_cast<Key>( i );
+    mKeys[i] = QString( "%1/%2" ).arg( group, keyName( key ) );
+    mValues[i] = settings.value( mKeys[i], defaultValue( key ) );
+    mChanged[i] = false;
+  }
+  mWriterPool.setMaxThreadCount( 1 );
+  mWriteTimer.setSingleShot( true );
+  mWriteTimer.setInterval( SETTINGS_WRITE_DELAY );
+  connect( &mWriteTimer, SIGNAL( timeout() ), this, SLOT( writePending() ) );
+}
+
+KeyChainBridgeSettings::~KeyChainBridgeSettings()
+{
+  sync();
+}
+
+void KeyChainBridgeSettings::setValue( Key key, const QVariant &value )
+{
+  if ( mValues[key] == value )
+  {
+    return;
+  }
+  mValues[key] = value;
+  mChanged[key] = true;
+  // Restart the quiet period
+  mWriteTimer.start();
+}
+
+bool KeyChainBridgeSettings::hasPendingChanges() const
+{
+  for ( int i = 0; i < KeyCount; ++i )
+  {
+    if ( mChanged[i] )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void KeyChainBridgeSettings::sync()
+{
+  mWriteTimer.stop();
+  writePending();
+  mWriterPool.waitForDone();
+}
+
+void KeyChainBridgeSettings::writePending()
+{
+  KeyChainBridgeSettingsValues values;
+  for ( int i = 0; i < KeyCount; ++i )
+  {
+    if ( mChanged[i] )
+    {
+      values << qMakePair( mKeys[i], mValues[i] );
+      mChanged[i] = false;
+    }
+  }
+  if ( values.isEmpty() )
+  {
+    return;
+  }
+  KEYCHAINBRIDGE_DEBUG( Plugin, QString( "Writing %1 settings" ).arg( values.size() ) );
+  mWriterPool.start( new KeyChainBridgeSettingsWriter( values ) );
+}
+
+QVariant KeyChainBridgeSettings::defaultValue( Key key )
+{
+  switch ( key )
+  {
+    case UseWallet:
+      return true;
+    case LoggingEnabled:
+      return false;
+    case PrefetchEnabled:
+      return true;
+    case Backend:
+      return QString( "qtkeychain" );
+    case LogLevel:
+      return static_cast<int>( KeyChainBridgeLog::Debug );
+    case LogCategories:
+      return static_cast<int>( KeyChainBridgeLog::AllCategories );
+    case ReadAheadEnabled:
+      return true;
+    case WalletRetries:
+      return 2;
+    case WalletRetryInterval:
+      return 60000;
+    case WalletTimeout:
+      return 10000;
+    case SecretCache:
+      return QString( "off" );
+    case SecretCacheDelay:
+      return 0;
+    case DialogFreeUnlock:
+      return false;
+    case DeferredInit:
+      return false;
+    case MasterPasswordTtl:
+      return 3600000;
+    case MasterPasswordIdleTimeout:
+      return 900000;
+    case DialogFreeUnlockTimeout:
+      return 1000;
+    default:
+      return QVariant();
+  }
+}
+
+QString KeyChainBridgeSettings::keyName( Key key )
+{
+  switch ( key )
+  {
+    case UseWallet:
+      return QString( "useWallet" );
+    case LoggingEnabled:
+      return QString( "loggingEnabled" );
+    case PrefetchEnabled:
+      return QString( "prefetchEnabled" );
+    case Backend:
+      return QString( "backend" );
+    case LogLevel:
+      return QString( "logLevel" );
+    case LogCategories:
+      return QString( "logCategories" );
+    case ReadAheadEnabled:
+      return QString( "readAheadEnabled" );
+    case WalletRetries:
+      return QString( "walletRetries" );
+    case WalletRetryInterval:
+      return QString( "walletRetryInterval" );
+    case WalletTimeout:
+      return QString( "walletTimeout" );
+    case SecretCache:
+      return QString( "secretCache" );
+    case SecretCacheDelay:
+      return QString( "secretCacheDelay" );
+    case DialogFreeUnlock:
+      return QString( "dialogFreeUnlock" );
+    case DeferredInit:
+      return QString( "deferredInit" );
+    case MasterPasswordTtl:
+      return QString( "masterPasswordTtl" );
+    case MasterPasswordIdleTimeout:
+      return QString( "masterPasswordIdleTimeout" );
+    case DialogFreeUnlockTimeout:
+      return QString( "dialogFreeUnlockTimeout" );
+    default:
+      return QString();
+  }
+}
@@ -0,0 +1,138 @@
+/***************************************************************************
+    keychainbridgesettings.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeSettings_H
+#define KeyChainBridgeSettings_H
+
+//QT4 includes
+#include <QObject>
+#include <QString>
+#include <QThreadPool>
+#include <QTimer>
+#include <QVariant>
+
+
+/**
+* \class KeyChainBridgeSettings
+* \brief In-memory snapshot of the plugin settings
+* All the settings are read once, when the object is created, with the
+* keys built once. Changes are kept in memory and written back in
+* background after a short quiet period, so that a burst of changes costs
+* a single write; whatever is still pending is written synchronously when
+* the object is destroyed.
+*/
+class KeyChainBridgeSettings : public QObject
+{
+    Q_OBJECT
+  public:
+
+    //! Settings entries
+    enum Key
+    {
+      UseWallet,            //!< Use the wallet at all
+      LoggingEnabled,       //!< Log to the QGIS message log
+      PrefetchEnabled,      //!< Read the wallet at plugin load
+      Backend,              //!< Storage backend name (not in the GUI)
+      LogLevel,             //!< Logging level when enabled (not in the GUI)
+      LogCategories,        //!< Logging categories mask (not in the GUI)
+      ReadAheadEnabled,     //!< Project load credentials read-ahead (not in the GUI)
+      WalletRetries,        //!< Retries of a failed wallet operation (not in the GUI)
+      WalletRetryInterval,  //!< Pause after repeated wallet failures, in ms (not in the GUI)
+      WalletTimeout,        //!< Deadline of the wallet operations, in ms (not in the GUI)
+      SecretCache,          //!< Encrypted secret cache: "off", "primary" or "fallback" (not in the GUI)
+      SecretCacheDelay,     //!< Wallet delay before the cache answers a read, in ms, 0 to wait (not in the GUI)
+      DialogFreeUnlock,     //!< Wait for the wallet in a nested event loop before the credentials dialog is shown (not in the GUI)
+      DeferredInit,         //!< Start the wallet on the first credentials request (not in the GUI)
+      MasterPasswordTtl,    //!< Time the master password is kept in memory, in ms, 0 for ever (not in the GUI)
+      MasterPasswordIdleTimeout, //!< Time the master password is kept in memory unused, in ms, 0 for ever (not in the GUI)
+      DialogFreeUnlockTimeout, //!< Wallet wait before the credentials dialog is shown anyway, in ms (not in the GUI)
+      KeyCount
+    };
+
+    //! Read all the settings under \a group
+    explicit KeyChainBridgeSettings( const QString &group, QObject *parent = nullptr );
+    //! Destructor, writes the pending changes
+    ~KeyChainBridgeSettings();
+
+    //! Value of \a key
+    QVariant value( Key key ) const { return mValues[key]; }
+
+    //! Change \a key, the change is persisted later, in background
+    void setValue( Key key, const QVariant &value );
+
+    //! Full settings key of \a key
+    QString settingsKey( Key key ) const { return mKeys[key]; }
+
+    bool useWallet() const { return mValues[UseWallet].toBool(); }
+    void setUseWallet( bool useWallet ) { setValue( UseWallet, useWallet ); }
+
+    bool loggingEnabled() const { return mValues[LoggingEnabled].toBool(); }
+    void setLoggingEnabled( bool loggingEnabled ) { setValue( LoggingEnabled, loggingEnabled ); }
+
+    bool prefetchEnabled() const { return mValues[PrefetchEnabled].toBool(); }
+    void setPrefetchEnabled( bool prefetchEnabled ) { setValue( PrefetchEnabled, prefetchEnabled ); }
+
+    QString backend() const { return mValues[Backend].toString(); }
+
+    int logLevel() const { return mValues[LogLevel].toInt(); }
+
+    int logCategories() const { return mValues[LogCategories].toInt(); }
+
+    bool readAheadEnabled() const { return mValues[ReadAheadEnabled].toBool(); }
+
+    QString secretCache() const { return mValues[SecretCache].toString(); }
+
+    bool dialogFreeUnlock() const { return mValues[DialogFreeUnlock].toBool(); }
+
+    bool deferredInit() const { return mValues[DeferredInit].toBool(); }
+
+    //! Quiet period before the changes are written, in milliseconds
+    int writeDelay() const { return mWriteTimer.interval(); }
+
+    //! Set the quiet period before the changes are written, in milliseconds
+    void setWriteDelay( int msecs ) { mWriteTimer.setInterval( msecs ); }
+
+    //! Whether there are changes not yet handed to the writer
+    bool hasPendingChanges() const;
+
+    //! Write the pending changes and wait for all the writes to complete
+    void sync();
+
+  private slots:
+
+    //! Hand the pending changes to the background writer
+    void writePending();
+
+  private:
+
+    //! Default value of \a key
+    static QVariant defaultValue( Key key );
+
+    //! Settings name of \a key, relative to the group
+    static QString keyName( Key key );
+
+    QString mKeys[KeyCount];
+
+    QVariant mValues[KeyCount];
+
+    bool mChanged[KeyCount];
+
+    QTimer mWriteTimer;
+
+    //! A single thread: writes are executed in order
+    QThreadPool mWriterPool;
+};
+
+#endif //KeyChainBridgeSettings_H
@@ -0,0 +1,51 @@
+/***************************************************************************
+    keychainbridgetestplugin.h
+    -------------------
+    Test harness access to the plugin internals
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeTestPlugin_H
+#define KeyChainBridgeTestPlugin_H
+
+#include "keychainbridge.h"
+
+
+/**
+* \class KeyChainBridgeTestPlugin
+* \brief The plugin, as driven by the benchmarks and the soak test
+* Exposes the protected steps of the plugin, so that a harness can run them
+* without the QGIS GUI. Only for the tests: it is not part of the plugin.
+*/
+class KeyChainBridgeTestPlugin : public KeyChainBridge
+{
+  public:
+
+    //! Headless plugin, see KeyChainBridge::KeyChainBridge()
+    explicit KeyChainBridgeTestPlugin( QgisInterface *theInterface = nullptr ) : KeyChainBridge( theInterface ) {}
+
+    using KeyChainBridge::initialize;
+    using KeyChainBridge::askSaveMasterPassword;
+    using KeyChainBridge::deleteMasterPassword;
+    using KeyChainBridge::setIsDirty;
+    using KeyChainBridge::isDirty;
+    using KeyChainBridge::setMasterPassword;
+    using KeyChainBridge::saveMasterPassword;
+    using KeyChainBridge::wallet;
+    using KeyChainBridge::credentials;
+    using KeyChainBridge::notifier;
+    using KeyChainBridge::settings;
+    using KeyChainBridge::failedInit;
+    using KeyChainBridge::isInitialized;
+};
+
+#endif //KeyChainBridgeTestPlugin_H
@@ -0,0 +1,205 @@
+/***************************************************************************
+  keychainbridgetrace.cpp
+
+  Structured event trace
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgetrace.h"
+#include "keychainbridgewallet.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QFile>
+#include <QMutexLocker>
+
+#include "qgsapplication.h"
+
+
+KeyChainBridgeTrace::KeyChainBridgeTrace():
+    mRing( DEFAULT_CAPACITY ),
+    mSequence( 0 ),
+    mFirst( 1 ),
+    mFlushed( 0 )
+{
+  mClock.start();
+}
+
+KeyChainBridgeTrace *KeyChainBridgeTrace::instance()
+{
+  static KeyChainBridgeTrace sInstance;
+  return &sInstance;
+}
+
+void KeyChainBridgeTrace::record( Event event, int code, qint64 usecs, int operation )
+{
+  Q_ASSERT( event < EventCount );
+  qint64 time = QDateTime::currentMSecsSinceEpoch();
+  QMutexLocker locker( &mMutex );
+  ++mSequence;
+  Record &record = mRing[mSequence % mRing.size()];
+  record.sequence = mSequence;
+  record.time = time;
+  record.elapsed = mClock.nsecsElapsed() / 1000;
+  record.event = event;
+  record.operation = operation;
+  record.code = code;
+  record.usecs = usecs;
+}
+
+qint64 KeyChainBridgeTrace::oldest() const
+{
+  return qMax( mFirst, mSequence - mRing.size() + 1 );
+}
+
+QList<KeyChainBridgeTrace::Record> KeyChainBridgeTrace::records() const
+{
+  QMutexLocker locker( &mMutex );
+  QList<Record> result;
+  for ( qint64 sequence = oldest(); sequence <= mSequence; ++sequence )
+  {
+    result.append( mRing.at( sequence % mRing.size() ) );
+  }
+  return result;
+}
+
+int KeyChainBridgeTrace::size() const
+{
+  QMutexLocker locker( &mMutex );
+  return static_cast<int>( mSequence - oldest() + 1 );
+}
+
+int KeyChainBridgeTrace::capacity() const
+{
+  QMutexLocker locker( &mMutex );
+  return mRing.size();
+}
+
+void KeyChainBridgeTrace::setCapacity( int capacity )
+{
+  Q_ASSERT( capacity > 0 );
+  QMutexLocker locker( &mMutex );
+  mRing = QVector<Record>( capacity );
+  mFirst = mSequence + 1;
+}
+
+void KeyChainBridgeTrace::clear()
+{
+  QMutexLocker locker( &mMutex );
+  mFirst = mSequence + 1;
+}
+
+bool KeyChainBridgeTrace::flush( const QString &fileName )
+{
+  QString path( fileName.isEmpty() ? defaultFileName() : fileName );
+  QByteArray lines;
+  qint64 last;
+  {
+    QMutexLocker locker( &mMutex );
+    last = mSequence;
+    // Events dropped from the ring leave a gap in the sequence
+    for ( qint64 sequence = qMax( oldest(), mFlushed + 1 ); sequence <= last; ++sequence )
+    {
+      lines += toJson( mRing.at( sequence % mRing.size() ) ).toUtf8();
+      lines += '\n';
+    }
+  }
+  if ( lines.isEmpty() )
+  {
+    return true;
+  }
+
+  QFile file( path );
+  if ( file.size() > MAX_FILE_SIZE )
+  {
+    QFile::remove( path + ".1" );
+    QFile::rename( path, path + ".1" );
+  }
+  if ( ! file.open( QIODevice::WriteOnly | QIODevice::Append ) || file.write( lines ) != lines.size() )
+  {
+    return false;
+  }
+  file.close();
+
+  QMutexLocker locker( &mMutex );
+  mFlushed = qMax( mFlushed, last );
+  return true;
+}
+
+QString KeyChainBridgeTrace::defaultFileName()
+{
+  return QgsApplication::qgisSettingsDirPath() + "keychainbridge-trace.jsonl";
+}
+
+QString KeyChainBridgeTrace::toJson( const Record &record )
+{
+  QString json( QString( "{\"seq\":%1,\"pid\":%2,\"time\":\"%3\",\"t_us\":%4,\"event\":\"%5\"" )
+                .arg( record.sequence )
+                .arg( QCoreApplication::applicationPid() )
+                .arg( QDateTime::fromMSecsSinceEpoch( record.time ).toUTC().toString( "yyyy-MM-ddThh:mm:ss.zzzZ" ) )
+                .arg( record.elapsed )
+                .arg( eventName( record.event ) ) );
+  switch ( record.operation )
+  {
+    case KeyChainBridgeWalletJob::Read:
+      json += ",\"op\":\"read\"";
+      break;
+    case KeyChainBridgeWalletJob::Write:
+      json += ",\"op\":\"write\"";
+      break;
+    case KeyChainBridgeWalletJob::Delete:
+      json += ",\"op\":\"delete\"";
+      break;
+    default:
+      break;
+  }
+  json += QString( ",\"code\":%1" ).arg( record.code );
+  if ( record.usecs >= 0 )
+  {
+    json += QString( ",\"us\":%1" ).arg( record.usecs );
+  }
+  json += '}';
+  return json;
+}
+
+QString KeyChainBridgeTrace::eventName( Event event )
+{
+  switch ( event )
+  {
+    case Initialized:
+      return QString( "initialized" );
+    case DialogShown:
+      return QString( "dialog_shown" );
+    case MasterPasswordServed:
+      return QString( "master_password_served" );
+    case MasterPasswordMissing:
+      return QString( "master_password_missing" );
+    case MasterPasswordExpired:
+      return QString( "master_password_expired" );
+    case WalletStarted:
+      return QString( "wallet_started" );
+    case WalletFinished:
+      return QString( "wallet_finished" );
+    case WalletCancelled:
+      return QString( "wallet_cancelled" );
+    case WalletTimedOut:
+      return QString( "wallet_timed_out" );
+    case Verified:
+      return QString( "verified" );
+    case DirtyChanged:
+      return QString( "dirty_changed" );
+    case Error:
+      return QString( "error" );
+    default:
+      return QString( "unknown" );
+  }
+}
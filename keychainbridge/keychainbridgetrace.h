@@ -0,0 +1,148 @@
+/***************************************************************************
+    keychainbridgetrace.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeTrace_H
+#define KeyChainBridgeTrace_H
+
+//QT4 includes
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+
+/**
+* \class KeyChainBridgeTrace
+* \brief Always-on structured event trace
+* The latest capacity() events are kept in memory, in a ring buffer, and
+* appended to a JSON-lines file by flush(): one object per line, with the
+* wall clock and monotonic timestamps, the event, the wallet operation,
+* an integer code and a duration. Events carry no text at all, so that no
+* secret, nor any path or entry name, can end up in the trace.
+* Recording is a mutex-protected copy of a few integers, safe from any
+* thread.
+*/
+class KeyChainBridgeTrace
+{
+  public:
+
+    //! Traced events, the meaning of code and usecs depends on the event
+    enum Event
+    {
+      Initialized,            //!< usecs: initialization time
+      DialogShown,            //!< The credentials dialog asks for the master password
+      MasterPasswordServed,   //!< A master password request answered from memory
+      MasterPasswordMissing,  //!< A master password request not answered from memory
+      MasterPasswordExpired,  //!< The master password in memory has been wiped, after its time to live or idle timeout
+      WalletStarted,          //!< operation sent to the backend
+      WalletFinished,         //!< code: QKeychain::Error, usecs: time in the backend
+      WalletCancelled,        //!< usecs: time in the backend
+      WalletTimedOut,         //!< usecs: time in the backend
+      Verified,               //!< code: 1 if the master password was verified
+      DirtyChanged,           //!< code: the new value of the dirty flag
+      Error,                  //!< code: QKeychain::Error shown to the user
+      EventCount
+    };
+
+    //! A traced event
+    struct Record
+    {
+      Record() : sequence( 0 ), time( 0 ), elapsed( 0 ), event( Initialized ), operation( -1 ), code( 0 ), usecs( -1 ) {}
+
+      //! Position in the trace, from 1
+      qint64 sequence;
+
+      //! Milliseconds since the epoch
+      qint64 time;
+
+      //! Microseconds since the trace was created
+      qint64 elapsed;
+
+      Event event;
+
+      //! KeyChainBridgeWalletJob::Type, -1 if not a wallet event
+      int operation;
+
+      int code;
+
+      //! Duration in microseconds, -1 if none
+      qint64 usecs;
+    };
+
+    //! Default number of events kept in memory
+    static const int DEFAULT_CAPACITY = 2048;
+
+    //! Trace files are rotated when they grow beyond this size, in bytes
+    static const qint64 MAX_FILE_SIZE = 4 * 1024 * 1024;
+
+    //! The process wide instance
+    static KeyChainBridgeTrace *instance();
+
+    //! Record \a event
+    void record( Event event, int code = 0, qint64 usecs = -1, int operation = -1 );
+
+    //! The events in memory, oldest first
+    QList<Record> records() const;
+
+    //! Number of events in memory
+    int size() const;
+
+    //! Maximum number of events in memory
+    int capacity() const;
+
+    //! Change the number of events in memory, the trace is cleared
+    void setCapacity( int capacity );
+
+    //! Forget the events in memory, the sequence goes on
+    void clear();
+
+    //! Append the events not yet written to \a fileName, or to
+    //! defaultFileName() if empty. Returns false on error
+    bool flush( const QString &fileName = QString() );
+
+    //! Trace file in the QGIS settings directory
+    static QString defaultFileName();
+
+    //! JSON object of \a record, on a single line
+    static QString toJson( const Record &record );
+
+    //! Name of \a event in the JSON objects
+    static QString eventName( Event event );
+
+  private:
+
+    KeyChainBridgeTrace();
+
+    //! Sequence of the oldest event in memory, call with the mutex locked
+    qint64 oldest() const;
+
+    mutable QMutex mMutex;
+
+    QVector<Record> mRing;
+
+    //! Sequence of the latest event
+    qint64 mSequence;
+
+    //! Sequence of the first event after the latest clear()
+    qint64 mFirst;
+
+    //! Sequence of the latest event written by flush()
+    qint64 mFlushed;
+
+    QElapsedTimer mClock;
+};
+
+#endif //KeyChainBridgeTrace_H
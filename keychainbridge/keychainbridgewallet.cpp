@@ -0,0 +1,403 @@
+/***************************************************************************
+  keychainbridgewallet.cpp
+
+  Asynchronous wallet job engine
+
+  -------------------
+
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "keychainbridgewallet.h"
+#include "keychainbridgebackend.h"
+#include "keychainbridgelog.h"
+#include "keychainbridgemetrics.h"
+#include "keychainbridgesecret.h"
+#include "keychainbridgetrace.h"
+
+#include <QMetaObject>
+#include <QTimer>
+
+// Default deadline of the operations, in milliseconds: a hung keyring daemon
+// must not stall the queue
+const int DEFAULT_WALLET_TIMEOUT = 10000;
+
+
+KeyChainBridgeWalletJob::KeyChainBridgeWalletJob( Type type, const QString &service, const QString &key, QObject *parent ):
+    QObject( parent ),
+    mType( type ),
+    mState( Pending ),
+    mService( service ),
+    mKey( key ),
+    mError( QKeychain::NoError ),
+    mElapsed( 0 ),
+    mRetries( 0 ),
+    mTimeout( -1 ),
+    mTimedOut( false ),
+    mCoalesced( false )
+{
+}
+
+KeyChainBridgeWalletJob::~KeyChainBridgeWalletJob()
+{
+  // The entry text holds the secrets
+  KeyChainBridgeSecret::wipe( mTextData );
+}
+
+void KeyChainBridgeWalletJob::start()
+{
+  Q_ASSERT( mState == Pending );
+  mState = Running;
+  mTimer.start();
+}
+
+void KeyChainBridgeWalletJob::cancel()
+{
+  if ( isDone() )
+  {
+    return;
+  }
+  mElapsed = elapsed();
+  mState = Cancelled;
+  emit finished( this );
+}
+
+qint64 KeyChainBridgeWalletJob::elapsed() const
+{
+  if ( isDone() || ! mTimer.isValid() )
+  {
+    return mElapsed;
+  }
+  return mTimer.nsecsElapsed() / 1000;
+}
+
+void KeyChainBridgeWalletJob::complete( QKeychain::Error error, const QString &errorString, const QString &textData )
+{
+  // Cancelled in the meantime
+  if ( mState != Running )
+  {
+    return;
+  }
+  // The wallet may try again, receivers only see the final outcome
+  KeyChainBridgeWallet *wallet = qobject_cast<KeyChainBridgeWallet*>( parent() );
+  if ( wallet && wallet->retry( this, error ) )
+  {
+    return;
+  }
+  finish( error, errorString, textData );
+}
+
+void KeyChainBridgeWalletJob::expire( const QString &errorString )
+{
+  if ( mState != Running )
+  {
+    return;
+  }
+  mTimedOut = true;
+  finish( QKeychain::OtherError, errorString, QString() );
+}
+
+void KeyChainBridgeWalletJob::finish( QKeychain::Error error, const QString &errorString, const QString &textData )
+{
+  mElapsed = elapsed();
+  mError = error;
+  mErrorString = errorString;
+  if ( mType == Read && mError == QKeychain::NoError )
+  {
+    mTextData = textData;
+  }
+  mState = Finished;
+  emit finished( this );
+}
+
+
+KeyChainBridgeWallet::KeyChainBridgeWallet( const QString &service, KeyChainBridgeBackend *backend, QObject *parent ):
+    QObject( parent ),
+    mService( service ),
+    mBackend( nullptr ),
+    mCurrent( nullptr ),
+    mTimeout( DEFAULT_WALLET_TIMEOUT )
+{
+  setBackend( backend ? backend : new KeyChainBridgeQtKeychainBackend() );
+  mDeadlineTimer.setSingleShot( true );
+  connect( &mDeadlineTimer, SIGNAL( timeout() ), this, SLOT( deadlineExpired() ) );
+}
+
+KeyChainBridgeWallet::~KeyChainBridgeWallet()
+{
+  // Receivers may be half destroyed at this point: no notifications
+  if ( mCurrent )
+  {
+    mCurrent->blockSignals( true );
+    delete mCurrent;
+  }
+  qDeleteAll( mQueue );
+}
+
+KeyChainBridgeWalletJob *KeyChainBridgeWallet::readPassword( const QString &key, QObject *receiver, const char *member )
+{
+  KeyChainBridgeWalletJob *job = new KeyChainBridgeWalletJob( KeyChainBridgeWalletJob::Read, mService, key, this );
+  KeyChainBridgeWalletJob *leader = readInProgress( key );
+  if ( leader )
+  {
+    return join( leader, job, receiver, member );
+  }
+  return enqueue( job, receiver, member );
+}
+
+KeyChainBridgeWalletJob *KeyChainBridgeWallet::writePassword( const QString &key, const QString &password, QObject *receiver, const char *member )
+{
+  KeyChainBridgeWalletJob *job = new KeyChainBridgeWalletJob( KeyChainBridgeWalletJob::Write, mService, key, this );
+  job->setTextData( password );
+  return enqueue( job, receiver, member );
+}
+
+KeyChainBridgeWalletJob *KeyChainBridgeWallet::deletePassword( const QString &key, QObject *receiver, const char *member )
+{
+  return enqueue( new KeyChainBridgeWalletJob( KeyChainBridgeWalletJob::Delete, mService, key, this ), receiver, member );
+}
+
+KeyChainBridgeWalletJob *KeyChainBridgeWallet::enqueue( KeyChainBridgeWalletJob *job, QObject *receiver, const char *member )
+{
+  // Our bookkeeping must run before the receiver's slot, that may well
+  // schedule another job
+  connect( job, SIGNAL( finished( KeyChainBridgeWalletJob* ) ), this, SLOT( jobFinished( KeyChainBridgeWalletJob* ) ) );
+  if ( receiver && member )
+  {
+    connect( job, SIGNAL( finished( KeyChainBridgeWalletJob* ) ), receiver, member );
+  }
+  mQueue.enqueue( job );
+  // Never start synchronously: the caller must get the job before any notification
+  QMetaObject::invokeMethod( this, "startNext", Qt::QueuedConnection );
+  return job;
+}
+
+KeyChainBridgeWalletJob *KeyChainBridgeWallet::readInProgress( const QString &key ) const
+{
+  // The latest operation on the entry decides: a read cannot see through a
+  // write or a deletion queued after the earlier read
+  for ( int i = mQueue.size() - 1; i >= 0; --i )
+  {
+    KeyChainBridgeWalletJob *job = mQueue.at( i );
+    if ( job->key() == key )
+    {
+      return job->type() == KeyChainBridgeWalletJob::Read ? job : nullptr;
+    }
+  }
+  if ( mCurrent && ! mCurrent->isDone() && mCurrent->type() == KeyChainBridgeWalletJob::Read && mCurrent->key() == key )
+  {
+    return mCurrent;
+  }
+  return nullptr;
+}
+
+KeyChainBridgeWalletJob *KeyChainBridgeWallet::join( KeyChainBridgeWalletJob *leader, KeyChainBridgeWalletJob *job, QObject *receiver, const char *member )
+{
+  connect( job, SIGNAL( finished( KeyChainBridgeWalletJob* ) ), this, SLOT( jobFinished( KeyChainBridgeWalletJob* ) ) );
+  if ( receiver && member )
+  {
+    connect( job, SIGNAL( finished( KeyChainBridgeWalletJob* ) ), receiver, member );
+  }
+  job->mCoalesced = true;
+  mFollowers[ leader ].append( job );
+  KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Wallet read of %1 joined the one in progress." ).arg( job->key() ) );
+  return job;
+}
+
+void KeyChainBridgeWallet::promoteFollower( KeyChainBridgeWalletJob *leader, int index )
+{
+  QList<KeyChainBridgeWalletJob*> followers = mFollowers.take( leader );
+  if ( followers.isEmpty() )
+  {
+    return;
+  }
+  KeyChainBridgeWalletJob *job = followers.takeFirst();
+  job->mCoalesced = false;
+  if ( ! followers.isEmpty() )
+  {
+    mFollowers.insert( job, followers );
+  }
+  // A running leader is about to leave the backend: go next
+  mQueue.insert( qMax( index, 0 ), job );
+  QMetaObject::invokeMethod( this, "startNext", Qt::QueuedConnection );
+}
+
+void KeyChainBridgeWallet::cancel( KeyChainBridgeWalletJob *job )
+{
+  if ( ! job || job->isDone() )
+  {
+    return;
+  }
+  // The other readers still want the entry
+  int index = mQueue.indexOf( job );
+  mQueue.removeAll( job );
+  promoteFollower( job, index );
+  job->cancel();
+}
+
+void KeyChainBridgeWallet::cancelAll()
+{
+  while ( ! mQueue.isEmpty() )
+  {
+    mQueue.dequeue()->cancel();
+  }
+  if ( mCurrent )
+  {
+    mCurrent->cancel();
+  }
+}
+
+void KeyChainBridgeWallet::setBackend( KeyChainBridgeBackend *backend )
+{
+  Q_ASSERT( backend );
+  if ( backend == mBackend )
+  {
+    return;
+  }
+  // The old backend would never answer
+  if ( mCurrent )
+  {
+    mCurrent->cancel();
+  }
+  // We might be called from within the old backend
+  if ( mBackend )
+  {
+    mBackend->deleteLater();
+  }
+  mBackend = backend;
+  mBackend->setParent( this );
+}
+
+void KeyChainBridgeWallet::startNext()
+{
+  if ( mCurrent || mQueue.isEmpty() )
+  {
+    return;
+  }
+  mCurrent = mQueue.dequeue();
+  mCurrent->start();
+  KeyChainBridgeTrace::instance()->record( KeyChainBridgeTrace::WalletStarted, 0, -1, mCurrent->type() );
+  int timeout = mCurrent->timeout() >= 0 ? mCurrent->timeout() : mTimeout;
+  if ( timeout > 0 )
+  {
+    mDeadlineTimer.start( timeout );
+  }
+  // The wallet keeps failing: do not wait for it again
+  if ( ! mRetryScheduler.allowRequest() )
+  {
+    mCurrent->complete( QKeychain::OtherError, tr( "The wallet is not responding, it will be contacted again in a while" ), QString() );
+    return;
+  }
+  mBackend->start( mCurrent );
+}
+
+bool KeyChainBridgeWallet::retry( KeyChainBridgeWalletJob *job, QKeychain::Error error )
+{
+  // Fast failure from startNext(), the wallet was not contacted
+  if ( mRetryScheduler.state() == KeyChainBridgeRetryScheduler::Open )
+  {
+    return false;
+  }
+  int delay = mRetryScheduler.retryDelay( error, job->mRetries );
+  if ( delay < 0 )
+  {
+    // The circuit breaker counts operations, not attempts
+    mRetryScheduler.record( error );
+    return false;
+  }
+  ++job->mRetries;
+  KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Wallet error %1, retry %2 in %3 ms." ).arg( error ).arg( job->mRetries ).arg( delay ) );
+  mRetryJob = job;
+  QTimer::singleShot( delay, this, SLOT( retryJob() ) );
+  return true;
+}
+
+void KeyChainBridgeWallet::deadlineExpired()
+{
+  if ( ! mCurrent || mCurrent->isDone() )
+  {
+    return;
+  }
+  KEYCHAINBRIDGE_DEBUG( Wallet, QString( "Wallet operation timed out after %1 ms." ).arg( mCurrent->elapsed() / 1000 ) );
+  // A hang counts as a failure for the circuit breaker, but it is not retried
+  if ( mRetryScheduler.state() != KeyChainBridgeRetryScheduler::Open )
+  {
+    mRetryScheduler.record( QKeychain::OtherError );
+  }
+  mCurrent->expire( tr( "The wallet did not answer in time" ) );
+}
+
+void KeyChainBridgeWallet::retryJob()
+{
+  // Cancelled in the meantime
+  if ( ! mRetryJob || mRetryJob != mCurrent || mRetryJob->isDone() )
+  {
+    return;
+  }
+  mBackend->start( mRetryJob );
+}
+
+void KeyChainBridgeWallet::jobFinished( KeyChainBridgeWalletJob *job )
+{
+  // Receivers are notified after us, delete when they are done
+  job->deleteLater();
+  if ( job->isCoalesced() )
+  {
+    // Not a backend operation: no metrics
+    QHash<KeyChainBridgeWalletJob*, QList<KeyChainBridgeWalletJob*> >::iterator it = mFollowers.begin();
+    for ( ; it != mFollowers.end(); ++it )
+    {
+      it.value().removeAll( job );
+    }
+    return;
+  }
+  // Same outcome for the readers that joined this one, cancellation included
+  QList<KeyChainBridgeWalletJob*> followers = mFollowers.take( job );
+  Q_FOREACH ( KeyChainBridgeWalletJob *follower, followers )
+  {
+    if ( job->state() == KeyChainBridgeWalletJob::Cancelled )
+    {
+      follower->cancel();
+      continue;
+    }
+    follower->mElapsed = job->elapsed();
+    follower->mRetries = job->retries();
+    follower->mTimedOut = job->timedOut();
+    follower->finish( job->error(), job->errorString(), job->textData() );
+  }
+  KeyChainBridgeMetrics::Operation operation = job->type() == KeyChainBridgeWalletJob::Read ? KeyChainBridgeMetrics::WalletRead :
+      job->type() == KeyChainBridgeWalletJob::Write ? KeyChainBridgeMetrics::WalletWrite : KeyChainBridgeMetrics::WalletDelete;
+  KeyChainBridgeTrace *trace = KeyChainBridgeTrace::instance();
+  if ( job->state() == KeyChainBridgeWalletJob::Cancelled )
+  {
+    // It may have been the circuit breaker trial
+    if ( job == mCurrent )
+    {
+      mRetryScheduler.cancelTrial();
+    }
+    KeyChainBridgeMetrics::instance()->recordCancelled( operation );
+    trace->record( KeyChainBridgeTrace::WalletCancelled, 0, job->elapsed(), job->type() );
+  }
+  else if ( job->timedOut() )
+  {
+    KeyChainBridgeMetrics::instance()->recordTimeout( operation );
+    trace->record( KeyChainBridgeTrace::WalletTimedOut, 0, job->elapsed(), job->type() );
+  }
+  else
+  {
+    KeyChainBridgeMetrics::instance()->record( operation, job->elapsed(), job->error() );
+    trace->record( KeyChainBridgeTrace::WalletFinished, job->error(), job->elapsed(), job->type() );
+  }
+  if ( job == mCurrent )
+  {
+    mDeadlineTimer.stop();
+    mCurrent = nullptr;
+    QMetaObject::invokeMethod( this, "startNext", Qt::QueuedConnection );
+  }
+}
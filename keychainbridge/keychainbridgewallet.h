@@ -0,0 +1,294 @@
+/***************************************************************************
+    keychainbridgewallet.h
+    -------------------
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef KeyChainBridgeWallet_H
+#define KeyChainBridgeWallet_H
+
+//QT4 includes
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QPointer>
+#include <QQueue>
+#include <QString>
+#include <QTimer>
+
+// QtKeyChain library
+#include "qtkeychain/keychain.h"
+
+#include "keychainbridgeretry.h"
+
+//forward declarations
+class KeyChainBridgeBackend;
+
+
+/**
+* \class KeyChainBridgeWalletJob
+* \brief A single asynchronous wallet operation
+* Jobs are created and scheduled by KeyChainBridgeWallet, the owner is
+* notified through the finished() signal and must not delete the job:
+* the wallet takes care of it once the signal has been delivered.
+*/
+class KeyChainBridgeWalletJob : public QObject
+{
+    Q_OBJECT
+  public:
+
+    //! Wallet operation
+    enum Type
+    {
+      Read,
+      Write,
+      Delete
+    };
+
+    //! Lifecycle of the operation
+    enum State
+    {
+      Pending,   //!< Queued, not yet sent to the backend
+      Running,   //!< Sent to the backend, waiting for the answer
+      Finished,  //!< The backend answered (check error())
+      Cancelled  //!< Cancelled before the backend answered
+    };
+
+    KeyChainBridgeWalletJob( Type type, const QString &service, const QString &key, QObject *parent = nullptr );
+    ~KeyChainBridgeWalletJob();
+
+    //! Operation type
+    Type type() const { return mType; }
+
+    //! Current state
+    State state() const { return mState; }
+
+    //! Whether the job is done, either finished or cancelled
+    bool isDone() const { return mState == Finished || mState == Cancelled; }
+
+    //! Wallet service (folder) name
+    QString service() const { return mService; }
+
+    //! Wallet entry key
+    QString key() const { return mKey; }
+
+    //! Data read from the wallet (Read) or to be written (Write)
+    QString textData() const { return mTextData; }
+
+    //! Set the data to be written
+    void setTextData( const QString &textData ) { mTextData = textData; }
+
+    //! Error code, QKeychain::NoError on success
+    QKeychain::Error error() const { return mError; }
+
+    //! Error description from the backend
+    QString errorString() const { return mErrorString; }
+
+    //! Time spent in the backend in microseconds, 0 if never started
+    qint64 elapsed() const;
+
+    //! Number of times the operation has been retried
+    int retries() const { return mRetries; }
+
+    //! Deadline of the operation in milliseconds, retries included, -1 for
+    //! the wallet default and 0 for none
+    int timeout() const { return mTimeout; }
+
+    //! Set the deadline, effective if set before the job is started
+    void setTimeout( int msecs ) { mTimeout = msecs; }
+
+    //! Whether the job has been abandoned because it missed its deadline:
+    //! it is finished with QKeychain::OtherError
+    bool timedOut() const { return mTimedOut; }
+
+    //! Whether the job is served by the backend operation of an earlier
+    //! read of the same entry, rather than by its own
+    bool isCoalesced() const { return mCoalesced; }
+
+  signals:
+
+    //! Emitted once, when the job is finished or cancelled
+    void finished( KeyChainBridgeWalletJob *job );
+
+  private:
+
+    friend class KeyChainBridgeWallet;
+    friend class KeyChainBridgeBackend;
+
+    //! Mark the job as sent to the backend
+    void start();
+
+    //! Mark the job as cancelled, the backend answer will be ignored
+    void cancel();
+
+    //! The backend answered
+    void complete( QKeychain::Error error, const QString &errorString, const QString &textData );
+
+    //! The deadline has passed, the backend answer will be ignored
+    void expire( const QString &errorString );
+
+    //! Set the outcome and notify
+    void finish( QKeychain::Error error, const QString &errorString, const QString &textData );
+
+    Type mType;
+
+    State mState;
+
+    QString mService;
+
+    QString mKey;
+
+    QString mTextData;
+
+    QKeychain::Error mError;
+
+    QString mErrorString;
+
+    //! Started when the job is sent to the backend
+    QElapsedTimer mTimer;
+
+    //! Time spent in the backend, set when done
+    qint64 mElapsed;
+
+    int mRetries;
+
+    int mTimeout;
+
+    bool mTimedOut;
+
+    bool mCoalesced;
+};
+
+
+/**
+* \class KeyChainBridgeWallet
+* \brief Asynchronous wallet job engine
+* All the operations are queued and executed one at a time, in the order
+* they were requested, without ever blocking the caller: completion is
+* notified to the receiver's slot, that must have the signature
+* "slot( KeyChainBridgeWalletJob* )".
+* Transient failures are retried, and the wallet is not contacted at all
+* while it keeps failing ( see KeyChainBridgeRetryScheduler ): the receiver
+* only gets the final outcome.
+* A read of an entry that is already being read, with no write or deletion
+* of the entry in between, joins the earlier read: all the receivers get
+* the outcome of a single backend operation.
+*/
+class KeyChainBridgeWallet : public QObject
+{
+    Q_OBJECT
+  public:
+
+    //! Create the engine for \a service, the wallet takes ownership of
+    //! \a backend, if null the QtKeychain backend is used
+    explicit KeyChainBridgeWallet( const QString &service, KeyChainBridgeBackend *backend = nullptr, QObject *parent = nullptr );
+    //! Destructor, pending jobs are discarded without notification
+    ~KeyChainBridgeWallet();
+
+    //! Schedule a read of the password stored in \a key, or join the read in
+    //! progress: the deadline of the earlier read applies
+    KeyChainBridgeWalletJob *readPassword( const QString &key, QObject *receiver, const char *member );
+
+    //! Schedule a write of \a password in \a key
+    KeyChainBridgeWalletJob *writePassword( const QString &key, const QString &password, QObject *receiver, const char *member );
+
+    //! Schedule the deletion of \a key
+    KeyChainBridgeWalletJob *deletePassword( const QString &key, QObject *receiver, const char *member );
+
+    //! Cancel a pending or running job, the receiver gets a Cancelled job
+    void cancel( KeyChainBridgeWalletJob *job );
+
+    //! Cancel all the pending and running jobs
+    void cancelAll();
+
+    //! Whether there are pending or running jobs
+    bool isBusy() const { return mCurrent || ! mQueue.isEmpty(); }
+
+    //! The storage backend
+    KeyChainBridgeBackend *backend() const { return mBackend; }
+
+    //! Replace the storage backend, the wallet takes ownership of \a backend
+    //! The running job, if any, is cancelled
+    void setBackend( KeyChainBridgeBackend *backend );
+
+    //! Retry policy and circuit breaker
+    KeyChainBridgeRetryScheduler *retryScheduler() { return &mRetryScheduler; }
+
+    //! Default deadline of the operations in milliseconds, 0 for none
+    int timeout() const { return mTimeout; }
+
+    //! Set the default deadline of the operations in milliseconds, 0 for none
+    void setTimeout( int msecs ) { mTimeout = msecs; }
+
+  private slots:
+
+    //! Start the next job in the queue, if idle
+    void startNext();
+
+    //! Bookkeeping when a job is done
+    void jobFinished( KeyChainBridgeWalletJob *job );
+
+    //! Send the job waiting for a retry to the backend again
+    void retryJob();
+
+    //! The running job missed its deadline
+    void deadlineExpired();
+
+  private:
+
+    friend class KeyChainBridgeWalletJob;
+
+    //! The backend answered \a job with \a error: schedule a retry if
+    //! appropriate, returns false if the job is to be completed
+    bool retry( KeyChainBridgeWalletJob *job, QKeychain::Error error );
+
+    //! Add the job to the queue and connect the receiver
+    KeyChainBridgeWalletJob *enqueue( KeyChainBridgeWalletJob *job, QObject *receiver, const char *member );
+
+    //! The pending or running read that a new read of \a key can join, if any
+    KeyChainBridgeWalletJob *readInProgress( const QString &key ) const;
+
+    //! Connect the receiver and attach \a job to the read in progress \a leader
+    KeyChainBridgeWalletJob *join( KeyChainBridgeWalletJob *leader, KeyChainBridgeWalletJob *job, QObject *receiver, const char *member );
+
+    //! \a leader is cancelled: its first follower takes its place in the
+    //! queue, at \a index, and leads the others
+    void promoteFollower( KeyChainBridgeWalletJob *leader, int index );
+
+    //! Wallet service (folder) name
+    QString mService;
+
+    //! Storage backend
+    KeyChainBridgeBackend *mBackend;
+
+    //! Jobs waiting to be started
+    QQueue<KeyChainBridgeWalletJob*> mQueue;
+
+    //! The job currently running in the backend
+    KeyChainBridgeWalletJob *mCurrent;
+
+    KeyChainBridgeRetryScheduler mRetryScheduler;
+
+    //! The job waiting for a retry, if any
+    QPointer<KeyChainBridgeWalletJob> mRetryJob;
+
+    //! Reads waiting for the outcome of an earlier read, by earlier read
+    QHash<KeyChainBridgeWalletJob*, QList<KeyChainBridgeWalletJob*> > mFollowers;
+
+    int mTimeout;
+
+    //! Deadline of the running job
+    QTimer mDeadlineTimer;
+};
+
+#endif //KeyChainBridgeWallet_H
@@ -0,0 +1,328 @@
+/***************************************************************************
+     benchkeychainbridgeunlock.cpp
+     ----------------------
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <QtTest/QtTest>
+#include <QApplication>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QSettings>
+#include <QString>
+#include <QTextStream>
+#include <QVector>
+
+#include "testutils.h"
+#include "qgsapplication.h"
+#include "qgsauthmanager.h"
+#include "qgscredentialdialog.h"
+
+#include "keychainbridgetestplugin.h"
+#include "keychainbridgecredentials.h"
+#include "keychainbridgeheadless.h"
+#include "keychainbridgebundle.h"
+#include "keychainbridgemockbackend.h"
+#include "keychainbridgesecret.h"
+#include "keychainbridgesettings.h"
+#include "keychainbridgewallet.h"
+
+
+/** Count the show events of a widget
+ */
+class ShowCounter : public QObject
+{
+    Q_OBJECT
+  public:
+    ShowCounter() : count( 0 ) {}
+
+    int count;
+
+  protected:
+    bool eventFilter( QObject *obj, QEvent *event ) override
+    {
+      if ( event->type() == QEvent::Show )
+      {
+        ++count;
+      }
+      return QObject::eventFilter( obj, event );
+    }
+};
+
+/** \ingroup UnitTests
+ * End to end benchmark of the master password unlock, from the auth manager
+ * credentials request to masterPasswordVerified, against the mock backend.
+ * The wallet unlock is measured with and without the credentials dialog
+ * being shown: the difference is the cost of building, painting and
+ * dismissing it. The plugin load time, that adds to the QGIS startup, is
+ * measured with and without deferred initialization.
+ *
+ * The number of iterations can be set with KEYCHAINBRIDGE_BENCH_ITERATIONS,
+ * if KEYCHAINBRIDGE_BENCH_MAX_P99_MS is set the test fails when the p99
+ * latency is above it.
+ */
+class TestKeychainBridgeBenchmark: public QObject
+{
+    Q_OBJECT
+
+  private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void testHeadlessUnlock();
+    void benchmarkUnlockFromWallet();
+    void benchmarkUnlockThroughDialog();
+    void benchmarkUnlockFromMemory();
+    void benchmarkPluginLoad();
+
+  private:
+
+    //! Load the plugin under test, with the master password in its wallet
+    void loadPlugin();
+
+    //! Lock the auth manager and unlock it again, returns the elapsed time in ns
+    qint64 unlock( bool fromWallet );
+
+    //! Print p50/p99 and check the p99 threshold
+    void report( const QString &label, QVector<qint64> samples );
+
+    QString mTempDir;
+    QString mPass;
+    int mIterations;
+    QgsCredentialDialog *mCredentialDialog;
+    KeyChainBridgeTestPlugin *mPlugin;
+    KeyChainBridgeMockBackend *mBackend;
+};
+
+void TestKeychainBridgeBenchmark::initTestCase()
+{
+  mPass = "pass";
+  mIterations = qgetenv( "KEYCHAINBRIDGE_BENCH_ITERATIONS" ).toInt();
+  if ( mIterations <= 0 )
+  {
+    mIterations = 2000;
+  }
+
+  // Private settings and auth DB
+  QCoreApplication::setOrganizationName( "QGIS" );
+  QCoreApplication::setApplicationName( "QGIS-KeyChainBridge-Bench" );
+  mTempDir = QDir::tempPath() + "/keychainbridge_bench";
+  QDir( mTempDir ).mkpath( mTempDir );
+  QFile::remove( mTempDir + "/qgis-auth.db" );
+  qputenv( "QGIS_AUTH_DB_DIR_PATH", mTempDir.toLocal8Bit() );
+
+  setPrefixEnviron();
+  QgsApplication::init();
+  QgsApplication::initQgis();
+  if ( QgsAuthManager::instance()->isDisabled() )
+    QSKIP( "Auth system is disabled, skipping test case", SkipAll );
+
+  QVERIFY( QgsAuthManager::instance()->setMasterPassword( mPass, true ) );
+
+  // Never touch the real keyring
+  QSettings settings;
+  settings.setValue( "Master Password Helper/backend", "mock" );
+  settings.setValue( "Master Password Helper/prefetchEnabled", false );
+
+  mCredentialDialog = new QgsCredentialDialog();
+  loadPlugin();
+}
+
+void TestKeychainBridgeBenchmark::loadPlugin()
+{
+  mPlugin = new KeyChainBridgeTestPlugin();
+  QVERIFY( ! mPlugin->failedInit() );
+  mBackend = qobject_cast<KeyChainBridgeMockBackend*>( mPlugin->wallet()->backend() );
+  QVERIFY( mBackend );
+  KeyChainBridgeBundle bundle;
+  bundle.setSecret( KeyChainBridgeBundle::masterPasswordName( QgsAuthManager::instance()->authenticationDbPath() ), mPass );
+  mBackend->setSecret( "QGIS", KeyChainBridge::sBundleName, bundle.toText() );
+}
+
+void TestKeychainBridgeBenchmark::cleanupTestCase()
+{
+  delete mPlugin;
+  QgsApplication::exitQgis();
+}
+
+qint64 TestKeychainBridgeBenchmark::unlock( bool fromWallet )
+{
+  QgsAuthManager::instance()->clearMasterPassword();
+  if ( fromWallet )
+  {
+    // Credentials provider miss: dialog, wallet read and injection
+    mPlugin->credentials()->clearMasterPassword();
+  }
+  QSignalSpy spy( QgsAuthManager::instance(), SIGNAL( masterPasswordVerified( bool ) ) );
+  QElapsedTimer timer;
+  timer.start();
+  bool ok = QgsAuthManager::instance()->setMasterPassword( true );
+  qint64 elapsed = timer.nsecsElapsed();
+  if ( ! ok || spy.isEmpty() || ! spy.last().at( 0 ).toBool() )
+  {
+    return -1;
+  }
+  return elapsed;
+}
+
+void TestKeychainBridgeBenchmark::report( const QString &label, QVector<qint64> samples )
+{
+  double p99 = printLatency( label, samples );
+  bool ok;
+  double maxP99 = qgetenv( "KEYCHAINBRIDGE_BENCH_MAX_P99_MS" ).toDouble( &ok );
+  if ( ok )
+  {
+    QVERIFY2( p99 <= maxP99, QString( "%1 p99 %2 ms exceeds %3 ms" ).arg( label ).arg( p99 ).arg( maxP99 ).toLocal8Bit().constData() );
+  }
+}
+
+void TestKeychainBridgeBenchmark::testHeadlessUnlock()
+{
+  // The headless mock backend is empty: the password comes from the file
+  QString fileName( mTempDir + "/master-password" );
+  QFile file( fileName );
+  QVERIFY( file.open( QIODevice::WriteOnly | QIODevice::Truncate ) );
+  file.write( mPass.toUtf8() + "\n" );
+  file.close();
+  qputenv( KeyChainBridgeHeadless::PASSWORD_FILE_VARIABLE, fileName.toLocal8Bit() );
+
+  KeyChainBridgeHeadless headless( "Master Password Helper" );
+  QCOMPARE( headless.unlock(), KeyChainBridgeHeadless::AlreadyUnlocked );
+
+  QgsAuthManager::instance()->clearMasterPassword();
+  QCOMPARE( headless.unlock(), KeyChainBridgeHeadless::UnlockedFromFile );
+  QVERIFY( QgsAuthManager::instance()->masterPasswordIsSet() );
+
+  QgsAuthManager::instance()->clearMasterPassword();
+  QVERIFY( file.open( QIODevice::WriteOnly | QIODevice::Truncate ) );
+  file.write( "wrong" );
+  file.close();
+  QCOMPARE( headless.unlock(), KeyChainBridgeHeadless::InvalidPassword );
+  QVERIFY( ! QgsAuthManager::instance()->masterPasswordIsSet() );
+
+  qputenv( KeyChainBridgeHeadless::PASSWORD_FILE_VARIABLE, QByteArray() );
+  QCOMPARE( headless.unlock(), KeyChainBridgeHeadless::NoPassword );
+  QFile::remove( fileName );
+}
+
+void TestKeychainBridgeBenchmark::benchmarkUnlockFromWallet()
+{
+  // Opt-in: the wallet is read before the dialog would be shown, it never is
+  mPlugin->settings()->setValue( KeyChainBridgeSettings::DialogFreeUnlock, true );
+  ShowCounter shows;
+  mCredentialDialog->installEventFilter( &shows );
+  QVector<qint64> samples;
+  samples.reserve( mIterations );
+  int allocations = -1;
+  for ( int i = 0; i < mIterations; ++i )
+  {
+    qint64 elapsed = unlock( true );
+    QVERIFY2( elapsed >= 0, QString( "Unlock failed at iteration %1" ).arg( i ).toLocal8Bit().constData() );
+    samples.append( elapsed );
+    // The first unlock may size the secret buffers, then they are reused.
+    // This only covers KeyChainBridgeSecret: the QString copies made at the
+    // QGIS and wallet boundaries are not counted
+    if ( i == 0 )
+    {
+      allocations = KeyChainBridgeSecret::allocations();
+    }
+  }
+  mCredentialDialog->removeEventFilter( &shows );
+  mPlugin->settings()->setValue( KeyChainBridgeSettings::DialogFreeUnlock, false );
+  QCOMPARE( shows.count, 0 );
+  QCOMPARE( KeyChainBridgeSecret::allocations(), allocations );
+  report( "Unlock from wallet", samples );
+}
+
+void TestKeychainBridgeBenchmark::benchmarkUnlockThroughDialog()
+{
+  // As before: the dialog is shown, the password injected and accepted
+  ShowCounter shows;
+  mCredentialDialog->installEventFilter( &shows );
+  QVector<qint64> samples;
+  samples.reserve( mIterations );
+  for ( int i = 0; i < mIterations; ++i )
+  {
+    qint64 elapsed = unlock( true );
+    QVERIFY2( elapsed >= 0, QString( "Unlock failed at iteration %1" ).arg( i ).toLocal8Bit().constData() );
+    samples.append( elapsed );
+  }
+  mCredentialDialog->removeEventFilter( &shows );
+  QCOMPARE( shows.count, mIterations );
+  report( "Unlock through the dialog", samples );
+}
+
+void TestKeychainBridgeBenchmark::benchmarkUnlockFromMemory()
+{
+  // Warm up: the wallet password is now in the credentials provider
+  QVERIFY( unlock( true ) >= 0 );
+  QVector<qint64> samples;
+  samples.reserve( mIterations );
+  for ( int i = 0; i < mIterations; ++i )
+  {
+    qint64 elapsed = unlock( false );
+    QVERIFY2( elapsed >= 0, QString( "Unlock failed at iteration %1" ).arg( i ).toLocal8Bit().constData() );
+    samples.append( elapsed );
+  }
+  report( "Unlock from memory", samples );
+}
+
+void TestKeychainBridgeBenchmark::benchmarkPluginLoad()
+{
+  // The plugin under test is the credentials provider: a new one could not
+  // chain the dialog
+  delete mPlugin;
+  mPlugin = nullptr;
+  int iterations = qMin( mIterations, 200 );
+  QSettings settings;
+  QVector<qint64> eager;
+  QVector<qint64> deferred;
+  QVector<qint64> initialization;
+  for ( int i = 0; i < iterations; ++i )
+  {
+    settings.setValue( "Master Password Helper/deferredInit", false );
+    QElapsedTimer timer;
+    timer.start();
+    KeyChainBridgeTestPlugin *plugin = new KeyChainBridgeTestPlugin();
+    eager.append( timer.nsecsElapsed() );
+    QVERIFY( plugin->isInitialized() );
+    delete plugin;
+
+    settings.setValue( "Master Password Helper/deferredInit", true );
+    timer.start();
+    plugin = new KeyChainBridgeTestPlugin();
+    deferred.append( timer.nsecsElapsed() );
+    QVERIFY( ! plugin->isInitialized() );
+    QVERIFY( ! plugin->wallet() );
+    // What the first credentials request pays for
+    timer.start();
+    plugin->initialize();
+    initialization.append( timer.nsecsElapsed() );
+    QVERIFY( plugin->wallet() );
+    delete plugin;
+  }
+  settings.setValue( "Master Password Helper/deferredInit", false );
+  report( "Plugin load", eager );
+  report( "Plugin load, deferred", deferred );
+  report( "Deferred initialization", initialization );
+  loadPlugin();
+}
+
+int main( int argc, char *argv[] )
+{
+  // No display needed (Qt 5 only, Qt 4 needs a X server, e.g. xvfb-run)
+  qputenv( "QT_QPA_PLATFORM", "offscreen" );
+  QApplication app( argc, argv );
+  TestKeychainBridgeBenchmark tc;
+  return QTest::qExec( &tc, argc, argv );
+}
+
+#include "benchkeychainbridgeunlock.moc"
@@ -0,0 +1,279 @@
+/***************************************************************************
+     soakkeychainbridge.cpp
+     ----------------------
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+#include <QtTest/QtTest>
+#include <QApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QObject>
+#include <QSettings>
+#include <QString>
+#include <QTextStream>
+#include <QWidget>
+
+#include "testutils.h"
+#include "qgsapplication.h"
+#include "qgsauthmanager.h"
+#include "qgscredentialdialog.h"
+#include "qgsmessagebar.h"
+
+#include "keychainbridgetestplugin.h"
+#include "keychainbridgecredentials.h"
+#include "keychainbridgemockbackend.h"
+#include "keychainbridgenotifier.h"
+#include "keychainbridgewallet.h"
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+
+/** \ingroup UnitTests
+ * Soak test: thousands of credentials request, verification, store and
+ * clear cycles against the mock backend, checking that the memory, the
+ * number of objects and widgets and the message bar do not grow.
+ * The number of cycles is read from KEYCHAINBRIDGE_SOAK_ITERATIONS, the
+ * default is a quick smoke run: set it to 20000 or more for a real soak.
+ * The resident set size growth allowed, in kB, is read from
+ * KEYCHAINBRIDGE_SOAK_MAX_RSS_GROWTH_KB.
+ */
+class TestKeychainBridgeSoak: public QObject
+{
+    Q_OBJECT
+
+  private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void soakCredentialCycles();
+
+  private:
+
+    //! Resource usage at a point in time
+    struct Sample
+    {
+      //! Resident set size in kB, -1 if unknown
+      qint64 rss;
+      int objects;
+      int widgets;
+      int messageBarChildren;
+    };
+
+    //! One request, verify, store and clear cycle
+    void cycle();
+
+    //! Process events until the wallet has nothing left to do
+    void waitForWallet();
+
+    Sample sample();
+
+    void print( int cycles, const Sample &s );
+
+    //! Resident set size of the process in kB, -1 if unknown
+    static qint64 residentSetSize();
+
+    QString mTempDir;
+    QString mPass;
+    int mIterations;
+    QgsCredentialDialog *mCredentialDialog;
+    QgsMessageBar *mMessageBar;
+    KeyChainBridgeTestPlugin *mPlugin;
+};
+
+void TestKeychainBridgeSoak::initTestCase()
+{
+  mPass = "pass";
+  mIterations = qgetenv( "KEYCHAINBRIDGE_SOAK_ITERATIONS" ).toInt();
+  if ( mIterations <= 0 )
+  {
+    mIterations = 200;
+  }
+
+  // Private settings and auth DB
+  QCoreApplication::setOrganizationName( "QGIS" );
+  QCoreApplication::setApplicationName( "QGIS-KeyChainBridge-Soak" );
+  mTempDir = QDir::tempPath() + "/keychainbridge_soak";
+  QDir( mTempDir ).mkpath( mTempDir );
+  QFile::remove( mTempDir + "/qgis-auth.db" );
+  qputenv( "QGIS_AUTH_DB_DIR_PATH", mTempDir.toLocal8Bit() );
+
+  setPrefixEnviron();
+  QgsApplication::init();
+  QgsApplication::initQgis();
+  if ( QgsAuthManager::instance()->isDisabled() )
+    QSKIP( "Auth system is disabled, skipping test case", SkipAll );
+
+  QVERIFY( QgsAuthManager::instance()->setMasterPassword( mPass, true ) );
+
+  // Never touch the real keyring
+  QSettings settings;
+  settings.setValue( "Master Password Helper/backend", "mock" );
+  settings.setValue( "Master Password Helper/prefetchEnabled", false );
+
+  mCredentialDialog = new QgsCredentialDialog();
+  mMessageBar = new QgsMessageBar();
+  mPlugin = new KeyChainBridgeTestPlugin();
+  QVERIFY( ! mPlugin->failedInit() );
+  // Headless: give the notifications somewhere to go
+  mPlugin->notifier()->setMessageBar( mMessageBar );
+  KeyChainBridgeMockBackend *backend = qobject_cast<KeyChainBridgeMockBackend*>( mPlugin->wallet()->backend() );
+  QVERIFY( backend );
+  backend->setSecret( "QGIS", "QGIS-Master-Password", mPass );
+}
+
+void TestKeychainBridgeSoak::cleanupTestCase()
+{
+  delete mPlugin;
+  delete mMessageBar;
+  QgsApplication::exitQgis();
+}
+
+void TestKeychainBridgeSoak::waitForWallet()
+{
+  QElapsedTimer timer;
+  timer.start();
+  while ( mPlugin->wallet()->isBusy() && timer.elapsed() < 5000 )
+  {
+    QCoreApplication::processEvents();
+  }
+  QVERIFY( ! mPlugin->wallet()->isBusy() );
+}
+
+void TestKeychainBridgeSoak::cycle()
+{
+  QgsAuthManager *authManager = QgsAuthManager::instance();
+
+  // Credentials request answered from the wallet, and verified
+  authManager->clearMasterPassword();
+  mPlugin->credentials()->clearMasterPassword();
+  QVERIFY( authManager->setMasterPassword( true ) );
+  QVERIFY( ! mPlugin->isDirty() );
+
+  // Stored again from the menu
+  mPlugin->saveMasterPassword();
+  waitForWallet();
+
+  // Cleared from the menu
+  mPlugin->deleteMasterPassword();
+  mPlugin->setMasterPassword( "", false );
+  mPlugin->setIsDirty( true );
+  waitForWallet();
+
+  // Typed in the dialog and verified: stored by the plugin
+  authManager->clearMasterPassword();
+  mPlugin->setMasterPassword( mPass, false );
+  QVERIFY( authManager->setMasterPassword( mPass, true ) );
+  waitForWallet();
+  QVERIFY( ! mPlugin->isDirty() );
+
+  // The widgets the user gets to see
+  mPlugin->askSaveMasterPassword( "Do you want to store your master password now?" );
+  mPlugin->about();
+}
+
+TestKeychainBridgeSoak::Sample TestKeychainBridgeSoak::sample()
+{
+  // Jobs and closed widgets are deleted later
+  QCoreApplication::processEvents();
+  QCoreApplication::sendPostedEvents( nullptr, QEvent::DeferredDelete );
+  Sample s;
+  s.rss = residentSetSize();
+  s.objects = mPlugin->findChildren<QObject*>().size();
+  s.widgets = QApplication::allWidgets().size();
+  s.messageBarChildren = mMessageBar->findChildren<QObject*>().size();
+  return s;
+}
+
+void TestKeychainBridgeSoak::print( int cycles, const Sample &s )
+{
+  qStdout() << QString( "%1 cycles: rss %2 kB, %3 plugin objects, %4 widgets, %5 message bar children\n" )
+  .arg( cycles ).arg( s.rss ).arg( s.objects ).arg( s.widgets ).arg( s.messageBarChildren );
+  qStdout().flush();
+}
+
+qint64 TestKeychainBridgeSoak::residentSetSize()
+{
+#ifdef Q_OS_LINUX
+  QFile statm( "/proc/self/statm" );
+  if ( statm.open( QIODevice::ReadOnly ) )
+  {
+    QList<QByteArray> fields( statm.readAll().split( ' ' ) );
+    if ( fields.size() > 1 )
+    {
+      return fields.at( 1 ).toLongLong() * sysconf( _SC_PAGESIZE ) / 1024;
+    }
+  }
+#endif
+  return -1;
+}
+
+void TestKeychainBridgeSoak::soakCredentialCycles()
+{
+  bool ok;
+  qint64 maxRssGrowth = qgetenv( "KEYCHAINBRIDGE_SOAK_MAX_RSS_GROWTH_KB" ).toLongLong( &ok );
+  if ( ! ok )
+  {
+    maxRssGrowth = 8192;
+  }
+  int step = qMax( 1, mIterations / 10 );
+
+  // Warm up: caches, lazily created objects, the first items in the bar
+  int warmup = qMin( step, 100 );
+  for ( int i = 0; i < warmup; ++i )
+  {
+    cycle();
+    if ( QTest::currentTestFailed() )
+    {
+      return;
+    }
+  }
+  Sample baseline( sample() );
+  print( warmup, baseline );
+
+  Sample last( baseline );
+  for ( int i = 1; i <= mIterations; ++i )
+  {
+    cycle();
+    if ( QTest::currentTestFailed() )
+    {
+      qStdout() << QString( "Failed at cycle %1\n" ).arg( i );
+      return;
+    }
+    if ( i % step == 0 )
+    {
+      last = sample();
+      print( warmup + i, last );
+    }
+  }
+
+  // Bar items that expired in between are created again: some slack
+  QVERIFY2( last.objects <= baseline.objects + 8, QString( "Plugin objects grew from %1 to %2" ).arg( baseline.objects ).arg( last.objects ).toLocal8Bit().constData() );
+  QVERIFY2( last.widgets <= baseline.widgets + 16, QString( "Widgets grew from %1 to %2" ).arg( baseline.widgets ).arg( last.widgets ).toLocal8Bit().constData() );
+  QVERIFY2( last.messageBarChildren <= baseline.messageBarChildren + 16, QString( "Message bar children grew from %1 to %2" ).arg( baseline.messageBarChildren ).arg( last.messageBarChildren ).toLocal8Bit().constData() );
+  if ( baseline.rss < 0 )
+  {
+    QWARN( "Resident set size not available on this platform, memory growth not checked" );
+    return;
+  }
+  QVERIFY2( last.rss - baseline.rss <= maxRssGrowth, QString( "Resident set size grew by %1 kB, more than %2 kB" ).arg( last.rss - baseline.rss ).arg( maxRssGrowth ).toLocal8Bit().constData() );
+}
+
+int main( int argc, char *argv[] )
+{
+  // No display needed (Qt 5 only, Qt 4 needs a X server, e.g. xvfb-run)
+  qputenv( "QT_QPA_PLATFORM", "offscreen" );
+  QApplication app( argc, argv );
+  TestKeychainBridgeSoak tc;
+  return QTest::qExec( &tc, argc, argv );
+}
+
+#include "soakkeychainbridge.moc"
@@ -16,29 +16,52 @@
 
 #include <QtTest/QtTest>
 #include <QApplication>
+#include <QDataStream>
 #include <QDateTime>
 #include <QDebug>
+#include <QDir>
+#include <QFileInfo>
 #include <QObject>
+#include <QSettings>
 #include <QString>
 #include <QStringList>
 #include <QTextStream>
 #include <QTemporaryFile>
+#include <QEvent>
+#include <QLineEdit>
+#include <QPushButton>
+#include <QStackedWidget>
+#include <QSignalSpy>
 
 #include "testutils.h"
 #include <qapplication.h>
 #include "qgsapplication.h"
 #include "qgsauthmanager.h"
+#include "qgscredentialdialog.h"
+#include "qgsmessagebar.h"
+
+#include "keychainbridgebundle.h"
+#include "keychainbridgecachebackend.h"
+#include "keychainbridgecredentials.h"
+#include "keychainbridgedialogfilter.h"
+#include "keychainbridgelog.h"
+#include "keychainbridgemetrics.h"
+#include "keychainbridgemockbackend.h"
+#include "keychainbridgenotifier.h"
+#include "keychainbridgereadahead.h"
+#include "keychainbridgesecret.h"
+#include "keychainbridgesecretcache.h"
+#include "keychainbridgesettings.h"
+#include "keychainbridgetrace.h"
+#include "keychainbridgewallet.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#ifdef Q_COMPILER_RVALUE_REFS
+#include <utility>
+#endif
 
 
-inline QTextStream& qStdout()
-{
-  static QTextStream r( stdout );
-  return r;
-}
-
 void suppressDebugHandler( QtMsgType type, const char *msg )
 {
   switch ( type )
@@ -57,6 +80,75 @@ void suppressDebugHandler( QtMsgType type, const char *msg )
   }
 }
 
+static int sLogEvaluations = 0;
+
+//! Count how many times a log message is built
+static QString countedLogMessage()
+{
+  ++sLogEvaluations;
+  return QString( "message" );
+}
+
+/** Reference for the benchmarks: the credentials dialog event filter as it
+ * was, with the widget lookups done before checking the event type
+ */
+class LegacyDialogFilter : public QObject
+{
+  public:
+    bool eventFilter( QObject *obj, QEvent *event ) override
+    {
+      QgsCredentialDialog* credentials = qobject_cast<QgsCredentialDialog*>( obj );
+      Q_ASSERT( credentials );
+      QStackedWidget* stackedWidget =  credentials->findChild<QStackedWidget*>( "stackedWidget" );
+      Q_ASSERT( stackedWidget );
+      if ( stackedWidget->currentIndex() == 1 &&
+           event->type() == QEvent::Show )
+      {
+        credentials->findChild<QLineEdit*>( "leMasterPass" );
+      }
+      return QObject::eventFilter( obj, event );
+    }
+};
+
+/** Record the outcome of the wallet jobs
+ */
+class JobRecorder : public QObject
+{
+    Q_OBJECT
+  public:
+    JobRecorder() : count( 0 ), state( KeyChainBridgeWalletJob::Pending ), error( QKeychain::NoError ), retries( 0 ), timedOut( false ) {}
+
+    //! Wait until \a expected jobs are done, or timeout
+    bool wait( int expected, int timeout = 5000 )
+    {
+      QTime t;
+      t.start();
+      while ( count < expected && t.elapsed() < timeout )
+      {
+        QTest::qWait( 1 );
+      }
+      return count >= expected;
+    }
+
+    int count;
+    KeyChainBridgeWalletJob::State state;
+    QKeychain::Error error;
+    QString textData;
+    int retries;
+    bool timedOut;
+
+  public slots:
+    void record( KeyChainBridgeWalletJob *job )
+    {
+      ++count;
+      state = job->state();
+      error = job->error();
+      textData = job->textData();
+      retries = job->retries();
+      timedOut = job->timedOut();
+    }
+};
+
 /** \ingroup UnitTests
  * Unit tests for QGIS Auth Test Browser
  */
@@ -71,11 +163,31 @@ class TestKeychainBridgePlugin: public QObject
     void cleanup();
 
     void testKeychainBridgePlugin();
+    void testDialogFilter();
+    void testWalletMockBackend();
+    void testWalletRetry();
+    void testWalletDeadline();
+    void testWalletCoalescing();
+    void testMetrics();
+    void testLazyLogging();
+    void testSettings();
+    void testBundle();
+    void testReadAheadScan();
+    void testSecretCache();
+    void testCacheBackend();
+    void testNotifier();
+    void testTrace();
+    void testSecret();
+    void testCredentialsExpiry();
+    void benchmarkLegacyDialogFilter();
+    void benchmarkDialogFilter();
 
   private:
     static QString smHashes;
 //    static QObject *smParentObj;
     QtMsgHandler mOrigMsgHandler;
+    //! Never deleted: it registers itself as the QgsCredentials instance
+    QgsCredentialDialog *mCredentialDialog;
 };
 
 QString TestKeychainBridgePlugin::smHashes = "#####################";
@@ -93,6 +205,8 @@ void TestKeychainBridgePlugin::initTestCase()
 
   qInstallMsgHandler( mOrigMsgHandler );
 
+  mCredentialDialog = new QgsCredentialDialog();
+
 //  qDebug() << QgsApplication::showSettings();
 }
 
@@ -122,5 +236,788 @@ void TestKeychainBridgePlugin::testKeychainBridgePlugin()
   qDebug() << "Entered";
 }
 
+void TestKeychainBridgePlugin::testDialogFilter()
+{
+  KeyChainBridgeDialogFilter filter( mCredentialDialog );
+  QSignalSpy spy( &filter, SIGNAL( masterPasswordRequested() ) );
+  QStackedWidget* stackedWidget = mCredentialDialog->findChild<QStackedWidget*>( "stackedWidget" );
+  QVERIFY( stackedWidget );
+  QVERIFY( filter.masterPasswordEdit() );
+
+  // Not a show event
+  QEvent paint( QEvent::Paint );
+  QCoreApplication::sendEvent( mCredentialDialog, &paint );
+  QCOMPARE( spy.count(), 0 );
+
+  // Not the master password page
+  stackedWidget->setCurrentIndex( 0 );
+  QEvent show( QEvent::Show );
+  QCoreApplication::sendEvent( mCredentialDialog, &show );
+  QCOMPARE( spy.count(), 0 );
+
+  stackedWidget->setCurrentIndex( 1 );
+  QCoreApplication::sendEvent( mCredentialDialog, &show );
+  QCOMPARE( spy.count(), 1 );
+  QVERIFY( filter.isMasterPasswordPage() );
+}
+
+void TestKeychainBridgePlugin::testWalletMockBackend()
+{
+  KeyChainBridgeMockBackend *backend = new KeyChainBridgeMockBackend();
+  KeyChainBridgeWallet wallet( "QGIS", backend );
+  JobRecorder recorder;
+
+  // Empty wallet
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 1 ) );
+  QCOMPARE( recorder.error, QKeychain::EntryNotFound );
+
+  wallet.writePassword( "key", "secret", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 3 ) );
+  QCOMPARE( recorder.error, QKeychain::NoError );
+  QCOMPARE( recorder.textData, QString( "secret" ) );
+  QCOMPARE( backend->secret( "QGIS", "key" ), QString( "secret" ) );
+
+  // Injected errors
+  backend->injectError( QKeychain::AccessDenied );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 4 ) );
+  QCOMPARE( recorder.error, QKeychain::AccessDenied );
+  backend->setFailureRate( 1.0 );
+  backend->setFailureError( QKeychain::NoBackendAvailable );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 5 ) );
+  QCOMPARE( recorder.error, QKeychain::NoBackendAvailable );
+  backend->setFailureRate( 0.0 );
+
+  // Cancellation
+  backend->setLatency( 50 );
+  KeyChainBridgeWalletJob *job = wallet.deletePassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  wallet.cancel( job );
+  QVERIFY( recorder.wait( 6 ) );
+  QCOMPARE( recorder.state, KeyChainBridgeWalletJob::Cancelled );
+  QTest::qWait( 100 );
+  QCOMPARE( recorder.count, 6 );
+
+  wallet.deletePassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 7 ) );
+  QCOMPARE( recorder.error, QKeychain::NoError );
+  QVERIFY( backend->secret( "QGIS", "key" ).isNull() );
+}
+
+void TestKeychainBridgePlugin::testWalletRetry()
+{
+  QCOMPARE( KeyChainBridgeRetryScheduler::classify( QKeychain::EntryNotFound ), KeyChainBridgeRetryScheduler::Success );
+  QCOMPARE( KeyChainBridgeRetryScheduler::classify( QKeychain::AccessDeniedByUser ), KeyChainBridgeRetryScheduler::Permanent );
+  QCOMPARE( KeyChainBridgeRetryScheduler::classify( QKeychain::OtherError ), KeyChainBridgeRetryScheduler::Transient );
+
+  KeyChainBridgeMockBackend *backend = new KeyChainBridgeMockBackend();
+  backend->setSecret( "QGIS", "key", "secret" );
+  KeyChainBridgeWallet wallet( "QGIS", backend );
+  KeyChainBridgeRetryScheduler *scheduler = wallet.retryScheduler();
+  scheduler->setSeed( 1 );
+  scheduler->setBaseDelay( 10 );
+  scheduler->setMaxDelay( 40 );
+  scheduler->setMaxRetries( 2 );
+  scheduler->setFailureThreshold( 3 );
+  scheduler->setOpenInterval( 200 );
+  JobRecorder recorder;
+
+  // Transient failures are retried transparently
+  backend->injectError( QKeychain::OtherError, 2 );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 1 ) );
+  QCOMPARE( recorder.error, QKeychain::NoError );
+  QCOMPARE( recorder.textData, QString( "secret" ) );
+  QCOMPARE( recorder.retries, 2 );
+  QCOMPARE( backend->operationCount(), 3 );
+  QCOMPARE( scheduler->state(), KeyChainBridgeRetryScheduler::Closed );
+
+  // Permanent failures are not
+  backend->injectError( QKeychain::AccessDenied );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 2 ) );
+  QCOMPARE( recorder.error, QKeychain::AccessDenied );
+  QCOMPARE( recorder.retries, 0 );
+
+  // A failed operation counts once, whatever its retries
+  backend->injectError( QKeychain::OtherError, 3 );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 3 ) );
+  QCOMPARE( recorder.error, QKeychain::OtherError );
+  QCOMPARE( recorder.retries, 2 );
+  QCOMPARE( scheduler->failures(), 1 );
+  QCOMPARE( scheduler->state(), KeyChainBridgeRetryScheduler::Closed );
+
+  // Repeated failed operations open the circuit: the backend is not contacted anymore
+  backend->injectError( QKeychain::OtherError, 6 );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 4 ) );
+  QCOMPARE( scheduler->state(), KeyChainBridgeRetryScheduler::Closed );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 5 ) );
+  QCOMPARE( recorder.error, QKeychain::OtherError );
+  QCOMPARE( scheduler->state(), KeyChainBridgeRetryScheduler::Open );
+  int operations = backend->operationCount();
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 6 ) );
+  QCOMPARE( recorder.error, QKeychain::OtherError );
+  QCOMPARE( backend->operationCount(), operations );
+
+  // After the open interval a trial goes through and closes it
+  QTest::qWait( 250 );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 7 ) );
+  QCOMPARE( recorder.error, QKeychain::NoError );
+  QCOMPARE( backend->operationCount(), operations + 1 );
+  QCOMPARE( scheduler->state(), KeyChainBridgeRetryScheduler::Closed );
+
+  // A cancelled trial does not keep the circuit half open
+  KeyChainBridgeRetryScheduler breaker;
+  breaker.setFailureThreshold( 1 );
+  breaker.setOpenInterval( 0 );
+  breaker.record( QKeychain::OtherError );
+  QCOMPARE( breaker.state(), KeyChainBridgeRetryScheduler::Open );
+  QVERIFY( breaker.allowRequest() );
+  QCOMPARE( breaker.state(), KeyChainBridgeRetryScheduler::HalfOpen );
+  QVERIFY( ! breaker.allowRequest() );
+  breaker.cancelTrial();
+  QVERIFY( breaker.allowRequest() );
+  breaker.record( QKeychain::NoError );
+  QCOMPARE( breaker.state(), KeyChainBridgeRetryScheduler::Closed );
+}
+
+void TestKeychainBridgePlugin::testWalletDeadline()
+{
+  KeyChainBridgeMetrics *metrics = KeyChainBridgeMetrics::instance();
+  int timeouts = metrics->timeoutCount( KeyChainBridgeMetrics::WalletRead );
+  KeyChainBridgeMockBackend *backend = new KeyChainBridgeMockBackend();
+  backend->setSecret( "QGIS", "key", "secret" );
+  backend->setLatency( 300 );
+  KeyChainBridgeWallet wallet( "QGIS", backend );
+  wallet.setTimeout( 50 );
+  JobRecorder recorder;
+
+  // The hung operation is abandoned, the queue goes on
+  QTime t;
+  t.start();
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 1 ) );
+  QVERIFY( t.elapsed() < 250 );
+  QCOMPARE( recorder.state, KeyChainBridgeWalletJob::Finished );
+  QCOMPARE( recorder.error, QKeychain::OtherError );
+  QVERIFY( recorder.timedOut );
+  QCOMPARE( metrics->timeoutCount( KeyChainBridgeMetrics::WalletRead ), timeouts + 1 );
+  QVERIFY( ! wallet.isBusy() );
+
+  // No deadline for this one
+  KeyChainBridgeWalletJob *job = wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  job->setTimeout( 0 );
+  QVERIFY( recorder.wait( 2 ) );
+  QCOMPARE( recorder.error, QKeychain::NoError );
+  QVERIFY( ! recorder.timedOut );
+  QCOMPARE( recorder.textData, QString( "secret" ) );
+  QCOMPARE( recorder.count, 2 );
+}
+
+void TestKeychainBridgePlugin::testWalletCoalescing()
+{
+  KeyChainBridgeMockBackend *backend = new KeyChainBridgeMockBackend();
+  backend->setSecret( "QGIS", "key", "secret" );
+  backend->setLatency( 50 );
+  KeyChainBridgeWallet wallet( "QGIS", backend );
+  JobRecorder recorder;
+
+  // Concurrent reads share a single backend operation
+  KeyChainBridgeWalletJob *first = wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( ! first->isCoalesced() );
+  QVERIFY( wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) )->isCoalesced() );
+  QVERIFY( wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) )->isCoalesced() );
+  QVERIFY( recorder.wait( 3 ) );
+  QCOMPARE( recorder.error, QKeychain::NoError );
+  QCOMPARE( recorder.textData, QString( "secret" ) );
+  QCOMPARE( backend->operationCount(), 1 );
+
+  // A read cannot see through a write
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  wallet.writePassword( "key", "other", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  KeyChainBridgeWalletJob *afterWrite = wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( ! afterWrite->isCoalesced() );
+  QVERIFY( recorder.wait( 6 ) );
+  QCOMPARE( recorder.textData, QString( "other" ) );
+  QCOMPARE( backend->operationCount(), 4 );
+
+  // Cancelling the first reader does not leave the others without an answer
+  first = wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  wallet.cancel( first );
+  QVERIFY( recorder.wait( 8 ) );
+  QCOMPARE( recorder.state, KeyChainBridgeWalletJob::Finished );
+  QCOMPARE( recorder.textData, QString( "other" ) );
+  QTest::qWait( 100 );
+  QCOMPARE( recorder.count, 8 );
+}
+
+void TestKeychainBridgePlugin::testMetrics()
+{
+  KeyChainBridgeMetrics *metrics = KeyChainBridgeMetrics::instance();
+  metrics->reset();
+  metrics->record( KeyChainBridgeMetrics::WalletRead, 50 );
+  metrics->record( KeyChainBridgeMetrics::WalletRead, 700 );
+  metrics->record( KeyChainBridgeMetrics::WalletRead, 10000000, QKeychain::AccessDenied );
+  metrics->recordCancelled( KeyChainBridgeMetrics::WalletRead );
+  QCOMPARE( metrics->count( KeyChainBridgeMetrics::WalletRead ), 3 );
+  QCOMPARE( metrics->count( KeyChainBridgeMetrics::WalletWrite ), 0 );
+  QCOMPARE( metrics->cancelledCount( KeyChainBridgeMetrics::WalletRead ), 1 );
+  QCOMPARE( metrics->errorCount( KeyChainBridgeMetrics::WalletRead, QKeychain::NoError ), 2 );
+  QCOMPARE( metrics->errorCount( KeyChainBridgeMetrics::WalletRead, QKeychain::AccessDenied ), 1 );
+  QCOMPARE( metrics->bucketCount( KeyChainBridgeMetrics::WalletRead, 0 ), 1 );
+  QCOMPARE( metrics->bucketCount( KeyChainBridgeMetrics::WalletRead, KeyChainBridgeMetrics::BUCKET_COUNT - 1 ), 1 );
+  QCOMPARE( metrics->maximum( KeyChainBridgeMetrics::WalletRead ), 10000000 );
+  QCOMPARE( metrics->percentile( KeyChainBridgeMetrics::WalletRead, 50 ), qint64( 1000 ) );
+  QVERIFY( metrics->toString().contains( "wallet read: 3 completed" ) );
+  metrics->reset();
+  QCOMPARE( metrics->count( KeyChainBridgeMetrics::WalletRead ), 0 );
+}
+
+void TestKeychainBridgePlugin::testLazyLogging()
+{
+  KeyChainBridgeLog::Level level = KeyChainBridgeLog::level();
+  int categories = KeyChainBridgeLog::categories();
+  sLogEvaluations = 0;
+
+  KeyChainBridgeLog::setLevel( KeyChainBridgeLog::Disabled );
+  KEYCHAINBRIDGE_WARNING( Wallet, countedLogMessage() );
+  QCOMPARE( sLogEvaluations, 0 );
+
+  KeyChainBridgeLog::setLevel( KeyChainBridgeLog::Warning );
+  KEYCHAINBRIDGE_DEBUG( Wallet, countedLogMessage() );
+  QCOMPARE( sLogEvaluations, 0 );
+  KEYCHAINBRIDGE_WARNING( Wallet, countedLogMessage() );
+  QCOMPARE( sLogEvaluations, 1 );
+
+  KeyChainBridgeLog::setLevel( KeyChainBridgeLog::Debug );
+  KeyChainBridgeLog::setCategories( KeyChainBridgeLog::Dialog );
+  KEYCHAINBRIDGE_DEBUG( Wallet, countedLogMessage() );
+  QCOMPARE( sLogEvaluations, 1 );
+  KEYCHAINBRIDGE_DEBUG( Dialog, countedLogMessage() );
+  QCOMPARE( sLogEvaluations, 2 );
+
+  KeyChainBridgeLog::setLevel( level );
+  KeyChainBridgeLog::setCategories( categories );
+}
+
+void TestKeychainBridgePlugin::testSettings()
+{
+  QString group( "KeyChainBridgeTest" );
+  QSettings().remove( group );
+
+  KeyChainBridgeSettings *settings = new KeyChainBridgeSettings( group );
+  QCOMPARE( settings->settingsKey( KeyChainBridgeSettings::UseWallet ), QString( "KeyChainBridgeTest/useWallet" ) );
+  QVERIFY( settings->useWallet() );
+  QVERIFY( settings->prefetchEnabled() );
+  QCOMPARE( settings->backend(), QString( "qtkeychain" ) );
+  QVERIFY( ! settings->hasPendingChanges() );
+
+  // A burst of changes is written once, after the quiet period
+  settings->setWriteDelay( 50 );
+  settings->setUseWallet( false );
+  settings->setLoggingEnabled( true );
+  settings->setUseWallet( true );
+  settings->setUseWallet( false );
+  QVERIFY( settings->hasPendingChanges() );
+  QVERIFY( ! QSettings().contains( settings->settingsKey( KeyChainBridgeSettings::UseWallet ) ) );
+  QTest::qWait( 200 );
+  QVERIFY( ! settings->hasPendingChanges() );
+  settings->sync();
+  QCOMPARE( QSettings().value( settings->settingsKey( KeyChainBridgeSettings::UseWallet ) ).toBool(), false );
+  QCOMPARE( QSettings().value( settings->settingsKey( KeyChainBridgeSettings::LoggingEnabled ) ).toBool(), true );
+
+  // Pending changes are written on destruction
+  settings->setWriteDelay( 60000 );
+  settings->setPrefetchEnabled( false );
+  delete settings;
+  QCOMPARE( QSettings().value( QString( "%1/prefetchEnabled" ).arg( group ) ).toBool(), false );
+
+  settings = new KeyChainBridgeSettings( group );
+  QVERIFY( ! settings->useWallet() );
+  QVERIFY( settings->loggingEnabled() );
+  QVERIFY( ! settings->prefetchEnabled() );
+  delete settings;
+  QSettings().remove( group );
+}
+
+void TestKeychainBridgePlugin::testBundle()
+{
+  KeyChainBridgeBundle bundle;
+  QVERIFY( bundle.isEmpty() );
+  QVERIFY( bundle.secret( "missing" ).isNull() );
+
+  bundle.setSecret( "masterPassword:/a/qgis-auth.db", "pass" );
+  bundle.setSecret( "masterPassword:/b/qgis-auth.db", QString::fromUtf8( "p\xc3\xa0ss" ) );
+  bundle.setSecret( "authcfg:abc1234", "" );
+  QCOMPARE( bundle.count(), 3 );
+  QCOMPARE( bundle.secret( "masterPassword:/a/qgis-auth.db" ), QString( "pass" ) );
+  QCOMPARE( bundle.secret( "masterPassword:/b/qgis-auth.db" ), QString::fromUtf8( "p\xc3\xa0ss" ) );
+  QVERIFY( ! bundle.secret( "authcfg:abc1234" ).isNull() );
+
+  // Fits in the slot: updated in place
+  int size = bundle.dataSize();
+  bundle.setSecret( "masterPassword:/a/qgis-auth.db", "password" );
+  QCOMPARE( bundle.dataSize(), size );
+  QCOMPARE( bundle.wastedBytes(), 0 );
+  QCOMPARE( bundle.secret( "masterPassword:/a/qgis-auth.db" ), QString( "password" ) );
+
+  // Does not fit: moved
+  bundle.setSecret( "masterPassword:/a/qgis-auth.db", QString( 40, 'x' ) );
+  QCOMPARE( bundle.secret( "masterPassword:/a/qgis-auth.db" ), QString( 40, 'x' ) );
+  QVERIFY( bundle.wastedBytes() > 0 );
+
+  // Round trip, binary and text
+  KeyChainBridgeBundle copy;
+  QVERIFY( copy.fromByteArray( bundle.toByteArray() ) );
+  QCOMPARE( copy.count(), 3 );
+  QCOMPARE( copy.secret( "masterPassword:/b/qgis-auth.db" ), QString::fromUtf8( "p\xc3\xa0ss" ) );
+  QVERIFY( KeyChainBridgeBundle::isBundleText( bundle.toText() ) );
+  QVERIFY( ! KeyChainBridgeBundle::isBundleText( "pass" ) );
+  KeyChainBridgeBundle fromText;
+  QVERIFY( fromText.fromText( bundle.toText() ) );
+  QCOMPARE( fromText.secret( "masterPassword:/a/qgis-auth.db" ), QString( 40, 'x' ) );
+
+  // Invalid data leaves the bundle untouched
+  QByteArray data( bundle.toByteArray() );
+  QVERIFY( ! copy.fromByteArray( data.left( data.size() - 4 ) ) );
+  QVERIFY( ! copy.fromByteArray( QByteArray( "pass" ) ) );
+  QByteArray overlapping;
+  QDataStream stream( &overlapping, QIODevice::WriteOnly );
+  stream.setVersion( QDataStream::Qt_4_8 );
+  stream << KeyChainBridgeBundle::MAGIC << KeyChainBridgeBundle::VERSION << quint32( 2 )
+         << QString( "a" ) << quint32( 0 ) << quint32( 4 ) << quint32( 32 )
+         << QString( "b" ) << quint32( 16 ) << quint32( 4 ) << quint32( 32 ) << QByteArray( 64, 'x' );
+  QVERIFY( ! copy.fromByteArray( overlapping ) );
+  QCOMPARE( copy.count(), 3 );
+
+  QVERIFY( bundle.removeSecret( "authcfg:abc1234" ) );
+  QVERIFY( ! bundle.removeSecret( "authcfg:abc1234" ) );
+  QVERIFY( bundle.removeSecret( "masterPassword:/a/qgis-auth.db" ) );
+  QCOMPARE( bundle.count(), 1 );
+  QCOMPARE( bundle.secret( "masterPassword:/b/qgis-auth.db" ), QString::fromUtf8( "p\xc3\xa0ss" ) );
+  QVERIFY( bundle.removeSecret( "masterPassword:/b/qgis-auth.db" ) );
+  QVERIFY( bundle.isEmpty() );
+  QCOMPARE( bundle.dataSize(), 0 );
+
+  // A moved auth DB is matched on its identity, never by elimination
+  KeyChainBridgeBundle moved;
+  moved.setSecret( "masterPassword:/old/qgis-auth.db", "pass" );
+  QVERIFY( moved.movedMasterPassword( "0123abcd" ).isNull() );
+  moved.setSecret( KeyChainBridgeBundle::authDbName( "0123abcd" ), "masterPassword:/old/qgis-auth.db" );
+  QCOMPARE( moved.movedMasterPassword( "0123abcd" ), QString( "masterPassword:/old/qgis-auth.db" ) );
+  QVERIFY( moved.movedMasterPassword( "4567ef01" ).isNull() );
+  QVERIFY( moved.movedMasterPassword( QString() ).isNull() );
+}
+
+void TestKeychainBridgePlugin::testReadAheadScan()
+{
+  QByteArray project(
+    "<qgis><projectlayers>"
+    "<maplayer><datasource>dbname='gis' host=db port=5432 authcfg=pg00001 sslmode=disable table=\"public\".\"a\"</datasource></maplayer>"
+    "<maplayer><datasource>contextualWMSLegend=0&amp;authcfg=wms0001&amp;url=http://example.com/wms</datasource></maplayer>"
+    "<maplayer><datasource>dbname='gis' authcfg='pg00001' table=\"public\".\"b\"</datasource></maplayer>"
+    "<maplayer><datasource>authcfg=toolong12 url=http://example.com</datasource></maplayer>"
+    "<maplayer><datasource>/data/roads.shp</datasource></maplayer>"
+    "</projectlayers></qgis>" );
+  QStringList ids( KeyChainBridgeReadAhead::authConfigIds( project ) );
+  QCOMPARE( ids, QStringList() << "pg00001" << "wms0001" );
+  QVERIFY( KeyChainBridgeReadAhead::authConfigIds( "<qgis/>" ).isEmpty() );
+}
+
+void TestKeychainBridgePlugin::testSecretCache()
+{
+  if ( ! KeyChainBridgeSecretCache::isSupported() )
+    QSKIP( "QCA lacks the secret cache algorithms, skipping test", SkipSingle );
+  QString fileName( QDir::tempPath() + "/keychainbridge_test.cache" );
+  QFile::remove( fileName );
+
+  {
+    KeyChainBridgeSecretCache cache( fileName, "user\nmachine" );
+    QVERIFY( cache.load() );
+    QCOMPARE( cache.count(), 0 );
+    QVERIFY( cache.setSecret( "QGIS", "a", "first" ) );
+    QVERIFY( cache.setSecret( "QGIS", "b", QString::fromUtf8( "p\xc3\xa0ss" ) ) );
+    QVERIFY( cache.setSecret( "QGIS", "a", "second" ) );
+    QVERIFY( cache.removeSecret( "QGIS", "b" ) );
+    QVERIFY( ! cache.removeSecret( "QGIS", "b" ) );
+    QCOMPARE( cache.secret( "QGIS", "a" ), QString( "second" ) );
+    QVERIFY( cache.secret( "QGIS", "b" ).isNull() );
+  }
+
+  // The log is replayed, nothing in clear text
+  QFile file( fileName );
+  QVERIFY( file.open( QIODevice::ReadOnly ) );
+  QByteArray contents( file.readAll() );
+  file.close();
+  QVERIFY( ! contents.contains( "second" ) );
+  KeyChainBridgeSecretCache reloaded( fileName, "user\nmachine" );
+  QVERIFY( reloaded.load() );
+  QCOMPARE( reloaded.count(), 1 );
+  QCOMPARE( reloaded.corruptRecords(), 0 );
+  QCOMPARE( reloaded.secret( "QGIS", "a" ), QString( "second" ) );
+
+  // Bound to the user and machine
+  KeyChainBridgeSecretCache elsewhere( fileName, "other\nmachine" );
+  QVERIFY( ! elsewhere.load() );
+
+  // A damaged tail is dropped, the rest survives and the file is usable
+  QVERIFY( reloaded.setSecret( "QGIS", "c", "third" ) );
+  QVERIFY( file.open( QIODevice::ReadWrite ) );
+  file.seek( file.size() - 1 );
+  char last;
+  file.getChar( &last );
+  file.seek( file.size() - 1 );
+  file.putChar( last ^ 0x01 );
+  file.close();
+  QVERIFY( reloaded.load() );
+  QCOMPARE( reloaded.corruptRecords(), 1 );
+  QVERIFY( reloaded.secret( "QGIS", "c" ).isNull() );
+  QCOMPARE( reloaded.secret( "QGIS", "a" ), QString( "second" ) );
+  QVERIFY( reloaded.setSecret( "QGIS", "c", "third" ) );
+
+  // Compaction keeps the live records only
+  qint64 size = QFileInfo( fileName ).size();
+  for ( int i = 0; i < 10; ++i )
+  {
+    QVERIFY( reloaded.setSecret( "QGIS", "a", QString::number( i ) ) );
+  }
+  QVERIFY( reloaded.compact() );
+  QVERIFY( QFileInfo( fileName ).size() < size );
+  QCOMPARE( reloaded.secret( "QGIS", "a" ), QString( "9" ) );
+  QCOMPARE( reloaded.secret( "QGIS", "c" ), QString( "third" ) );
+
+  // Another instance on the same file: neither overwrites the other
+  {
+    KeyChainBridgeSecretCache other( fileName, "user\nmachine" );
+    QVERIFY( other.load() );
+    QVERIFY( other.setSecret( "QGIS", "d", "fourth" ) );
+    QVERIFY( reloaded.setSecret( "QGIS", "e", "fifth" ) );
+    QVERIFY( other.load() );
+    QCOMPARE( other.secret( "QGIS", "d" ), QString( "fourth" ) );
+    QCOMPARE( other.secret( "QGIS", "e" ), QString( "fifth" ) );
+  }
+
+  QVERIFY( reloaded.clear() );
+  QVERIFY( ! QFile::exists( fileName ) );
+}
+
+void TestKeychainBridgePlugin::testCacheBackend()
+{
+  if ( ! KeyChainBridgeSecretCache::isSupported() )
+    QSKIP( "QCA lacks the secret cache algorithms, skipping test", SkipSingle );
+  QString fileName( QDir::tempPath() + "/keychainbridge_test_backend.cache" );
+  QFile::remove( fileName );
+  KeyChainBridgeSecretCache *cache = new KeyChainBridgeSecretCache( fileName, "user\nmachine" );
+  KeyChainBridgeMockBackend *backend = new KeyChainBridgeMockBackend();
+  KeyChainBridgeCacheBackend *cacheBackend = new KeyChainBridgeCacheBackend( cache, backend, KeyChainBridgeCacheBackend::Fallback );
+  cacheBackend->setFallbackDelay( 50 );
+  KeyChainBridgeWallet wallet( "QGIS", cacheBackend );
+  wallet.retryScheduler()->setMaxRetries( 0 );
+  JobRecorder recorder;
+
+  // Written through
+  wallet.writePassword( "key", "secret", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 1 ) );
+  QCOMPARE( recorder.error, QKeychain::NoError );
+  QCOMPARE( backend->secret( "QGIS", "key" ), QString( "secret" ) );
+  QCOMPARE( cache->secret( "QGIS", "key" ), QString( "secret" ) );
+
+  // The wallet is gone
+  backend->injectError( QKeychain::NoBackendAvailable );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 2 ) );
+  QCOMPARE( recorder.error, QKeychain::NoError );
+  QCOMPARE( recorder.textData, QString( "secret" ) );
+  QCOMPARE( cacheBackend->fallbackCount(), 1 );
+
+  // Writes report what the wallet did
+  backend->injectError( QKeychain::NoBackendAvailable );
+  wallet.writePassword( "key", "other", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 3 ) );
+  QCOMPARE( recorder.error, QKeychain::NoBackendAvailable );
+  QCOMPARE( cache->secret( "QGIS", "key" ), QString( "secret" ) );
+  QCOMPARE( cacheBackend->fallbackCount(), 1 );
+
+  // The user said no: not bypassed
+  backend->injectError( QKeychain::AccessDeniedByUser );
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 4 ) );
+  QCOMPARE( recorder.error, QKeychain::AccessDeniedByUser );
+
+  // The wallet is slow
+  backend->setLatency( 1000 );
+  QTime t;
+  t.start();
+  wallet.readPassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 5 ) );
+  QVERIFY( t.elapsed() < 500 );
+  QCOMPARE( recorder.error, QKeychain::NoError );
+  QCOMPARE( recorder.textData, QString( "secret" ) );
+  QCOMPARE( cacheBackend->fallbackCount(), 2 );
+  backend->setLatency( 0 );
+  QTest::qWait( 1100 );
+
+  // Deleted from both
+  wallet.deletePassword( "key", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 6 ) );
+  QCOMPARE( recorder.error, QKeychain::NoError );
+  QVERIFY( ! cache->contains( "QGIS", "key" ) );
+  QFile::remove( fileName );
+}
+
+void TestKeychainBridgePlugin::testNotifier()
+{
+  QgsMessageBar bar;
+  KeyChainBridgeNotifier notifier( &bar );
+  notifier.setBatchDelay( 10 );
+  QSignalSpy spy( &notifier, SIGNAL( promptAccepted() ) );
+
+  // Repeated messages end up in a single bar item
+  for ( int i = 0; i < 5; ++i )
+  {
+    notifier.notify( KeyChainBridgeNotifier::Info, "title", "unlocked" );
+  }
+  QTest::qWait( 50 );
+  QCOMPARE( notifier.pushedCount(), 1 );
+  QCOMPARE( notifier.droppedCount(), 4 );
+  notifier.notify( KeyChainBridgeNotifier::Info, "title", "unlocked" );
+  QCOMPARE( notifier.droppedCount(), 5 );
+
+  // A batch of messages of a kind is a single update
+  notifier.notify( KeyChainBridgeNotifier::Info, "title", "stored" );
+  notifier.notify( KeyChainBridgeNotifier::Info, "title", "removed" );
+  notifier.notify( KeyChainBridgeNotifier::Warning, "title", "not valid" );
+  QTest::qWait( 50 );
+  QCOMPARE( notifier.pushedCount(), 2 );
+  QCOMPARE( notifier.updatedCount(), 1 );
+
+  // The prompt widget is reused
+  notifier.prompt( "store it?", "Store" );
+  notifier.flush();
+  notifier.prompt( "update it?", "Store" );
+  notifier.flush();
+  notifier.prompt( "update it?", "Store" );
+  QCOMPARE( notifier.pushedCount(), 3 );
+  QCOMPARE( notifier.updatedCount(), 2 );
+  QPushButton *button = bar.findChild<QPushButton*>();
+  QVERIFY( button );
+  button->click();
+  QCOMPARE( spy.count(), 1 );
+
+  // Without a bar nothing is kept
+  notifier.setMessageBar( nullptr );
+  notifier.notify( KeyChainBridgeNotifier::Critical, "title", "error" );
+  notifier.flush();
+  QCOMPARE( notifier.pushedCount(), 3 );
+}
+
+void TestKeychainBridgePlugin::testTrace()
+{
+  KeyChainBridgeTrace *trace = KeyChainBridgeTrace::instance();
+  trace->setCapacity( 4 );
+  QCOMPARE( trace->size(), 0 );
+
+  // Wallet operations are traced, the secret is not
+  KeyChainBridgeMockBackend *backend = new KeyChainBridgeMockBackend();
+  KeyChainBridgeWallet wallet( "QGIS", backend );
+  JobRecorder recorder;
+  wallet.writePassword( "key", "not-in-the-trace", &recorder, SLOT( record( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( recorder.wait( 1 ) );
+  QList<KeyChainBridgeTrace::Record> records( trace->records() );
+  QCOMPARE( records.size(), 2 );
+  QCOMPARE( records.at( 0 ).event, KeyChainBridgeTrace::WalletStarted );
+  QCOMPARE( records.at( 1 ).event, KeyChainBridgeTrace::WalletFinished );
+  QCOMPARE( records.at( 1 ).operation, int( KeyChainBridgeWalletJob::Write ) );
+  QCOMPARE( records.at( 1 ).code, int( QKeychain::NoError ) );
+  QVERIFY( records.at( 1 ).usecs >= 0 );
+  QVERIFY( records.at( 1 ).sequence == records.at( 0 ).sequence + 1 );
+
+  // Bounded: the oldest events are dropped
+  for ( int i = 0; i < 5; ++i )
+  {
+    trace->record( KeyChainBridgeTrace::DirtyChanged, i % 2 );
+  }
+  records = trace->records();
+  QCOMPARE( records.size(), 4 );
+  QCOMPARE( records.last().event, KeyChainBridgeTrace::DirtyChanged );
+
+  // Flushed once, as JSON lines
+  QString fileName( QDir::tempPath() + "/keychainbridge_test_trace.jsonl" );
+  QFile::remove( fileName );
+  QVERIFY( trace->flush( fileName ) );
+  trace->record( KeyChainBridgeTrace::Verified, 1 );
+  QVERIFY( trace->flush( fileName ) );
+  QFile file( fileName );
+  QVERIFY( file.open( QIODevice::ReadOnly ) );
+  QList<QByteArray> lines( file.readAll().split( '\n' ) );
+  file.close();
+  QCOMPARE( lines.size(), 6 );
+  QVERIFY( lines.last().isEmpty() );
+  QVERIFY( lines.at( 0 ).startsWith( "{\"seq\":" ) );
+  QVERIFY( lines.at( 0 ).endsWith( "}" ) );
+  QVERIFY( lines.at( 0 ).contains( "\"event\":\"dirty_changed\"" ) );
+  QVERIFY( lines.at( 4 ).contains( "\"event\":\"verified\",\"code\":1" ) );
+  QVERIFY( ! lines.join( "\n" ).contains( "not-in-the-trace" ) );
+  QFile::remove( fileName );
+  trace->setCapacity( KeyChainBridgeTrace::DEFAULT_CAPACITY );
+}
+
+void TestKeychainBridgePlugin::testSecret()
+{
+  int allocations = KeyChainBridgeSecret::allocations();
+  KeyChainBridgeSecret empty;
+  QVERIFY( empty.isEmpty() );
+  QVERIFY( empty.equals( QString( "" ) ) );
+  QCOMPARE( KeyChainBridgeSecret::allocations(), allocations );
+
+  KeyChainBridgeSecret secret( QString( "password" ) );
+  QCOMPARE( KeyChainBridgeSecret::allocations(), allocations + 1 );
+  QCOMPARE( secret.size(), 8 );
+  QVERIFY( secret.equals( "password" ) );
+  QVERIFY( ! secret.equals( "passwore" ) );
+  QVERIFY( ! secret.equals( "pass" ) );
+  QCOMPARE( secret.toString(), QString( "password" ) );
+
+  // Swapped or moved, not copied
+  const QChar *data = secret.constData();
+  KeyChainBridgeSecret swapped;
+  swapped.swap( secret );
+  QVERIFY( secret.isEmpty() );
+  QVERIFY( swapped.constData() == data );
+#ifdef Q_COMPILER_RVALUE_REFS
+  KeyChainBridgeSecret moved( std::move( swapped ) );
+  QVERIFY( swapped.isEmpty() );
+  QVERIFY( moved.constData() == data );
+  secret = std::move( moved );
+  QVERIFY( moved.isEmpty() );
+#else
+  secret.swap( swapped );
+#endif
+  QVERIFY( secret.constData() == data );
+  QCOMPARE( KeyChainBridgeSecret::allocations(), allocations + 1 );
+
+  // Replaced in place while it fits
+  int capacity = secret.capacity();
+  for ( int i = 0; i < 1000; ++i )
+  {
+    secret.assign( QString( "password%1" ).arg( i ) );
+  }
+  QVERIFY( secret.equals( "password999" ) );
+  QVERIFY( secret.constData() == data );
+  QCOMPARE( secret.capacity(), capacity );
+  QCOMPARE( KeyChainBridgeSecret::allocations(), allocations + 1 );
+
+  // What is left of the previous secret is wiped
+  secret.assign( QString( "p" ) );
+  QCOMPARE( data[1].unicode(), static_cast<ushort>( 0 ) );
+  QCOMPARE( data[10].unicode(), static_cast<ushort>( 0 ) );
+  secret.clear();
+  QVERIFY( secret.isEmpty() );
+  QCOMPARE( data[0].unicode(), static_cast<ushort>( 0 ) );
+  QCOMPARE( secret.capacity(), capacity );
+
+  // Copies are explicit
+  secret.assign( QString( "password" ) );
+  KeyChainBridgeSecret copy;
+  copy.assign( secret );
+  QVERIFY( copy == secret );
+  QVERIFY( copy.constData() != secret.constData() );
+  QCOMPARE( KeyChainBridgeSecret::allocations(), allocations + 2 );
+  copy.release();
+  QVERIFY( copy.isEmpty() );
+  QCOMPARE( copy.capacity(), 0 );
+
+  // Larger than a chunk
+  QString text( 5000, QChar( 'x' ) );
+  KeyChainBridgeSecret large( text );
+  QVERIFY( large.equals( text ) );
+  QVERIFY( large != secret );
+  large.release();
+
+  // A QString shared with another one is only cleared
+  text = "password";
+  QString shared( text );
+  KeyChainBridgeSecret::wipe( text );
+  QVERIFY( text.isEmpty() );
+  QCOMPARE( shared, QString( "password" ) );
+  KeyChainBridgeSecret::wipe( shared );
+  QVERIFY( shared.isEmpty() );
+
+  if ( ! KeyChainBridgeSecret::isLocked() )
+  {
+    QWARN( "Secret memory could not be locked (RLIMIT_MEMLOCK?)" );
+  }
+}
+
+void TestKeychainBridgePlugin::testCredentialsExpiry()
+{
+  KeyChainBridgeCredentials credentials( mCredentialDialog );
+  QSignalSpy expired( &credentials, SIGNAL( masterPasswordExpired() ) );
+  KeyChainBridgeSecret password( QString( "password" ) );
+  QString served;
+
+  // Served from memory within the time to live
+  credentials.setTimeToLive( 300 );
+  credentials.setMasterPassword( password );
+  QVERIFY( credentials.hasMasterPassword() );
+  QVERIFY( credentials.getMasterPassword( served, true ) );
+  QCOMPARE( served, QString( "password" ) );
+  QTest::qWait( 500 );
+  QCOMPARE( expired.count(), 1 );
+  QVERIFY( ! credentials.hasMasterPassword() );
+
+  // Kept as long as it is used within the idle timeout
+  credentials.setTimeToLive( 0 );
+  credentials.setIdleTimeout( 400 );
+  credentials.setMasterPassword( password );
+  for ( int i = 0; i < 6; ++i )
+  {
+    QTest::qWait( 100 );
+    QVERIFY( credentials.hasMasterPassword() );
+    QVERIFY( credentials.getMasterPassword( served, true ) );
+  }
+  QCOMPARE( expired.count(), 1 );
+  QTest::qWait( 600 );
+  QCOMPARE( expired.count(), 2 );
+  QVERIFY( ! credentials.hasMasterPassword() );
+
+  // Never expires, until cleared
+  credentials.setIdleTimeout( 0 );
+  credentials.setMasterPassword( password );
+  QTest::qWait( 100 );
+  QVERIFY( credentials.hasMasterPassword() );
+  credentials.clearMasterPassword();
+  QVERIFY( ! credentials.hasMasterPassword() );
+  QCOMPARE( expired.count(), 2 );
+}
+
+void TestKeychainBridgePlugin::benchmarkLegacyDialogFilter()
+{
+  LegacyDialogFilter filter;
+  QEvent paint( QEvent::Paint );
+  QBENCHMARK
+  {
+    filter.eventFilter( mCredentialDialog, &paint );
+  }
+}
+
+void TestKeychainBridgePlugin::benchmarkDialogFilter()
+{
+  KeyChainBridgeDialogFilter filter( mCredentialDialog );
+  QEvent paint( QEvent::Paint );
+  QBENCHMARK
+  {
+    filter.eventFilter( mCredentialDialog, &paint );
+  }
+}
+
 QTEST_MAIN( TestKeychainBridgePlugin )
 #include "testkeychainbridgeplugin.moc"
@@ -0,0 +1,512 @@
+/***************************************************************************
+     testkeychainbridgesecretservice.cpp
+     ----------------------
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <QtTest/QtTest>
+#include <QCoreApplication>
+#include <QDBusConnection>
+#include <QDBusContext>
+#include <QDBusVariant>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QMap>
+#include <QObject>
+#include <QProcess>
+#include <QString>
+#include <QStringList>
+#include <QTextStream>
+#include <QTimer>
+#include <QVector>
+
+#include "testutils.h"
+#include "keychainbridgesecretservice.h"
+#include "keychainbridgewallet.h"
+
+
+static const QString COLLECTION_PATH( "/org/freedesktop/secrets/collection/login" );
+
+bool operator==( const KeyChainBridgeSecretAttributes &a, const KeyChainBridgeSecretAttributes &b )
+{
+  return a.attributes == b.attributes;
+}
+
+/**
+ * Storage shared by the stand-in Secret Service objects
+ */
+struct StandInStore
+{
+  StandInStore() : openSessions( 0 ), nextId( 0 ), confirmWrites( false ), dismissPrompts( false ) {}
+
+  //! Store \a value under \a attributes, replacing the item with the same ones if \a replace
+  QString store( QDBusConnection connection, QObject *parent, const KeyChainBridgeSecretAttributes &itemAttributes,
+                 const QByteArray &value, bool replace );
+
+  QStringList sessions;
+  QMap<QString, KeyChainBridgeSecretAttributes> attributes;
+  QMap<QString, QByteArray> values;
+  int openSessions;
+  int nextId;
+  //! CreateItem returns a prompt, that stores the item when completed
+  bool confirmWrites;
+  //! Prompts are dismissed by the "user"
+  bool dismissPrompts;
+};
+
+/**
+ * A stored item of the stand-in Secret Service
+ */
+class StandInItem : public QObject, protected QDBusContext
+{
+    Q_OBJECT
+    Q_CLASSINFO( "D-Bus Interface", "org.freedesktop.Secret.Item" )
+  public:
+    StandInItem( StandInStore *store, const QString &path, QObject *parent )
+        : QObject( parent ), mStore( store ), mPath( path ) {}
+
+  public slots:
+    QDBusObjectPath Delete()
+    {
+      mStore->attributes.remove( mPath );
+      mStore->values.remove( mPath );
+      connection().unregisterObject( mPath );
+      deleteLater();
+      return QDBusObjectPath( "/" );
+    }
+
+  private:
+    StandInStore *mStore;
+    QString mPath;
+};
+
+QString StandInStore::store( QDBusConnection connection, QObject *parent, const KeyChainBridgeSecretAttributes &itemAttributes,
+                             const QByteArray &value, bool replace )
+{
+  QString path;
+  if ( replace )
+  {
+    path = attributes.key( itemAttributes );
+  }
+  if ( path.isEmpty() )
+  {
+    path = QString( "%1/%2" ).arg( COLLECTION_PATH ).arg( ++nextId );
+    connection.registerObject( path, new StandInItem( this, path, parent ), QDBusConnection::ExportAllSlots );
+  }
+  attributes.insert( path, itemAttributes );
+  values.insert( path, value );
+  return path;
+}
+
+/**
+ * A confirmation prompt of the stand-in Secret Service
+ */
+class StandInPrompt : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO( "D-Bus Interface", "org.freedesktop.Secret.Prompt" )
+  public:
+    StandInPrompt( StandInStore *store, QDBusConnection connection, const QString &path,
+                   const KeyChainBridgeSecretAttributes &attributes, const QByteArray &value, bool replace, QObject *parent )
+        : QObject( parent ), mStore( store ), mConnection( connection ), mPath( path )
+        , mAttributes( attributes ), mValue( value ), mReplace( replace ) {}
+
+  public slots:
+    void Prompt( const QString &windowId )
+    {
+      Q_UNUSED( windowId );
+      // The "user" answers later
+      QTimer::singleShot( 0, this, SLOT( answer() ) );
+    }
+
+  signals:
+    void Completed( bool dismissed, const QDBusVariant &result );
+
+  private slots:
+    void answer()
+    {
+      bool dismissed = mStore->dismissPrompts;
+      QString item( "/" );
+      if ( ! dismissed )
+      {
+        item = mStore->store( mConnection, parent(), mAttributes, mValue, mReplace );
+      }
+      emit Completed( dismissed, QDBusVariant( QVariant::fromValue( QDBusObjectPath( item ) ) ) );
+      mConnection.unregisterObject( mPath );
+      deleteLater();
+    }
+
+  private:
+    StandInStore *mStore;
+    QDBusConnection mConnection;
+    QString mPath;
+    KeyChainBridgeSecretAttributes mAttributes;
+    QByteArray mValue;
+    bool mReplace;
+};
+
+/**
+ * The default collection of the stand-in Secret Service
+ */
+class StandInCollection : public QObject, protected QDBusContext
+{
+    Q_OBJECT
+    Q_CLASSINFO( "D-Bus Interface", "org.freedesktop.Secret.Collection" )
+  public:
+    StandInCollection( StandInStore *store, QObject *parent ) : QObject( parent ), mStore( store ) {}
+
+  public slots:
+    KeyChainBridgeObjectPathList SearchItems( const KeyChainBridgeSecretAttributes &attributes )
+    {
+      KeyChainBridgeObjectPathList result;
+      QMap<QString, KeyChainBridgeSecretAttributes>::const_iterator it = mStore->attributes.constBegin();
+      for ( ; it != mStore->attributes.constEnd(); ++it )
+      {
+        if ( matches( it.value(), attributes ) )
+        {
+          result.paths << QDBusObjectPath( it.key() );
+        }
+      }
+      return result;
+    }
+
+    QDBusObjectPath CreateItem( const QVariantMap &properties, const KeyChainBridgeDBusSecret &secret, bool replace, QDBusObjectPath &prompt )
+    {
+      prompt = QDBusObjectPath( "/" );
+      if ( ! mStore->sessions.contains( secret.session.path() ) )
+      {
+        sendErrorReply( "org.freedesktop.Secret.Error.NoSession", "No such session" );
+        return QDBusObjectPath( "/" );
+      }
+      KeyChainBridgeSecretAttributes attributes = qdbus_cast<KeyChainBridgeSecretAttributes>( properties.value( "org.freedesktop.Secret.Item.Attributes" ) );
+      if ( mStore->confirmWrites )
+      {
+        QString path( QString( "/org/freedesktop/secrets/prompt/%1" ).arg( ++mStore->nextId ) );
+        connection().registerObject( path, new StandInPrompt( mStore, connection(), path, attributes, secret.value, replace, this ),
+                                     QDBusConnection::ExportAllSlots | QDBusConnection::ExportAllSignals );
+        prompt = QDBusObjectPath( path );
+        return QDBusObjectPath( "/" );
+      }
+      return QDBusObjectPath( mStore->store( connection(), this, attributes, secret.value, replace ) );
+    }
+
+  private:
+    static bool matches( const KeyChainBridgeSecretAttributes &item, const KeyChainBridgeSecretAttributes &lookup )
+    {
+      QMap<QString, QString>::const_iterator it = lookup.attributes.constBegin();
+      for ( ; it != lookup.attributes.constEnd(); ++it )
+      {
+        if ( item.attributes.value( it.key() ) != it.value() )
+        {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    StandInStore *mStore;
+};
+
+/**
+ * The service object of the stand-in Secret Service
+ */
+class StandInSecretService : public QObject, protected QDBusContext
+{
+    Q_OBJECT
+    Q_CLASSINFO( "D-Bus Interface", "org.freedesktop.Secret.Service" )
+  public:
+    explicit StandInSecretService( StandInStore *store, QObject *parent = nullptr ) : QObject( parent ), mStore( store ) {}
+
+  public slots:
+    QDBusVariant OpenSession( const QString &algorithm, const QDBusVariant &input, QDBusObjectPath &result )
+    {
+      Q_UNUSED( input );
+      if ( algorithm != "plain" )
+      {
+        sendErrorReply( "org.freedesktop.DBus.Error.NotSupported", "Algorithm not supported" );
+        return QDBusVariant( QString() );
+      }
+      ++mStore->openSessions;
+      QString path( QString( "/org/freedesktop/secrets/session/%1" ).arg( ++mStore->nextId ) );
+      mStore->sessions << path;
+      result = QDBusObjectPath( path );
+      return QDBusVariant( QString() );
+    }
+
+    QDBusObjectPath ReadAlias( const QString &name )
+    {
+      return QDBusObjectPath( name == "default" ? COLLECTION_PATH : QString( "/" ) );
+    }
+
+    KeyChainBridgeObjectPathList Unlock( const KeyChainBridgeObjectPathList &objects, QDBusObjectPath &prompt )
+    {
+      prompt = QDBusObjectPath( "/" );
+      return objects;
+    }
+
+    KeyChainBridgeSecretMap GetSecrets( const KeyChainBridgeObjectPathList &items, const QDBusObjectPath &session )
+    {
+      KeyChainBridgeSecretMap result;
+      if ( ! mStore->sessions.contains( session.path() ) )
+      {
+        sendErrorReply( "org.freedesktop.Secret.Error.NoSession", "No such session" );
+        return result;
+      }
+      Q_FOREACH ( const QDBusObjectPath &item, items.paths )
+      {
+        if ( mStore->values.contains( item.path() ) )
+        {
+          KeyChainBridgeDBusSecret secret;
+          secret.session = session;
+          secret.value = mStore->values.value( item.path() );
+          secret.contentType = "text/plain";
+          result.secrets << qMakePair( item, secret );
+        }
+      }
+      return result;
+    }
+
+  private:
+    StandInStore *mStore;
+};
+
+/**
+ * Waits for a wallet job and keeps its outcome
+ */
+class JobWaiter : public QObject
+{
+    Q_OBJECT
+  public:
+    JobWaiter() : error( QKeychain::NoError ), done( false ) {}
+
+    //! Run the event loop until the job is finished, false on timeout
+    bool wait()
+    {
+      if ( ! done )
+      {
+        QTimer::singleShot( 5000, &loop, SLOT( quit() ) );
+        loop.exec();
+      }
+      return done;
+    }
+
+    QKeychain::Error error;
+    QString textData;
+    bool done;
+    QEventLoop loop;
+
+  public slots:
+    void jobFinished( KeyChainBridgeWalletJob *job )
+    {
+      error = job->error();
+      textData = job->textData();
+      done = true;
+      loop.quit();
+    }
+};
+
+/** \ingroup UnitTests
+ * Integration test of the Secret Service backend against a stand-in
+ * service on a private dbus-daemon: no desktop session nor real keyring
+ * is needed. The per-operation latency is printed, the number of
+ * iterations can be set with KEYCHAINBRIDGE_BENCH_ITERATIONS.
+ */
+class TestKeychainBridgeSecretService: public QObject
+{
+    Q_OBJECT
+
+  private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void testWriteReadDelete();
+    void testReconnect();
+    void testPrompt();
+    void benchmarkLatency();
+
+  private:
+
+    KeyChainBridgeWalletJob *write( const QString &key, const QString &value, JobWaiter *waiter );
+    KeyChainBridgeWalletJob *read( const QString &key, JobWaiter *waiter );
+
+    QProcess mDaemon;
+    StandInStore mStore;
+    KeyChainBridgeWallet *mWallet;
+    KeyChainBridgeSecretServiceBackend *mBackend;
+};
+
+void TestKeychainBridgeSecretService::initTestCase()
+{
+  mWallet = nullptr;
+  mDaemon.start( "dbus-daemon", QStringList() << "--session" << "--nofork" << "--print-address" );
+  if ( ! mDaemon.waitForStarted() || ! mDaemon.waitForReadyRead( 5000 ) )
+    QSKIP( "dbus-daemon is not available, skipping test case", SkipAll );
+  QString address( QString::fromLocal8Bit( mDaemon.readLine() ).trimmed() );
+  QVERIFY( ! address.isEmpty() );
+
+  KeyChainBridgeSecretServiceBackend::registerTypes();
+
+  // Server and client on separate connections, as in real life
+  QDBusConnection server( QDBusConnection::connectToBus( address, "keychainbridge-test-server" ) );
+  QVERIFY( server.isConnected() );
+  QVERIFY( server.registerObject( "/org/freedesktop/secrets", new StandInSecretService( &mStore, this ), QDBusConnection::ExportAllSlots ) );
+  QVERIFY( server.registerObject( COLLECTION_PATH, new StandInCollection( &mStore, this ), QDBusConnection::ExportAllSlots ) );
+  QVERIFY( server.registerService( KeyChainBridgeSecretServiceBackend::SERVICE_NAME ) );
+
+  QDBusConnection client( QDBusConnection::connectToBus( address, "keychainbridge-test-client" ) );
+  QVERIFY( client.isConnected() );
+  mBackend = new KeyChainBridgeSecretServiceBackend( client );
+  mWallet = new KeyChainBridgeWallet( "QGIS", mBackend );
+}
+
+void TestKeychainBridgeSecretService::cleanupTestCase()
+{
+  delete mWallet;
+  QDBusConnection::disconnectFromBus( "keychainbridge-test-client" );
+  QDBusConnection::disconnectFromBus( "keychainbridge-test-server" );
+  mDaemon.kill();
+  mDaemon.waitForFinished();
+}
+
+KeyChainBridgeWalletJob *TestKeychainBridgeSecretService::write( const QString &key, const QString &value, JobWaiter *waiter )
+{
+  return mWallet->writePassword( key, value, waiter, SLOT( jobFinished( KeyChainBridgeWalletJob* ) ) );
+}
+
+KeyChainBridgeWalletJob *TestKeychainBridgeSecretService::read( const QString &key, JobWaiter *waiter )
+{
+  return mWallet->readPassword( key, waiter, SLOT( jobFinished( KeyChainBridgeWalletJob* ) ) );
+}
+
+void TestKeychainBridgeSecretService::testWriteReadDelete()
+{
+  JobWaiter written;
+  write( "QGIS-Master-Password", QString::fromUtf8( "pàss" ), &written );
+  QVERIFY( written.wait() );
+  QCOMPARE( written.error, QKeychain::NoError );
+  // Stored with the attributes QtKeychain looks up
+  QCOMPARE( mStore.attributes.size(), 1 );
+  QCOMPARE( mStore.attributes.values().first().attributes.value( "user" ), QString( "QGIS-Master-Password" ) );
+  QCOMPARE( mStore.attributes.values().first().attributes.value( "server" ), QString( "QGIS" ) );
+
+  JobWaiter overwritten;
+  write( "QGIS-Master-Password", "pass", &overwritten );
+  QVERIFY( overwritten.wait() );
+  QCOMPARE( overwritten.error, QKeychain::NoError );
+  QCOMPARE( mStore.attributes.size(), 1 );
+
+  JobWaiter readBack;
+  read( "QGIS-Master-Password", &readBack );
+  QVERIFY( readBack.wait() );
+  QCOMPARE( readBack.error, QKeychain::NoError );
+  QCOMPARE( readBack.textData, QString( "pass" ) );
+
+  JobWaiter deleted;
+  mWallet->deletePassword( "QGIS-Master-Password", &deleted, SLOT( jobFinished( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( deleted.wait() );
+  QCOMPARE( deleted.error, QKeychain::NoError );
+  QVERIFY( mStore.values.isEmpty() );
+
+  JobWaiter missing;
+  read( "QGIS-Master-Password", &missing );
+  QVERIFY( missing.wait() );
+  QCOMPARE( missing.error, QKeychain::EntryNotFound );
+
+  // One handshake for all of the above
+  QCOMPARE( mBackend->sessionCount(), 1 );
+  QCOMPARE( mStore.openSessions, 1 );
+  QVERIFY( mBackend->isConnected() );
+}
+
+void TestKeychainBridgeSecretService::testReconnect()
+{
+  JobWaiter written;
+  write( "QGIS-Master-Password", "pass", &written );
+  QVERIFY( written.wait() );
+  QCOMPARE( written.error, QKeychain::NoError );
+
+  // The service forgets our session, e.g. it has been restarted
+  int sessions = mBackend->sessionCount();
+  mStore.sessions.clear();
+
+  JobWaiter readBack;
+  read( "QGIS-Master-Password", &readBack );
+  QVERIFY( readBack.wait() );
+  QCOMPARE( readBack.error, QKeychain::NoError );
+  QCOMPARE( readBack.textData, QString( "pass" ) );
+  QCOMPARE( mBackend->sessionCount(), sessions + 1 );
+}
+
+void TestKeychainBridgeSecretService::testPrompt()
+{
+  mStore.confirmWrites = true;
+
+  // Stored once the user has confirmed
+  JobWaiter confirmed;
+  write( "QGIS-Prompted", "secret", &confirmed );
+  QVERIFY( confirmed.wait() );
+  QCOMPARE( confirmed.error, QKeychain::NoError );
+  JobWaiter readBack;
+  read( "QGIS-Prompted", &readBack );
+  QVERIFY( readBack.wait() );
+  QCOMPARE( readBack.textData, QString( "secret" ) );
+
+  // Not stored if the user said no
+  mStore.dismissPrompts = true;
+  JobWaiter dismissed;
+  write( "QGIS-Dismissed", "secret", &dismissed );
+  QVERIFY( dismissed.wait() );
+  QCOMPARE( dismissed.error, QKeychain::AccessDeniedByUser );
+  JobWaiter missing;
+  read( "QGIS-Dismissed", &missing );
+  QVERIFY( missing.wait() );
+  QCOMPARE( missing.error, QKeychain::EntryNotFound );
+
+  mStore.confirmWrites = false;
+  mStore.dismissPrompts = false;
+  JobWaiter deleted;
+  mWallet->deletePassword( "QGIS-Prompted", &deleted, SLOT( jobFinished( KeyChainBridgeWalletJob* ) ) );
+  QVERIFY( deleted.wait() );
+  QCOMPARE( deleted.error, QKeychain::NoError );
+}
+
+void TestKeychainBridgeSecretService::benchmarkLatency()
+{
+  int iterations = qgetenv( "KEYCHAINBRIDGE_BENCH_ITERATIONS" ).toInt();
+  if ( iterations <= 0 )
+  {
+    iterations = 200;
+  }
+  int sessions = mBackend->sessionCount();
+  QVector<qint64> samples;
+  samples.reserve( iterations );
+  for ( int i = 0; i < iterations; ++i )
+  {
+    JobWaiter waiter;
+    QElapsedTimer timer;
+    timer.start();
+    read( "QGIS-Master-Password", &waiter );
+    QVERIFY( waiter.wait() );
+    samples.append( timer.nsecsElapsed() );
+    QCOMPARE( waiter.error, QKeychain::NoError );
+  }
+  // The session is reused by every operation
+  QCOMPARE( mBackend->sessionCount(), sessions );
+
+  printLatency( "Secret Service read", samples );
+}
+
+int main( int argc, char *argv[] )
+{
+  QCoreApplication app( argc, argv );
+  TestKeychainBridgeSecretService tc;
+  return QTest::qExec( &tc, argc, argv );
+}
+
+#include "testkeychainbridgesecretservice.moc"
@@ -3,10 +3,32 @@
 
 #include <QString>
 #include <QFile>
+#include <QTextStream>
+#include <QVector>
 
 #include "qgsconfig.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+
+inline QTextStream& qStdout()
+{
+  static QTextStream r( stdout );
+  return r;
+}
+
+//! Print the p50 and p99 of latency samples in nanoseconds, returns the p99 in ms
+inline double printLatency( const QString &label, QVector<qint64> samples )
+{
+  std::sort( samples.begin(), samples.end() );
+  double p50 = samples.at( samples.size() / 2 ) / 1000000.0;
+  double p99 = samples.at( qMin( samples.size() - 1, ( samples.size() * 99 ) / 100 ) ) / 1000000.0;
+  qStdout() << QString( "%1: %2 iterations, p50 %3 ms, p99 %4 ms\n" )
+  .arg( label ).arg( samples.size() ).arg( p50, 0, 'f', 3 ).arg( p99, 0, 'f', 3 );
+  qStdout().flush();
+  return p99;
+}
 
 inline void setPrefixEnviron()
 {